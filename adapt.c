@@ -0,0 +1,134 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "adapt.h"
+#include "tx_alsalib.h"
+
+/* Loss (percent) at which to back off, and the most FEC to add */
+
+#define LOSS_HIGH 2
+#define LOSS_MAX 25
+
+extern unsigned int verbose;
+
+struct adapt* adapt_new(unsigned int nr_peers,
+		unsigned int min_kbps, unsigned int max_kbps,
+		unsigned int min_loss)
+{
+	struct adapt *a;
+
+	a = malloc(sizeof *a);
+	if (a == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+
+	a->peer = calloc(nr_peers, sizeof *a->peer);
+	if (a->peer == NULL) {
+		perror("calloc");
+		free(a);
+		return NULL;
+	}
+	a->nr_peers = nr_peers;
+
+	a->min_kbps = min_kbps < max_kbps ? min_kbps : max_kbps;
+	a->max_kbps = a->kbps = max_kbps;
+	a->min_loss = a->loss = min_loss;
+
+	return a;
+}
+
+void adapt_free(struct adapt *a)
+{
+	free(a->peer);
+	free(a);
+}
+
+static int set_bitrate(OpusMSEncoder *encoder, unsigned int kbps)
+{
+	int r;
+
+	r = opus_multistream_encoder_ctl(encoder, OPUS_SET_BITRATE(kbps * 1024));
+	if (r != OPUS_OK) {
+		fprintf(stderr, "OPUS_SET_BITRATE: %s\n", opus_strerror(r));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start the encoder at the highest bitrate; the packet size limit
+ * (bytes_per_frame) stays at that rate throughout
+ */
+
+int adapt_start(struct adapt *a, OpusMSEncoder *encoder)
+{
+	return set_bitrate(encoder, a->kbps);
+}
+
+/*
+ * Called from the sending thread after each frame; does nothing
+ * until a peer has reported since last time
+ */
+
+int adapt_frame(struct adapt *a, OpusMSEncoder *encoder)
+{
+	unsigned int n, worst = 0, kbps, loss;
+	bool fresh = false;
+
+	for (n = 0; n < a->nr_peers; n++) {
+		struct adapt_peer *p = &a->peer[n];
+		unsigned int reports, fraction;
+
+		reports = atomic_load_explicit(&p->reports, memory_order_acquire);
+		if (reports == p->seen)
+			continue;
+		p->seen = reports;
+		fresh = true;
+
+		fraction = atomic_load_explicit(&p->fraction,
+				memory_order_relaxed);
+		if (fraction > worst)
+			worst = fraction;
+	}
+
+	if (!fresh)
+		return 0;
+
+	worst = worst * 100 / 256;
+
+	kbps = a->kbps;
+	if (worst >= LOSS_HIGH)
+		kbps = kbps * 3 / 4;
+	else if (worst == 0)
+		kbps += a->max_kbps / 16;
+
+	if (kbps < a->min_kbps)
+		kbps = a->min_kbps;
+	if (kbps > a->max_kbps)
+		kbps = a->max_kbps;
+
+	loss = worst < LOSS_MAX ? worst : LOSS_MAX;
+	if (loss < a->min_loss)
+		loss = a->min_loss;
+
+	if (kbps == a->kbps && loss == a->loss)
+		return 0;
+
+	if (kbps != a->kbps && set_bitrate(encoder, kbps) == -1)
+		return -1;
+	if (loss != a->loss && set_opus_fec(encoder, loss) == -1)
+		return -1;
+
+	a->kbps = kbps;
+	a->loss = loss;
+
+	if (verbose > 0) {
+		fprintf(stderr, "Worst loss %u%%, now %ukbps with FEC for %u%%\n",
+				worst, kbps, loss);
+	}
+
+	return 0;
+}
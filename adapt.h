@@ -0,0 +1,51 @@
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include <stdatomic.h>
+#include <opus/opus_multistream.h>
+
+/*
+ * Adaptive bitrate, driven by the loss our peers see
+ *
+ * Receivers record the fraction lost from each RTCP report about
+ * our stream (adapt_report); the sender applies the worst of any
+ * new reports to its encoder (adapt_frame). The bitrate backs off
+ * multiplicatively while any peer loses packets, and climbs back
+ * additively once none do. In-band FEC follows the loss, so that
+ * what still gets through can recover what does not.
+ */
+
+struct adapt_peer {
+	atomic_uint fraction, /* lost, of 256, in the latest report */
+		reports;
+	unsigned int seen;
+};
+
+struct adapt {
+	unsigned int min_kbps, max_kbps, kbps,
+		min_loss, loss;
+
+	unsigned int nr_peers;
+	struct adapt_peer *peer;
+};
+
+struct adapt* adapt_new(unsigned int nr_peers,
+		unsigned int min_kbps, unsigned int max_kbps,
+		unsigned int min_loss);
+void adapt_free(struct adapt *a);
+
+int adapt_start(struct adapt *a, OpusMSEncoder *encoder);
+int adapt_frame(struct adapt *a, OpusMSEncoder *encoder);
+
+/*
+ * Called from the receiving thread for each report block about
+ * our stream
+ */
+
+static inline void adapt_report(struct adapt_peer *p, unsigned int fraction)
+{
+	atomic_store_explicit(&p->fraction, fraction, memory_order_relaxed);
+	atomic_fetch_add_explicit(&p->reports, 1, memory_order_release);
+}
+
+#endif
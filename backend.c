@@ -0,0 +1,397 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "format.h"
+
+#define FILE_PREFIX "file:"
+#define NULL_NAME "null"
+
+#define NS 1000000000ULL
+
+bool backend_is(const char *name)
+{
+	return !strncmp(name, FILE_PREFIX, strlen(FILE_PREFIX)) ||
+		!strcmp(name, NULL_NAME);
+}
+
+static uint16_t le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Find the audio in a WAV file, checking it is what we were asked
+ * for (or taking its format, if FORMAT_AUTO); a file which is not
+ * WAV is taken to be raw audio as given
+ */
+
+static int parse_wav(struct backend *b, unsigned int rate,
+		unsigned int channels, snd_pcm_format_t *format)
+{
+	const unsigned char *p = b->data, *fmt = NULL, *data = NULL;
+	size_t left = b->len;
+	snd_pcm_format_t f;
+
+	if (left < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4)) {
+		if (*format == FORMAT_AUTO)
+			*format = SND_PCM_FORMAT_S16;
+		return 0;
+	}
+	p += 12;
+	left -= 12;
+
+	while (left >= 8) {
+		size_t len = le32(p + 4);
+
+		if (len > left - 8)
+			len = left - 8;
+
+		if (!memcmp(p, "fmt ", 4) && len >= 16) {
+			fmt = p + 8;
+		} else if (!memcmp(p, "data", 4)) {
+			data = p + 8;
+			b->len = len;
+			break;
+		}
+
+		len += len & 1;
+		if (len > left - 8)
+			break;
+		p += 8 + len;
+		left -= 8 + len;
+	}
+
+	if (fmt == NULL || data == NULL) {
+		fprintf(stderr, "WAV file has no audio\n");
+		return -1;
+	}
+	b->data = data;
+
+	/* WAVE_FORMAT_EXTENSIBLE gives the format in its sub-type */
+
+	switch (le16(fmt) == 0xfffe ? le16(fmt + 24) : le16(fmt)) {
+	case 1:
+		if (le16(fmt + 14) == 16)
+			f = SND_PCM_FORMAT_S16;
+		else if (le16(fmt + 14) == 32)
+			f = SND_PCM_FORMAT_S32;
+		else
+			goto unsupported;
+		break;
+	case 3:
+		if (le16(fmt + 14) != 32)
+			goto unsupported;
+		f = SND_PCM_FORMAT_FLOAT;
+		break;
+	default:
+		goto unsupported;
+	}
+
+	if (*format == FORMAT_AUTO)
+		*format = f;
+
+	if (le16(fmt + 2) != channels || le32(fmt + 4) != rate ||
+			*format != f)
+	{
+		fprintf(stderr, "WAV file is %u channels, %uHz, %s\n",
+				le16(fmt + 2), le32(fmt + 4),
+				snd_pcm_format_name(f));
+		return -1;
+	}
+
+	return 0;
+
+unsupported:
+	fprintf(stderr, "WAV file must be 16 or 32-bit, or float\n");
+	return -1;
+}
+
+static int open_source(struct backend *b, const char *path,
+		unsigned int rate, unsigned int channels,
+		snd_pcm_format_t *format)
+{
+	int fd;
+	struct stat st;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	b->map_len = st.st_size;
+	b->map = mmap(NULL, b->map_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+			fd, 0);
+	close(fd);
+	if (b->map == MAP_FAILED) {
+		perror("mmap");
+		b->map = NULL;
+		return -1;
+	}
+	b->data = b->map;
+	b->len = b->map_len;
+
+	if (parse_wav(b, rate, channels, format) == -1)
+		return -1;
+
+	b->frame_bytes = format_bytes(*format) * channels;
+	b->len -= b->len % b->frame_bytes;
+	if (b->len == 0) {
+		fprintf(stderr, "%s: No audio\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct backend* backend_open(const char *name, bool capture,
+		unsigned int rate, unsigned int channels,
+		snd_pcm_format_t *format)
+{
+	struct backend *b;
+
+	b = calloc(1, sizeof *b);
+	if (b == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	b->fd = -1;
+	b->rate = rate;
+
+	b->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (b->timer == -1) {
+		perror("timerfd_create");
+		goto fail;
+	}
+
+	if (capture && strcmp(name, NULL_NAME)) {
+		if (open_source(b, name + strlen(FILE_PREFIX), rate, channels,
+					format) == -1)
+		{
+			goto fail;
+		}
+		return b;
+	}
+
+	if (*format == FORMAT_AUTO)
+		*format = SND_PCM_FORMAT_S16;
+	b->frame_bytes = format_bytes(*format) * channels;
+
+	if (!capture && strcmp(name, NULL_NAME)) {
+		const char *path = name + strlen(FILE_PREFIX);
+
+		b->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				0644);
+		if (b->fd == -1) {
+			perror(path);
+			goto fail;
+		}
+	}
+
+	return b;
+
+fail:
+	backend_close(b);
+	return NULL;
+}
+
+void backend_close(struct backend *b)
+{
+	if (b->map)
+		munmap(b->map, b->map_len);
+	if (b->fd != -1)
+		close(b->fd);
+	if (b->timer != -1)
+		close(b->timer);
+	free(b);
+}
+
+/*
+ * Wait until the given audio would have passed through a device.
+ * If we fall more than a period behind, as a device would xrun,
+ * the clock is started again from now
+ */
+
+static int pace(struct backend *b, snd_pcm_uframes_t samples)
+{
+	struct timespec now;
+	struct itimerspec its = { };
+	uint64_t t, expired;
+
+	if (b->unpaced)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = now.tv_sec * NS + now.tv_nsec;
+
+	b->samples += samples;
+	if (b->start == 0 ||
+			t > b->start + (b->samples + samples) * NS / b->rate)
+	{
+		b->start = t;
+		b->samples = samples;
+	}
+
+	t = b->start + b->samples * NS / b->rate;
+	its.it_value.tv_sec = t / NS;
+	its.it_value.tv_nsec = t % NS;
+
+	if (timerfd_settime(b->timer, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		return -1;
+	}
+
+	while (read(b->timer, &expired, sizeof expired) == -1) {
+		if (errno != EINTR) {
+			perror("read");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+snd_pcm_sframes_t backend_read(struct backend *b, void *pcm,
+		snd_pcm_uframes_t samples)
+{
+	size_t want = samples * b->frame_bytes;
+	unsigned char *out = pcm;
+
+	if (pace(b, samples) == -1)
+		return -1;
+
+	if (b->data == NULL) {
+		memset(pcm, 0, want);
+		return samples;
+	}
+
+	while (want > 0) {
+		size_t n = b->len - b->pos;
+
+		if (n > want)
+			n = want;
+		memcpy(out, b->data + b->pos, n);
+
+		out += n;
+		want -= n;
+		b->pos += n;
+		if (b->pos == b->len)
+			b->pos = 0;
+	}
+
+	return samples;
+}
+
+snd_pcm_sframes_t backend_write(struct backend *b, const void *pcm,
+		snd_pcm_uframes_t samples)
+{
+	size_t len = samples * b->frame_bytes;
+
+	if (pace(b, samples) == -1)
+		return -1;
+
+	if (b->fd != -1 && write(b->fd, pcm, len) != (ssize_t)len) {
+		perror("write");
+		return -1;
+	}
+
+	return samples;
+}
+
+/*
+ * Write as much as there is room for, without waiting. When full,
+ * return -EAGAIN with the timer set for when there will be room for
+ * the rest; or, if the buffer ran dry before this write (an xrun),
+ * return -EPIPE and start the clock again
+ */
+
+snd_pcm_sframes_t backend_write_nonblock(struct backend *b, const void *pcm,
+		snd_pcm_uframes_t samples)
+{
+	struct timespec now;
+	struct itimerspec its = { };
+	uint64_t t, played, held;
+	snd_pcm_uframes_t room;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = now.tv_sec * NS + now.tv_nsec;
+
+	if (b->start == 0) {
+		b->start = t;
+		b->samples = 0;
+	}
+
+	played = (t - b->start) * b->rate / NS;
+	if (played > b->samples) {
+		b->start = 0;
+		return -EPIPE;
+	}
+
+	held = b->samples - played;
+	room = held < b->buffer ? b->buffer - held : 0;
+	if (room > samples)
+		room = samples;
+
+	/* Wake when there is room for the rest, or half the buffer, as a
+	 * device wakes by the period and not when it is empty */
+
+	if (room == 0) {
+		if (samples > b->buffer / 2)
+			samples = b->buffer / 2;
+		t = b->start + (b->samples + samples - b->buffer) * NS / b->rate;
+		its.it_value.tv_sec = t / NS;
+		its.it_value.tv_nsec = t % NS;
+
+		if (timerfd_settime(b->timer, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+			perror("timerfd_settime");
+			return -1;
+		}
+		return -EAGAIN;
+	}
+
+	if (b->fd != -1 && write(b->fd, pcm, room * b->frame_bytes)
+			!= (ssize_t)(room * b->frame_bytes))
+	{
+		perror("write");
+		return -1;
+	}
+	b->samples += room;
+
+	return room;
+}
+
+/*
+ * Acknowledge the timer, once it has woken the caller
+ */
+
+int backend_ready(struct backend *b)
+{
+	uint64_t expired;
+
+	if (read(b->timer, &expired, sizeof expired) == -1 && errno != EAGAIN) {
+		perror("read");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+/*
+ * Sources and sinks of audio other than an ALSA device, so that
+ * streams can be run where there is no sound hardware
+ *
+ * They are named in place of a device:
+ *
+ *   file:<path>  as a source, a WAV or raw file, played in a loop;
+ *                as a sink, raw audio written to the file
+ *   null         silence, or audio thrown away
+ *
+ * Either way, audio moves at the given rate, as it would through a
+ * device, timed by a timerfd.
+ *
+ * A sink may also be written without blocking, for a caller which
+ * waits on the timer itself (see rx_looplib.h): it holds up to
+ * 'buffer' samples, as a device's buffer, which drain at the rate.
+ */
+
+struct backend {
+	const unsigned char *data; /* source, mapped */
+	size_t len, pos;
+	void *map;
+	size_t map_len;
+
+	int fd, /* file sink */
+		timer;
+	size_t frame_bytes;
+	unsigned int rate;
+	uint64_t start, samples; /* since the clock was last set */
+	snd_pcm_uframes_t buffer; /* when not blocking */
+	bool unpaced; /* as fast as asked, for benchmarks */
+};
+
+bool backend_is(const char *name);
+
+struct backend* backend_open(const char *name, bool capture,
+		unsigned int rate, unsigned int channels,
+		snd_pcm_format_t *format);
+void backend_close(struct backend *b);
+
+snd_pcm_sframes_t backend_read(struct backend *b, void *pcm,
+		snd_pcm_uframes_t samples);
+snd_pcm_sframes_t backend_write(struct backend *b, const void *pcm,
+		snd_pcm_uframes_t samples);
+snd_pcm_sframes_t backend_write_nonblock(struct backend *b, const void *pcm,
+		snd_pcm_uframes_t samples);
+int backend_ready(struct backend *b);
+
+#endif
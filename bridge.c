@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "bridge.h"
+#include "device.h"
+#include "mixer.h"
+#include "rx_alsalib.h"
+
+extern unsigned int verbose;
+
+struct bridge* bridge_new(unsigned int nr_peers, struct rx_args *rx,
+		const struct codec_layout *layout, unsigned int rate,
+		snd_pcm_uframes_t frame, unsigned int kbps, unsigned int loss,
+		struct fanout *fanout, struct stats *stats)
+{
+	struct bridge *b;
+	unsigned int n;
+
+	b = calloc(1, sizeof *b);
+	if (b == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	b->nr_peers = nr_peers;
+	b->channels = layout->channels;
+	b->rate = rate;
+	b->frame = frame;
+	b->bytes_per_frame = kbps * 1024 * frame / rate / 8;
+	/* Follow the RFC, payload 0 has 8kHz reference rate */
+	b->ts_per_frame = frame * 8000 / rate;
+	b->fanout = fanout;
+	b->stats = stats;
+	b->timer = -1;
+
+	b->peer = calloc(nr_peers, sizeof *b->peer);
+	b->packets = calloc(nr_peers, sizeof *b->packets);
+	b->lens = calloc(nr_peers, sizeof *b->lens);
+	if (b->peer == NULL || b->packets == NULL || b->lens == NULL) {
+		perror("calloc");
+		goto fail;
+	}
+
+	b->sum = alloc_pcm(sizeof(float) * frame * b->channels);
+	if (b->sum == NULL)
+		goto fail;
+
+	for (n = 0; n < nr_peers; n++) {
+		struct bridge_peer *p = &b->peer[n];
+
+		p->rx = &rx[n];
+		p->rx->channels = b->channels;
+		p->rx->rate = rate;
+		if (rx_stream_init(&p->rx->stream, b->channels, MAX_SAMPLES,
+					SND_PCM_FORMAT_FLOAT) == -1)
+		{
+			goto fail;
+		}
+
+		p->encoder = codec_encoder(layout, rate);
+		if (p->encoder == NULL)
+			goto fail;
+		if (set_opus_fec(p->encoder, loss) == -1)
+			goto fail;
+
+		if (tx_stream_init(&p->tx, b->channels, frame,
+					b->bytes_per_frame, SND_PCM_FORMAT_FLOAT) == -1)
+		{
+			goto fail;
+		}
+	}
+
+	b->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (b->timer == -1) {
+		perror("timerfd_create");
+		goto fail;
+	}
+
+	return b;
+
+fail:
+	bridge_free(b);
+	return NULL;
+}
+
+/*
+ * Stop the workers, if started, and free everything but the hosts'
+ * receivers
+ */
+
+void bridge_free(struct bridge *b)
+{
+	unsigned int n;
+
+	/* Workers wait to start a period, and are told to quit instead */
+
+	if (b->workers && b->started == b->nr_workers) {
+		atomic_store(&b->quit, true);
+		pthread_barrier_wait(&b->step);
+		for (n = 0; n < b->nr_workers; n++)
+			pthread_join(b->workers[n], NULL);
+		pthread_barrier_destroy(&b->step);
+	}
+	free(b->workers);
+
+	for (n = 0; b->peer && n < b->nr_peers; n++) {
+		struct bridge_peer *p = &b->peer[n];
+
+		if (p->encoder)
+			opus_multistream_encoder_destroy(p->encoder);
+		if (p->tx.pcm)
+			tx_stream_clear(&p->tx);
+	}
+
+	if (b->timer != -1)
+		close(b->timer);
+	free(b->sum);
+	free(b->packets);
+	free(b->lens);
+	free(b->peer);
+	free(b);
+}
+
+/*
+ * Receive and decode the host's next frame; anything other than a
+ * whole frame is made up with silence
+ */
+
+static void decode_peer(struct bridge *b, struct bridge_peer *p)
+{
+	struct rx_args *rx = p->rx;
+	struct rx_stream *s = &rx->stream;
+	const void *packet;
+	size_t len;
+	unsigned long start;
+	int r, got;
+
+	drain_rx(rx, s->ts);
+
+	got = jbuf_get(rx->jb, &packet, &len);
+	if (got == JBUF_MISSING) {
+		packet = NULL;
+		len = 0;
+	}
+
+	start = stats_now();
+
+	r = decode_one_frame((void *)packet, len, got == JBUF_FEC,
+			rx->decoder, s->format, s->pcm,
+			got == JBUF_PACKET ? MAX_SAMPLES : b->frame);
+	if (r < 0)
+		r = 0;
+	if ((snd_pcm_uframes_t)r < b->frame) {
+		mix_clear_float((float *)s->pcm + r * b->channels,
+				(b->frame - r) * b->channels);
+	}
+
+	/* Follow the RFC, payload 0 has 8kHz reference rate */
+	s->ts += (r ? (snd_pcm_uframes_t)r : b->frame) * 8000 / rx->rate;
+
+	if (rx->stats) {
+		stats_hist_add(&rx->stats->decode_ns, stats_now() - start);
+		if (got != JBUF_PACKET)
+			stats_add(&rx->stats->concealed, 1);
+		publish_rx(rx);
+	}
+}
+
+/*
+ * Encode the sum of everyone less this host
+ */
+
+static void encode_peer(struct bridge *b, struct bridge_peer *p)
+{
+	const size_t samples = b->frame * b->channels;
+	float *mix = p->tx.pcm;
+	opus_int32 z;
+
+	memcpy(mix, b->sum, sizeof(float) * samples);
+	mix_add_float(mix, p->rx->stream.pcm, samples, -p->rx->gain);
+
+	z = encode_one_frame(p->encoder, mix, b->channels, b->frame,
+			b->bytes_per_frame, &p->tx);
+	if (z < 0) {
+		fprintf(stderr, "opus_multistream_encode_float: %s\n",
+				opus_strerror(z));
+		z = 0;
+	}
+
+	p->packet = p->tx.packet;
+	p->len = z;
+}
+
+/*
+ * Take hosts from the shared counter until there are none left
+ */
+
+static void take(struct bridge *b,
+		void (*fn)(struct bridge *b, struct bridge_peer *p))
+{
+	unsigned int n;
+
+	while ((n = atomic_fetch_add(&b->next, 1)) < b->nr_peers)
+		fn(b, &b->peer[n]);
+}
+
+static void* run_worker(void *arg)
+{
+	struct bridge *b = arg;
+
+	for (;;) {
+		pthread_barrier_wait(&b->step); /* period starts */
+		if (atomic_load(&b->quit))
+			return NULL;
+
+		take(b, decode_peer);
+		pthread_barrier_wait(&b->step); /* all decoded */
+		pthread_barrier_wait(&b->step); /* summed */
+		take(b, encode_peer);
+		pthread_barrier_wait(&b->step); /* all encoded */
+	}
+}
+
+int bridge_start(struct bridge *b, const struct sched_role *role,
+		unsigned int nr_workers)
+{
+	unsigned int n;
+	int r;
+
+	r = pthread_barrier_init(&b->step, NULL, nr_workers + 1);
+	if (r != 0) {
+		errno = r;
+		perror("pthread_barrier_init");
+		return -1;
+	}
+
+	b->nr_workers = nr_workers;
+	b->workers = calloc(nr_workers + 1, sizeof *b->workers);
+	if (b->workers == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	/* The timekeeper is the first of the role's threads */
+
+	for (n = 0; n < nr_workers; n++) {
+		if (sched_thread(&b->workers[n], role, n + 1, run_worker, b) == -1)
+			return -1;
+		b->started++;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for the next period; those missed while the last one ran
+ * over are counted
+ */
+
+static int tick(struct bridge *b)
+{
+	uint64_t expired;
+
+	while (read(b->timer, &expired, sizeof expired) == -1) {
+		if (errno != EINTR) {
+			perror("read");
+			return -1;
+		}
+	}
+
+	if (expired > 1 && b->stats)
+		stats_add(&b->stats->tx.xruns, expired - 1);
+
+	return 0;
+}
+
+static void publish(struct bridge *b)
+{
+	unsigned int n;
+
+	stats_add(&b->stats->tx.frames, 1);
+
+	for (n = 0; n < b->nr_peers; n++) {
+		struct stats_peer *st = b->peer[n].rx->stats;
+
+		if (st == NULL)
+			continue;
+		stats_set(&st->sent, b->fanout->peer[n].sent);
+		stats_set(&st->send_failed, b->fanout->peer[n].failed);
+	}
+}
+
+void* run_bridge(struct bridge *b)
+{
+	unsigned long period = 1000000000UL * b->frame / b->rate;
+	struct itimerspec its = {
+		.it_value.tv_nsec = 1,
+		.it_interval.tv_sec = period / 1000000000,
+		.it_interval.tv_nsec = period % 1000000000
+	};
+	unsigned int n;
+
+	if (timerfd_settime(b->timer, 0, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		return (void *)-1;
+	}
+
+	for (;;) {
+		if (tick(b) == -1)
+			return (void *)-1;
+
+		atomic_store(&b->next, 0);
+		pthread_barrier_wait(&b->step);
+		take(b, decode_peer);
+		pthread_barrier_wait(&b->step);
+
+		mix_clear_float(b->sum, b->frame * b->channels);
+		for (n = 0; n < b->nr_peers; n++) {
+			const struct rx_args *rx = b->peer[n].rx;
+
+			mix_add_float(b->sum, rx->stream.pcm,
+					b->frame * b->channels, rx->gain);
+		}
+
+		atomic_store(&b->next, 0);
+		pthread_barrier_wait(&b->step);
+		take(b, encode_peer);
+		pthread_barrier_wait(&b->step);
+
+		for (n = 0; n < b->nr_peers; n++) {
+			b->packets[n] = b->peer[n].packet;
+			b->lens[n] = b->peer[n].len;
+		}
+		fanout_send_each(b->fanout, b->packets, b->lens, b->ts);
+		b->ts += b->ts_per_frame;
+
+		if (b->stats)
+			publish(b);
+		if (verbose > 1)
+			fputc('.', stderr);
+	}
+}
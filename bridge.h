@@ -0,0 +1,74 @@
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "codec.h"
+#include "fanout.h"
+#include "rx_runlib.h"
+#include "sched.h"
+#include "stats.h"
+#include "tx_alsalib.h"
+
+/*
+ * Conference bridge: every host is sent a mix of all the others
+ * (mix-minus), so each only receives and decodes a single stream.
+ *
+ * The bridge works in periods of one frame, kept by a timer. In
+ * each, the frame from every host is decoded, the frames are summed
+ * once, and each host's mix is that sum less its own frame; the
+ * mixes are then encoded, and sent in a single batch. Decoding and
+ * encoding are shared out between a pool of workers, one of which
+ * is the thread keeping time, meeting at a barrier between each
+ * step, so that a period's work is finished within the period.
+ * A period which overruns is counted as a tx xrun.
+ *
+ * Audio is in float throughout, so summing needs no saturation and
+ * the subtraction is exact enough.
+ */
+
+struct bridge_peer {
+	struct rx_args *rx;
+	OpusMSEncoder *encoder;
+	struct tx_stream tx; /* 'pcm' holds the mix */
+	const void *packet;
+	size_t len; /* of this period's packet, 0 if none */
+};
+
+struct bridge {
+	unsigned int nr_peers, channels, rate;
+	snd_pcm_uframes_t frame;
+	size_t bytes_per_frame;
+	unsigned int ts_per_frame;
+
+	struct bridge_peer *peer;
+	float *sum;
+	const void **packets;
+	size_t *lens;
+	struct fanout *fanout;
+	struct stats *stats; /* if given */
+
+	unsigned int nr_workers, /* besides the timekeeper */
+		started;
+	pthread_t *workers;
+	pthread_barrier_t step;
+	atomic_uint next; /* peer to be taken by a worker */
+	atomic_bool quit;
+
+	int timer;
+	uint32_t ts;
+};
+
+struct bridge* bridge_new(unsigned int nr_peers, struct rx_args *rx,
+		const struct codec_layout *layout, unsigned int rate,
+		snd_pcm_uframes_t frame, unsigned int kbps, unsigned int loss,
+		struct fanout *fanout, struct stats *stats);
+void bridge_free(struct bridge *b);
+
+int bridge_start(struct bridge *b, const struct sched_role *role,
+		unsigned int nr_workers);
+void* run_bridge(struct bridge *b);
+
+#endif
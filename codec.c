@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+
+/*
+ * Work out a layout for the given channels from its name: "pairs"
+ * (the default) couples channels 1+2, 3+4 and so on, with any odd
+ * one out on its own; "mono" gives every channel its own stream,
+ * which suits separate microphones. Otherwise the layout is given
+ * in full as "<streams>:<coupled>:<mapping>,<mapping>,..."
+ */
+
+int codec_layout(struct codec_layout *l, unsigned int channels,
+		const char *name)
+{
+	unsigned int n;
+
+	if (channels == 0 || channels > CODEC_MAX_CHANNELS)
+		goto bad;
+
+	l->channels = channels;
+
+	if (name == NULL || !strcmp(name, "pairs")) {
+		l->coupled = channels / 2;
+		l->streams = l->coupled + channels % 2;
+		for (n = 0; n < channels; n++)
+			l->mapping[n] = n;
+
+	} else if (!strcmp(name, "mono")) {
+		l->coupled = 0;
+		l->streams = channels;
+		for (n = 0; n < channels; n++)
+			l->mapping[n] = n;
+
+	} else {
+		const char *s = name;
+		char *end;
+
+		l->streams = strtol(s, &end, 10);
+		if (*end != ':')
+			goto bad;
+		s = end + 1;
+
+		l->coupled = strtol(s, &end, 10);
+		if (*end != ':')
+			goto bad;
+		s = end + 1;
+
+		for (n = 0; n < channels; n++) {
+			unsigned long m;
+
+			m = strtoul(s, &end, 10);
+			if (end == s || m > 255)
+				goto bad;
+			l->mapping[n] = m;
+
+			s = end;
+			if (*s != (n + 1 < channels ? ',' : '\0'))
+				goto bad;
+			s++;
+		}
+
+		/* The rest is checked by Opus */
+
+		if (l->streams < 1 || l->coupled < 0 || l->coupled > l->streams)
+			goto bad;
+	}
+
+	return 0;
+
+bad:
+	fprintf(stderr, "Bad layout '%s' for %u channels\n",
+			name ? name : "pairs", channels);
+	return -1;
+}
+
+OpusMSEncoder* codec_encoder(const struct codec_layout *l,
+		unsigned int rate)
+{
+	OpusMSEncoder *e;
+	int error;
+
+	e = opus_multistream_encoder_create(rate, l->channels,
+			l->streams, l->coupled, l->mapping,
+			OPUS_APPLICATION_AUDIO, &error);
+	if (e == NULL) {
+		fprintf(stderr, "opus_multistream_encoder_create: %s\n",
+				opus_strerror(error));
+		return NULL;
+	}
+
+	return e;
+}
+
+OpusMSDecoder* codec_decoder(const struct codec_layout *l,
+		unsigned int rate)
+{
+	OpusMSDecoder *d;
+	int error;
+
+	d = opus_multistream_decoder_create(rate, l->channels,
+			l->streams, l->coupled, l->mapping, &error);
+	if (d == NULL) {
+		fprintf(stderr, "opus_multistream_decoder_create: %s\n",
+				opus_strerror(error));
+		return NULL;
+	}
+
+	return d;
+}
@@ -0,0 +1,35 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <opus/opus_multistream.h>
+
+/*
+ * Layout of channels over Opus streams
+ *
+ * Every encoder and decoder is an Opus multistream one, so that a
+ * single packet carries any number of channels. Each stream codes
+ * one channel, or a pair (coupled); 'mapping' gives, for each
+ * channel, the stream channel it is carried in (see RFC 7845).
+ *
+ * Nothing about the layout is sent, so both ends must be given the
+ * same. One or two channels in the default layout are a single
+ * stream, which is exactly the plain Opus of earlier versions.
+ */
+
+#define CODEC_MAX_CHANNELS 255
+
+struct codec_layout {
+	unsigned int channels;
+	int streams, coupled;
+	unsigned char mapping[CODEC_MAX_CHANNELS];
+};
+
+int codec_layout(struct codec_layout *l, unsigned int channels,
+		const char *name);
+
+OpusMSEncoder* codec_encoder(const struct codec_layout *l,
+		unsigned int rate);
+OpusMSDecoder* codec_decoder(const struct codec_layout *l,
+		unsigned int rate);
+
+#endif
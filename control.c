@@ -0,0 +1,115 @@
+#define _GNU_SOURCE /* accept4 */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+#define MAX_REPLY 4096
+
+int control_open(struct control *c, const char *path,
+		const struct control_command *commands, void *arg)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX
+	};
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "%s: Path too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	/* Replace the socket of a previous run */
+
+	unlink(path);
+
+	if (bind(c->fd, (struct sockaddr *)&addr, sizeof addr) == -1) {
+		perror("bind");
+		close(c->fd);
+		return -1;
+	}
+
+	if (listen(c->fd, 4) == -1) {
+		perror("listen");
+		close(c->fd);
+		return -1;
+	}
+
+	c->commands = commands;
+	c->arg = arg;
+
+	return 0;
+}
+
+static void command(struct control *c, char *line, FILE *out)
+{
+	const struct control_command *cmd;
+	char *name, *args, reply[MAX_REPLY] = "";
+
+	line[strcspn(line, "\r\n")] = '\0';
+
+	name = line + strspn(line, " \t");
+	if (*name == '\0')
+		return;
+
+	args = name + strcspn(name, " \t");
+	if (*args != '\0')
+		*args++ = '\0';
+	args += strspn(args, " \t");
+
+	for (cmd = c->commands; cmd->name; cmd++) {
+		if (strcmp(cmd->name, name) == 0)
+			break;
+	}
+
+	if (cmd->name == NULL) {
+		fprintf(out, "error: unknown command '%s'\n", name);
+	} else if (cmd->fn(c->arg, args, reply, sizeof reply) == -1) {
+		fprintf(out, "error: %s\n", *reply ? reply : "failed");
+	} else {
+		fputs(reply, out);
+		fputs("ok\n", out);
+	}
+
+	fflush(out);
+}
+
+/*
+ * Serve one client at a time; commands are not expected often
+ */
+
+void *run_control(struct control *c)
+{
+	for (;;) {
+		int fd;
+		FILE *f;
+		char line[256];
+
+		fd = accept4(c->fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			perror("accept4");
+			continue;
+		}
+
+		f = fdopen(fd, "r+");
+		if (f == NULL) {
+			perror("fdopen");
+			close(fd);
+			continue;
+		}
+
+		while (fgets(line, sizeof line, f))
+			command(c, line, f);
+
+		fclose(f);
+	}
+}
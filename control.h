@@ -0,0 +1,33 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+
+/*
+ * Control socket
+ *
+ * A Unix domain stream socket taking one command per line, eg.
+ *
+ *   $ echo "remove 1350" | socat - UNIX-CONNECT:/run/trx.sock
+ *   ok
+ *
+ * Each command is given the rest of its line, and writes any reply
+ * to 'reply'; it returns -1 on error.
+ */
+
+struct control_command {
+	const char *name;
+	int (*fn)(void *arg, char *args, char *reply, size_t len);
+};
+
+struct control {
+	int fd;
+	const struct control_command *commands;
+	void *arg;
+};
+
+int control_open(struct control *c, const char *path,
+		const struct control_command *commands, void *arg);
+void *run_control(struct control *c);
+
+#endif
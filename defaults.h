@@ -3,16 +3,22 @@
 
 #define DEFAULT_DEVICE "default"
 #define DEFAULT_BUFFER 2
+#define DEFAULT_FORMAT "s16"
 
 #define DEFAULT_ADDR "0.0.0.0"
 #define DEFAULT_PORT 1350
 #define DEFAULT_FRAME 120
 #define DEFAULT_JITTER 4
+#define DEFAULT_JITTER_MAX(j) ((j) * 4)
+#define DEFAULT_JITTER_DECAY 2000
+#define DEFAULT_DRIFT 500
 #define DEFAULT_SSRC 0x12345678
 
 #define DEFAULT_RATE 48000
 #define DEFAULT_CHANNELS 1
 #define DEFAULT_BITRATE 128
+#define DEFAULT_LOSS 0
+#define DEFAULT_SLOTS 16
 
 #define DEFAULT_VERBOSE 1
 
@@ -20,6 +20,9 @@
 #include <stdio.h>
 #include <alsa/asoundlib.h>
 
+#include "device.h"
+#include "format.h"
+
 #define CHK(call, r) { \
 	if (r < 0) { \
 		aerror(call, r); \
@@ -27,6 +30,28 @@
 	} \
 }
 
+/*
+ * Allocate a buffer for use on the audio path, aligned so that it
+ * shares no cache line with anything else
+ */
+
+void* alloc_pcm(size_t len)
+{
+	void *p;
+	int r;
+
+	len = (len + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+
+	r = posix_memalign(&p, CACHE_LINE, len);
+	if (r != 0) {
+		errno = r;
+		perror("posix_memalign");
+		return NULL;
+	}
+
+	return p;
+}
+
 void aerror(const char *msg, int r)
 {
 	fputs(msg, stderr);
@@ -35,9 +60,43 @@ void aerror(const char *msg, int r)
 	fputc('\n', stderr);
 }
 
+/*
+ * Formats we can work in, best first. A plug device will claim to
+ * support all of them, so auto is only useful with hw devices
+ */
+
+static const snd_pcm_format_t native[] = {
+	SND_PCM_FORMAT_S32,
+	SND_PCM_FORMAT_FLOAT,
+	SND_PCM_FORMAT_S24,
+	SND_PCM_FORMAT_S16
+};
+
+static int choose_format(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw,
+		snd_pcm_format_t *format)
+{
+	unsigned int n;
+
+	for (n = 0; n < sizeof(native) / sizeof(*native); n++) {
+		if (snd_pcm_hw_params_test_format(pcm, hw, native[n]) == 0) {
+			*format = native[n];
+			return 0;
+		}
+	}
+
+	fputs("No supported sample format\n", stderr);
+	return -1;
+}
+
+/*
+ * Set up the device, negotiating the sample format if 'format' is
+ * FORMAT_AUTO, and returning the one used
+ */
+
 int set_alsa_hw(snd_pcm_t *pcm,
 		unsigned int rate, unsigned int channels,
-		unsigned int buffer)
+		unsigned int buffer, snd_pcm_access_t access,
+		snd_pcm_format_t *format)
 {
 	int r, dir;
 	snd_pcm_hw_params_t *hw;
@@ -50,10 +109,13 @@ int set_alsa_hw(snd_pcm_t *pcm,
 	r = snd_pcm_hw_params_set_rate_resample(pcm, hw, 1);
 	CHK("snd_pcm_hw_params_set_rate_resample", r);
 
-	r = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED);
+	r = snd_pcm_hw_params_set_access(pcm, hw, access);
 	CHK("snd_pcm_hw_params_set_access", r);
 
-	r = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16);
+	if (*format == FORMAT_AUTO && choose_format(pcm, hw, format) == -1)
+		return -1;
+
+	r = snd_pcm_hw_params_set_format(pcm, hw, *format);
 	CHK("snd_pcm_hw_params_set_format", r);
 
 	r = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0);
@@ -89,9 +151,105 @@ int set_alsa_sw(snd_pcm_t *pcm)
 	r = snd_pcm_sw_params_set_stop_threshold(pcm, sw, boundary);
 	CHK("snd_pcm_sw_params_set_stop_threshold", r);
 
+	/* Timestamps on the clock of stats_now(), for latency */
+
+	r = snd_pcm_sw_params_set_tstamp_mode(pcm, sw, SND_PCM_TSTAMP_ENABLE);
+	CHK("snd_pcm_sw_params_set_tstamp_mode", r);
+
+	r = snd_pcm_sw_params_set_tstamp_type(pcm, sw,
+			SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	CHK("snd_pcm_sw_params_set_tstamp_type", r);
+
 	r = snd_pcm_sw_params(pcm, sw);
 	CHK("snd_pcm_sw_params", r);
 
 	return 0;
 
 }
+
+/*
+ * Helpers for devices opened with SND_PCM_ACCESS_MMAP_INTERLEAVED,
+ * where audio is read and written in place in the device's buffer
+ */
+
+/*
+ * Wait until at least the given number of frames can be transferred
+ */
+
+int pcm_mmap_wait(snd_pcm_t *pcm, snd_pcm_uframes_t frames)
+{
+	int r;
+	snd_pcm_sframes_t avail;
+
+	for (;;) {
+		avail = snd_pcm_avail_update(pcm);
+		if (avail < 0)
+			return avail;
+		if ((snd_pcm_uframes_t)avail >= frames)
+			return 0;
+
+		/* Capture does not start by itself, as it does from
+		 * snd_pcm_readi() */
+
+		if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+			r = snd_pcm_start(pcm);
+			if (r < 0)
+				return r;
+		}
+
+		r = snd_pcm_wait(pcm, 1000);
+		if (r < 0)
+			return r;
+	}
+}
+
+/*
+ * Begin access to the buffer, returning 1 with 'buf' pointing at
+ * the given number of contiguous frames; or 0 if the buffer wraps
+ * before then, in which case nothing is begun and the caller must
+ * fall back to a copy
+ */
+
+int pcm_mmap_begin(snd_pcm_t *pcm, snd_pcm_uframes_t frames,
+		void **buf, snd_pcm_uframes_t *offset)
+{
+	int r;
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t n = frames;
+
+	r = snd_pcm_mmap_begin(pcm, &areas, offset, &n);
+	if (r < 0)
+		return r;
+
+	if (n < frames) {
+		r = snd_pcm_mmap_commit(pcm, *offset, 0);
+		return r < 0 ? r : 0;
+	}
+
+	*buf = (char*)areas[0].addr + areas[0].first / 8
+		+ *offset * areas[0].step / 8;
+
+	return 1;
+}
+
+int pcm_mmap_commit(snd_pcm_t *pcm, snd_pcm_uframes_t offset,
+		snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t r;
+
+	r = snd_pcm_mmap_commit(pcm, offset, frames);
+	if (r < 0)
+		return r;
+	if ((snd_pcm_uframes_t)r != frames)
+		return -EPIPE;
+
+	/* Nor does playback */
+
+	if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+		r = snd_pcm_start(pcm);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
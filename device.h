@@ -20,10 +20,21 @@
 #ifndef DEVICE_H
 #define DEVICE_H
 
+#define CACHE_LINE 64
+
+void* alloc_pcm(size_t len);
+
 void aerror(const char *msg, int r);
 int set_alsa_hw(snd_pcm_t *pcm,
 		unsigned int rate, unsigned int channels,
-		unsigned int buffer);
+		unsigned int buffer, snd_pcm_access_t access,
+		snd_pcm_format_t *format);
 int set_alsa_sw(snd_pcm_t *pcm);
 
+int pcm_mmap_wait(snd_pcm_t *pcm, snd_pcm_uframes_t frames);
+int pcm_mmap_begin(snd_pcm_t *pcm, snd_pcm_uframes_t frames,
+		void **buf, snd_pcm_uframes_t *offset);
+int pcm_mmap_commit(snd_pcm_t *pcm, snd_pcm_uframes_t offset,
+		snd_pcm_uframes_t frames);
+
 #endif
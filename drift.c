@@ -0,0 +1,71 @@
+#include "drift.h"
+#include "resample.h"
+
+/* Seconds over which to find the reference after anchoring, and
+ * over which the level is smoothed */
+
+#define SETTLE 2.0
+#define SMOOTH 4.0
+
+/* A second of error changes the rate by KP, and the estimate of the
+ * clocks' difference by KI each second */
+
+#define KP (1.0 / 60.0)
+#define KI (KP / 600.0)
+
+void drift_init(struct drift *d, unsigned int rate, unsigned int max_ppm)
+{
+	if (max_ppm > RESAMPLE_MAX_PPM)
+		max_ppm = RESAMPLE_MAX_PPM;
+
+	d->rate = rate;
+	d->max = max_ppm / 1e6;
+
+	drift_reset(d);
+}
+
+void drift_reset(struct drift *d)
+{
+	d->integral = 0.0;
+	d->step = 1.0;
+
+	drift_anchor(d);
+}
+
+void drift_anchor(struct drift *d)
+{
+	d->settle = SETTLE;
+	d->sum = d->count = 0.0;
+}
+
+static double clamp(double x, double max)
+{
+	return x > max ? max : (x < -max ? -max : x);
+}
+
+/*
+ * A proportional-integral controller; the integral is, over time,
+ * the difference between the two clocks
+ */
+
+double drift_update(struct drift *d, double level, unsigned int samples)
+{
+	double dt = (double)samples / d->rate, e;
+
+	if (d->settle > 0.0) {
+		d->sum += level;
+		d->count++;
+		d->settle -= dt;
+		if (d->settle <= 0.0)
+			d->ref = d->level = d->sum / d->count;
+		return d->step = 1.0 + d->integral;
+	}
+
+	d->level += (level - d->level) * dt / SMOOTH;
+	e = (d->level - d->ref) / d->rate;
+
+	d->integral = clamp(d->integral + KI * e * dt, d->max);
+	d->step = 1.0 + clamp(KP * e + d->integral, d->max);
+
+	return d->step;
+}
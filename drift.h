@@ -0,0 +1,44 @@
+#ifndef DRIFT_H
+#define DRIFT_H
+
+#include <stdbool.h>
+
+/*
+ * Clock drift between a sender and our playback device
+ *
+ * Audio is played at the rate of our device's clock, but arrives
+ * at the rate of the sender's. The difference shows as a slow
+ * trend in how much audio is waiting to be played: the jitter
+ * buffer and whatever was decoded but not yet played.
+ *
+ * Once per decoded frame that level is given to drift_update(),
+ * which returns the rate at which to play the stream (see
+ * resample.h) so that it stays where it was when last anchored.
+ * The jitter buffer moves the level itself when it changes its
+ * target, so drift_anchor() takes a new reference then, keeping
+ * what has been learnt of the clocks.
+ */
+
+struct drift {
+	unsigned int rate;
+	double max; /* of |step - 1| */
+
+	double settle, /* seconds still to average over */
+		sum, count,
+		ref, level,
+		integral,
+		step;
+};
+
+void drift_init(struct drift *d, unsigned int rate, unsigned int max_ppm);
+void drift_reset(struct drift *d);
+void drift_anchor(struct drift *d);
+
+double drift_update(struct drift *d, double level, unsigned int samples);
+
+static inline long drift_ppm(const struct drift *d)
+{
+	return (long)((d->step - 1.0) * 1e6);
+}
+
+#endif
@@ -0,0 +1,339 @@
+#define _GNU_SOURCE /* sendmmsg */
+#include <errno.h>
+#include <stdbool.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "fanout.h"
+
+/* Match the sessions set up by oRTP, see trx_rtplib.c */
+
+#define TTL 16
+#define DSCP 40
+
+struct fanout* fanout_new(unsigned int nr_peers, int payload_type)
+{
+	struct fanout *f;
+
+	f = calloc(1, sizeof *f);
+	if (f == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	f->nr_peers = nr_peers;
+	f->payload_type = payload_type;
+	f->fd4 = f->fd6 = -1;
+
+	f->peer = calloc(nr_peers, sizeof *f->peer);
+	f->msg = calloc(nr_peers, sizeof *f->msg);
+	f->index = calloc(nr_peers, sizeof *f->index);
+	if (f->peer == NULL || f->msg == NULL || f->index == NULL) {
+		perror("calloc");
+		fanout_free(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+void fanout_free(struct fanout *f)
+{
+	if (f->fd4 != -1)
+		close(f->fd4);
+	if (f->fd6 != -1)
+		close(f->fd6);
+
+	free(f->peer);
+	free(f->msg);
+	free(f->index);
+	free(f);
+}
+
+/*
+ * Open the shared socket for an address family, the first time it
+ * is needed. It is not bound, so packets leave from an ephemeral
+ * port
+ */
+
+static int family_socket(struct fanout *f, int family)
+{
+	int *fd, tos = DSCP << 2, ttl = TTL;
+
+	fd = (family == AF_INET6) ? &f->fd6 : &f->fd4;
+	if (*fd != -1)
+		return *fd;
+
+	*fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (*fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	if (family == AF_INET6) {
+		if (setsockopt(*fd, IPPROTO_IPV6, IPV6_TCLASS,
+				&tos, sizeof tos) == -1 ||
+			setsockopt(*fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+				&ttl, sizeof ttl) == -1)
+		{
+			perror("setsockopt");
+			return -1;
+		}
+	} else {
+		if (setsockopt(*fd, IPPROTO_IP, IP_TOS,
+				&tos, sizeof tos) == -1 ||
+			setsockopt(*fd, IPPROTO_IP, IP_MULTICAST_TTL,
+				&ttl, sizeof ttl) == -1)
+		{
+			perror("setsockopt");
+			return -1;
+		}
+	}
+
+	return *fd;
+}
+
+/*
+ * Set up a free slot for a peer, from any thread, and start sending
+ * to it from socket 'fd', or the shared one if -1
+ */
+
+int fanout_add(struct fanout *f, unsigned int n,
+		const char *addr, int port, uint32_t ssrc, int fd)
+{
+	int r;
+	char service[8];
+	struct addrinfo *ai, hints = {
+		.ai_socktype = SOCK_DGRAM,
+		.ai_flags = AI_NUMERICSERV
+	};
+	struct fanout_peer *p = &f->peer[n];
+
+	if (slot_get(&p->state) != SLOT_FREE) {
+		fprintf(stderr, "Peer %u is in use\n", n);
+		return -1;
+	}
+
+	/* The address must be of the family of the socket given */
+
+	if (fd != -1) {
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof ss;
+
+		if (getsockname(fd, (struct sockaddr *)&ss, &len) == -1) {
+			perror("getsockname");
+			return -1;
+		}
+		hints.ai_family = ss.ss_family;
+	}
+
+	snprintf(service, sizeof service, "%d", port);
+	r = getaddrinfo(addr, service, &hints, &ai);
+	if (r != 0) {
+		fprintf(stderr, "getaddrinfo: %s: %s\n", addr, gai_strerror(r));
+		return -1;
+	}
+
+	p->fd = (fd != -1) ? fd : family_socket(f, ai->ai_family);
+	if (p->fd == -1) {
+		freeaddrinfo(ai);
+		return -1;
+	}
+
+	memcpy(&p->addr, ai->ai_addr, ai->ai_addrlen);
+	p->seq = random();
+	p->sent = p->failed = 0;
+
+	p->header[0] = 0x80; /* version 2 */
+	if (f->stamped)
+		p->header[0] |= 0x10; /* extension */
+	p->header[1] = f->payload_type;
+	ssrc = htonl(ssrc);
+	memcpy(p->header + 8, &ssrc, sizeof ssrc);
+
+	/* The payload is filled in for each frame */
+
+	p->iov[0].iov_base = p->header;
+	p->iov[0].iov_len = RTP_HEADER + (f->stamped ? STAMP_BYTES : 0);
+
+	memset(&p->hdr, 0, sizeof p->hdr);
+	p->hdr.msg_name = &p->addr;
+	p->hdr.msg_namelen = ai->ai_addrlen;
+	p->hdr.msg_iov = p->iov;
+	p->hdr.msg_iovlen = 2;
+
+	freeaddrinfo(ai);
+
+	/* The sender has nothing of its own to reset */
+
+	slot_set(&p->state, SLOT_ACTIVE);
+
+	return 0;
+}
+
+/*
+ * Stop sending to a peer, waiting for any frame in flight; the slot
+ * is free again on return. Returns -1 if the sender did not let go,
+ * leaving the slot to be removed again later, as it may still be in
+ * use
+ */
+
+int fanout_remove(struct fanout *f, unsigned int n)
+{
+	struct fanout_peer *p = &f->peer[n];
+
+	switch (slot_get(&p->state)) {
+	case SLOT_ACTIVE:
+		slot_set(&p->state, SLOT_REMOVING);
+		break;
+	case SLOT_REMOVING:
+	case SLOT_REMOVED:
+		break;
+	default:
+		return 0;
+	}
+
+	if (!slot_wait(&p->state, SLOT_REMOVED, 1000)) {
+		fputs("Sender did not let go of peer; is it running?\n", stderr);
+		return -1;
+	}
+	slot_set(&p->state, SLOT_FREE);
+
+	return 0;
+}
+
+/*
+ * Whether a peer shares its address with the one sent to just before
+ * it this frame, eg. hosts reached through the same relay, which are
+ * listed together
+ */
+
+static bool is_duplicate(const struct fanout *f, unsigned int nr_msg,
+		const struct fanout_peer *p)
+{
+	const struct fanout_peer *q;
+
+	if (nr_msg == 0)
+		return false;
+
+	q = &f->peer[f->index[nr_msg - 1]];
+	return q->hdr.msg_namelen == p->hdr.msg_namelen &&
+		!memcmp(&q->addr, &p->addr, p->hdr.msg_namelen);
+}
+
+/*
+ * Send the payload to every peer (or, if 'each', every peer its own
+ * payload), numbered by each peer's own sequence or as given. A peer
+ * which cannot be sent to is counted and skipped, the same as a
+ * packet lost on the network. Returns the number of packets sent
+ */
+
+static int send_frame(struct fanout *f, const void *const *payload,
+		const size_t *len, bool each, uint32_t ts, const uint16_t *given)
+{
+	unsigned int n, end, start, nr_msg = 0, nr_sent = 0;
+	uint32_t now_us = f->stamped ? stamp_now() : 0;
+
+	ts = htonl(ts);
+
+	/* Gather the messages for the active peers */
+
+	for (n = 0; n < f->nr_peers; n++) {
+		struct fanout_peer *p = &f->peer[n];
+		uint16_t seq;
+
+		switch (slot_get(&p->state)) {
+		case SLOT_ACTIVE:
+			break;
+		case SLOT_REMOVING:
+			slot_set(&p->state, SLOT_REMOVED);
+			/* fall through */
+		default:
+			continue;
+		}
+
+		if (each ? len[n] == 0 : is_duplicate(f, nr_msg, p))
+			continue;
+
+		seq = htons(given ? *given : p->seq++);
+		memcpy(p->header + 2, &seq, sizeof seq);
+		memcpy(p->header + 4, &ts, sizeof ts);
+		if (f->stamped) {
+			stamp_build(p->header + RTP_HEADER, now_us,
+					f->capture_us, f->encode_us, p->echo);
+		}
+
+		p->iov[1].iov_base = (void *)payload[each ? n : 0];
+		p->iov[1].iov_len = len[each ? n : 0];
+
+		f->msg[nr_msg].msg_hdr = p->hdr;
+		f->index[nr_msg] = n;
+		nr_msg++;
+	}
+
+	for (start = 0; start < nr_msg; start = end) {
+		int fd = f->peer[f->index[start]].fd;
+
+		for (end = start; end < nr_msg; end++) {
+			if (f->peer[f->index[end]].fd != fd)
+				break;
+		}
+
+		while (start < end) {
+			int r;
+
+			r = sendmmsg(fd, &f->msg[start], end - start, 0);
+			if (r == -1) {
+				if (errno == EINTR)
+					continue;
+
+				/* The first message failed; report it and move
+				 * on to the rest */
+
+				if (errno != EAGAIN)
+					perror("sendmmsg");
+				f->peer[f->index[start]].failed++;
+				start++;
+				continue;
+			}
+
+			nr_sent += r;
+			for (; r > 0; r--)
+				f->peer[f->index[start++]].sent++;
+		}
+	}
+
+	return nr_sent;
+}
+
+int fanout_send(struct fanout *f, const void *payload, size_t len,
+		uint32_t ts)
+{
+	return send_frame(f, &payload, &len, false, ts, NULL);
+}
+
+/*
+ * Send a packet received from elsewhere, keeping its numbering
+ */
+
+int fanout_forward(struct fanout *f, const void *payload, size_t len,
+		uint16_t seq, uint32_t ts)
+{
+	return send_frame(f, &payload, &len, false, ts, &seq);
+}
+
+/*
+ * Send each peer a payload of its own, in the same batch; a peer
+ * whose length is 0 is sent nothing
+ */
+
+int fanout_send_each(struct fanout *f, const void *const *payload,
+		const size_t *len, uint32_t ts)
+{
+	return send_frame(f, payload, len, true, ts, NULL);
+}
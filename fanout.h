@@ -0,0 +1,81 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "slot.h"
+#include "stamp.h"
+
+/*
+ * Fan-out sender: one encoded frame to many peers
+ *
+ * Each peer has its own RTP header, built when the peer is added;
+ * only the sequence number and timestamp are patched for each frame.
+ * The frame goes out in a single sendmmsg() for each run of peers
+ * sent to from the same socket, in place of a send per peer through
+ * oRTP. Peers next to one another which share an address (as when
+ * reached through a relay) are sent the frame once.
+ *
+ * Each peer is sent to from the socket given for it, normally the
+ * one its own stream arrives on, so that the packets come from the
+ * port the peer sends to (symmetric RTP, and NAT and firewalls which
+ * only let through the replies); each such peer then costs a system
+ * call of its own, as a batch only spans one socket. Given none,
+ * peers share an unbound socket of the fanout's own per address
+ * family, so that a frame goes out to all of them in one system call.
+ *
+ * If 'stamped', each packet also carries the stamps of stamp.h,
+ * with the given capture and encode times of the frame and an echo
+ * from the peer's receiver, if set.
+ *
+ * Peers are held in a fixed number of slots (see slot.h), and may
+ * be added and removed while frames are being sent.
+ */
+
+#define RTP_HEADER 12
+
+struct fanout_peer {
+	slot_t state;
+	struct sockaddr_storage addr;
+	uint16_t seq;
+	unsigned char header[RTP_HEADER + STAMP_BYTES];
+	const struct stamp_rx *echo; /* if given */
+	struct msghdr hdr;
+	struct iovec iov[2];
+	int fd; /* not ours, unless fd4 or fd6 */
+	unsigned long sent, failed;
+};
+
+struct fanout {
+	unsigned int nr_peers;
+	int fd4, fd6;
+	unsigned char payload_type;
+	struct fanout_peer *peer;
+
+	bool stamped; /* set before peers are added */
+	uint16_t capture_us, encode_us; /* of the frame being sent */
+
+	/* The messages for one frame, and the peer each is for */
+
+	struct mmsghdr *msg;
+	unsigned int *index;
+};
+
+struct fanout* fanout_new(unsigned int nr_peers, int payload_type);
+void fanout_free(struct fanout *f);
+
+int fanout_add(struct fanout *f, unsigned int n,
+		const char *addr, int port, uint32_t ssrc, int fd);
+int fanout_remove(struct fanout *f, unsigned int n);
+int fanout_send(struct fanout *f, const void *payload, size_t len,
+		uint32_t ts);
+int fanout_forward(struct fanout *f, const void *payload, size_t len,
+		uint16_t seq, uint32_t ts);
+int fanout_send_each(struct fanout *f, const void *const *payload,
+		const size_t *len, uint32_t ts);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Conversion between device sample formats and float
+ *
+ * Four samples at a time where the CPU allows, with a scalar tail
+ * which rounds the same way
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "format.h"
+
+/* Largest float below 2^31, as 2^31 itself does not convert */
+
+#define S32_MAX_F 2147483520.0f
+#define S32_MIN_F -2147483648.0f
+#define S24_MAX_F 8388607.0f
+#define S24_MIN_F -8388608.0f
+
+int format_parse(const char *name, snd_pcm_format_t *format)
+{
+	if (!strcasecmp(name, "auto"))
+		*format = FORMAT_AUTO;
+	else if (!strcasecmp(name, "s16"))
+		*format = SND_PCM_FORMAT_S16;
+	else if (!strcasecmp(name, "s24"))
+		*format = SND_PCM_FORMAT_S24;
+	else if (!strcasecmp(name, "s32"))
+		*format = SND_PCM_FORMAT_S32;
+	else if (!strcasecmp(name, "float"))
+		*format = SND_PCM_FORMAT_FLOAT;
+	else
+		return -1;
+
+	return 0;
+}
+
+bool format_is_float(snd_pcm_format_t format)
+{
+	return format != SND_PCM_FORMAT_S16;
+}
+
+size_t format_bytes(snd_pcm_format_t format)
+{
+	return format == SND_PCM_FORMAT_S16 ? sizeof(int16_t) : sizeof(int32_t);
+}
+
+size_t format_work_bytes(snd_pcm_format_t format)
+{
+	return format_is_float(format) ? sizeof(float) : sizeof(int16_t);
+}
+
+/*
+ * Whether the device format differs from the working format
+ */
+
+bool format_needs_conversion(snd_pcm_format_t format)
+{
+	return format == SND_PCM_FORMAT_S24 || format == SND_PCM_FORMAT_S32;
+}
+
+static inline float clamp(float x, float min, float max)
+{
+	return x < min ? min : (x > max ? max : x);
+}
+
+void format_to_float(snd_pcm_format_t format, float *out,
+		const void *in, size_t samples)
+{
+	size_t n = 0;
+	const int32_t *s = in;
+
+	switch (format) {
+	case SND_PCM_FORMAT_S32:
+#ifdef __SSE2__
+		for (; n + 4 <= samples; n += 4) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(s + n));
+			_mm_storeu_ps(out + n, _mm_mul_ps(_mm_cvtepi32_ps(x),
+					_mm_set1_ps(1.0f / 2147483648.0f)));
+		}
+#endif
+		for (; n < samples; n++)
+			out[n] = s[n] * (1.0f / 2147483648.0f);
+		break;
+
+	case SND_PCM_FORMAT_S24:
+#ifdef __SSE2__
+		for (; n + 4 <= samples; n += 4) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(s + n));
+			x = _mm_srai_epi32(_mm_slli_epi32(x, 8), 8);
+			_mm_storeu_ps(out + n, _mm_mul_ps(_mm_cvtepi32_ps(x),
+					_mm_set1_ps(1.0f / 8388608.0f)));
+		}
+#endif
+		for (; n < samples; n++)
+			out[n] = ((int32_t)((uint32_t)s[n] << 8) >> 8)
+				* (1.0f / 8388608.0f);
+		break;
+
+	default:
+		abort();
+	}
+}
+
+void format_from_float(snd_pcm_format_t format, void *out,
+		const float *in, size_t samples)
+{
+	size_t n = 0;
+	int32_t *d = out;
+	float scale, min, max;
+
+	switch (format) {
+	case SND_PCM_FORMAT_S32:
+		scale = 2147483648.0f;
+		min = S32_MIN_F;
+		max = S32_MAX_F;
+		break;
+	case SND_PCM_FORMAT_S24:
+		scale = 8388608.0f;
+		min = S24_MIN_F;
+		max = S24_MAX_F;
+		break;
+	default:
+		abort();
+	}
+
+#ifdef __SSE2__
+	{
+		const __m128 vscale = _mm_set1_ps(scale),
+			vmin = _mm_set1_ps(min),
+			vmax = _mm_set1_ps(max);
+
+		for (; n + 4 <= samples; n += 4) {
+			__m128 x = _mm_mul_ps(_mm_loadu_ps(in + n), vscale);
+			x = _mm_max_ps(_mm_min_ps(x, vmax), vmin);
+			_mm_storeu_si128((__m128i*)(d + n), _mm_cvtps_epi32(x));
+		}
+	}
+#endif
+
+	for (; n < samples; n++)
+		d[n] = lrintf(clamp(in[n] * scale, min, max));
+}
@@ -0,0 +1,33 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <alsa/asoundlib.h>
+
+/*
+ * Sample formats
+ *
+ * Audio is worked on as int16_t if the device is S16, so that the
+ * original path is unchanged; otherwise as float (+/-1.0) through
+ * Opus' float interface, converting to and from the device format.
+ * S24 is the low three bytes of a 32-bit word, as in ALSA.
+ */
+
+/* Take whichever the device supports natively, see set_alsa_hw() */
+
+#define FORMAT_AUTO SND_PCM_FORMAT_UNKNOWN
+
+int format_parse(const char *name, snd_pcm_format_t *format);
+
+bool format_is_float(snd_pcm_format_t format);
+size_t format_bytes(snd_pcm_format_t format);
+size_t format_work_bytes(snd_pcm_format_t format);
+
+bool format_needs_conversion(snd_pcm_format_t format);
+void format_to_float(snd_pcm_format_t format, float *out,
+		const void *in, size_t samples);
+void format_from_float(snd_pcm_format_t format, void *out,
+		const float *in, size_t samples);
+
+#endif
@@ -0,0 +1,430 @@
+/*
+ * Microbenchmark of the audio path, a stage at a time: frames are
+ * sent with send_one_frame() and played with play_one_frame() as
+ * fast as they will go, from and to a backend which does not keep
+ * time (see backend.h), over a socket to ourselves
+ *
+ * Each stage is timed on every frame, and reported as percentiles;
+ * on x86 also in cycles of the timestamp counter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "backend.h"
+#include "codec.h"
+#include "defaults.h"
+#include "fanout.h"
+#include "format.h"
+#include "rtp.h"
+#include "rx_alsalib.h"
+#include "stats.h"
+#include "tx_alsalib.h"
+
+#define MAX_VALUES 8
+#define WARMUP 50 /* frames, before timing */
+#define SIGNAL_S 2
+#define RECV_TIMEOUT_MS 1000 /* before a packet is taken as lost */
+
+unsigned int verbose = 0;
+
+enum {
+	STAGE_CAPTURE, /* copy from the device, and any conversion */
+	STAGE_ENCODE,
+	STAGE_SEND,
+	STAGE_RECEIVE,
+	STAGE_DECODE,
+	STAGE_WRITE, /* any conversion, and copy to the device */
+	NR_STAGES
+};
+
+static const char *stage_name[NR_STAGES] = {
+	"capture", "encode", "send", "receive", "decode", "write"
+};
+
+static double cycles_per_ns = 0;
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: framebench [<parameters>]\n"
+		"Measure each stage of sending and playing a frame\n");
+
+	fprintf(fd, "\nParameters:\n");
+	fprintf(fd, "  -f <n,...>  Frame sizes (default 120,240,480,960 samples)\n");
+	fprintf(fd, "  -c <n,...>  Numbers of channels (default 1,2)\n");
+	fprintf(fd, "  -x <n,...>  Opus complexities (default 0,5,10)\n");
+	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n", DEFAULT_RATE);
+	fprintf(fd, "  -b <kbps>   Bitrate (approx., default %d)\n",
+		DEFAULT_BITRATE);
+	fprintf(fd, "  -F <fmt>    Sample format: s16, s24, s32 or float (default %s)\n",
+		DEFAULT_FORMAT);
+	fprintf(fd, "  -i <n>      Frames to time per measurement (default 2000)\n");
+	fprintf(fd, "  -p <port>   UDP port to send to ourselves on (default 5300)\n");
+}
+
+static int parse_list(const char *s, unsigned int *v)
+{
+	unsigned int n = 0;
+	char *end;
+
+	for (;;) {
+		if (n == MAX_VALUES)
+			return -1;
+		v[n++] = strtoul(s, &end, 10);
+		if (end == s)
+			return -1;
+		if (*end == '\0')
+			return n;
+		if (*end != ',')
+			return -1;
+		s = end + 1;
+	}
+}
+
+/*
+ * Rate of the timestamp counter against the monotonic clock, so
+ * that times taken inside the library can be given in cycles
+ */
+
+static void calibrate(void)
+{
+#ifdef HAVE_TSC
+	unsigned long start;
+	unsigned long long tsc;
+	struct timespec ts = { .tv_nsec = 100000000 };
+
+	start = stats_now();
+	tsc = __rdtsc();
+	nanosleep(&ts, NULL);
+	cycles_per_ns = (double)(__rdtsc() - tsc) / (stats_now() - start);
+#endif
+}
+
+/*
+ * Tones and noise, so that the encoder has work to do as it does
+ * not with silence; in the device format, via float
+ */
+
+static void *make_signal(snd_pcm_format_t format, unsigned int rate,
+		unsigned int channels, size_t *len)
+{
+	size_t n, samples = rate * SIGNAL_S * channels;
+	uint32_t seed = 1;
+	float *f;
+	void *pcm;
+
+	f = malloc(sizeof *f * samples);
+	pcm = malloc(format_bytes(format) * samples);
+	if (f == NULL || pcm == NULL) {
+		perror("malloc");
+		free(f);
+		free(pcm);
+		return NULL;
+	}
+
+	for (n = 0; n < samples; n++) {
+		double t = (double)(n / channels) / rate;
+
+		seed = seed * 1103515245 + 12345;
+		f[n] = 0.3 * sin(2 * M_PI * 220 * t)
+			+ 0.2 * sin(2 * M_PI * 1375 * t)
+			+ 0.1 * ((double)(seed >> 16) / 32768 - 1);
+	}
+
+	if (format_needs_conversion(format)) {
+		format_from_float(format, pcm, f, samples);
+	} else if (format_is_float(format)) {
+		memcpy(pcm, f, sizeof *f * samples);
+	} else {
+		for (n = 0; n < samples; n++)
+			((int16_t *)pcm)[n] = f[n] * INT16_MAX;
+	}
+
+	free(f);
+	*len = format_bytes(format) * samples;
+	return pcm;
+}
+
+static int compare(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a,
+		y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(unsigned int frame, unsigned int channels,
+		unsigned int complexity, unsigned int stage,
+		unsigned long *ns, unsigned int n)
+{
+	unsigned long p50, p90, p99, max;
+
+	qsort(ns, n, sizeof *ns, compare);
+	p50 = ns[n / 2];
+	p90 = ns[n * 9 / 10];
+	p99 = ns[n * 99 / 100];
+	max = ns[n - 1];
+
+	printf("%u %u %u %s %lu %lu %lu %lu %.0f %.0f\n",
+		frame, channels, complexity, stage_name[stage],
+		p50, p90, p99, max, p50 * cycles_per_ns, p99 * cycles_per_ns);
+}
+
+struct bench {
+	unsigned int rate, kbps, port, iterations;
+	snd_pcm_format_t format;
+	unsigned long *ns[NR_STAGES];
+};
+
+/*
+ * Send and play the given number of frames, one at a time, timing
+ * each stage
+ */
+
+static int measure(struct bench *b, unsigned int frame,
+		unsigned int channels, unsigned int complexity)
+{
+	struct codec_layout layout;
+	OpusMSEncoder *encoder = NULL;
+	OpusMSDecoder *decoder = NULL;
+	struct backend *source = NULL, *sink = NULL;
+	struct fanout *fanout = NULL;
+	struct rtp *rtp = NULL;
+	struct tx_stream tx;
+	struct rx_stream rx;
+	snd_pcm_format_t format = b->format;
+	void *signal = NULL;
+	size_t signal_len, bytes_per_frame;
+	unsigned int n, s;
+	int r = -1;
+
+	memset(&tx, 0, sizeof tx);
+	memset(&rx, 0, sizeof rx);
+
+	bytes_per_frame = b->kbps * 1024 * frame / b->rate / 8;
+
+	if (codec_layout(&layout, channels, NULL) == -1)
+		return -1;
+	encoder = codec_encoder(&layout, b->rate);
+	decoder = codec_decoder(&layout, b->rate);
+	if (encoder == NULL || decoder == NULL)
+		goto done;
+	opus_multistream_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(complexity));
+
+	/* The source plays the signal in a loop, in place of a file */
+
+	source = backend_open("null", true, b->rate, channels, &format);
+	sink = backend_open("null", false, b->rate, channels, &format);
+	if (source == NULL || sink == NULL)
+		goto done;
+	source->unpaced = sink->unpaced = true;
+
+	signal = make_signal(format, b->rate, channels, &signal_len);
+	if (signal == NULL)
+		goto done;
+	source->data = signal;
+	source->len = signal_len;
+
+	fanout = fanout_new(1, 120);
+	if (fanout == NULL)
+		goto done;
+	if (fanout_add(fanout, 0, "127.0.0.1", b->port, 1, -1) == -1)
+		goto done;
+	rtp = rtp_new("127.0.0.1", b->port);
+	if (rtp == NULL)
+		goto done;
+
+	if (tx_stream_init(&tx, channels, frame, bytes_per_frame, format) == -1)
+		goto done;
+	tx.backend = source;
+	if (rx_stream_init(&rx, channels, MAX_SAMPLES, format) == -1)
+		goto done;
+	rx.backend = sink;
+
+	for (n = 0; n < WARMUP + b->iterations; n++) {
+		struct rtp_packet p;
+		unsigned long start, send, receive, play;
+		int got;
+
+		start = stats_now();
+		if (send_one_frame(NULL, channels, frame, encoder, bytes_per_frame,
+					frame * 8000 / b->rate, 0, NULL, fanout, &tx) == -1)
+		{
+			goto done;
+		}
+		send = stats_now() - start;
+
+		/* Loopback delivers as it sends, but allow for a wait; not
+		 * forever, as the packet may have been dropped */
+
+		start = stats_now();
+		while ((got = rtp_recv(rtp, &p)) == 0) {
+			struct pollfd pfd = { .fd = rtp->fd, .events = POLLIN };
+
+			got = poll(&pfd, 1, RECV_TIMEOUT_MS);
+			if (got == -1) {
+				perror("poll");
+				goto done;
+			}
+			if (got == 0) {
+				fprintf(stderr, "No packet back on port %u\n", b->port);
+				goto done;
+			}
+		}
+		if (got == -1)
+			goto done;
+		receive = stats_now() - start;
+
+		start = stats_now();
+		if (play_one_frame((void *)p.payload, p.len, false, decoder, NULL,
+					channels, &rx) == -1)
+		{
+			goto done;
+		}
+		play = stats_now() - start;
+
+		if (n < WARMUP)
+			continue;
+
+		s = n - WARMUP;
+		b->ns[STAGE_ENCODE][s] = tx.encode_ns;
+		b->ns[STAGE_SEND][s] = tx.send_ns;
+		b->ns[STAGE_CAPTURE][s] = send - tx.encode_ns - tx.send_ns;
+		b->ns[STAGE_RECEIVE][s] = receive;
+		b->ns[STAGE_DECODE][s] = rx.last_decode_ns;
+		b->ns[STAGE_WRITE][s] = play - rx.last_decode_ns;
+	}
+
+	for (s = 0; s < NR_STAGES; s++)
+		report(frame, channels, complexity, s, b->ns[s], b->iterations);
+	fflush(stdout);
+
+	r = 0;
+done:
+	if (tx.pcm)
+		tx_stream_clear(&tx);
+	if (rx.pcm)
+		rx_stream_clear(&rx);
+	if (rtp)
+		rtp_free(rtp);
+	if (fanout)
+		fanout_free(fanout);
+	if (source)
+		backend_close(source);
+	if (sink)
+		backend_close(sink);
+	free(signal);
+	if (encoder)
+		opus_multistream_encoder_destroy(encoder);
+	if (decoder)
+		opus_multistream_decoder_destroy(decoder);
+
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int frames[MAX_VALUES] = { 120, 240, 480, 960 },
+		channels[MAX_VALUES] = { 1, 2 },
+		complexities[MAX_VALUES] = { 0, 5, 10 };
+	int nr_frames = 4, nr_channels = 2, nr_complexities = 3;
+	struct bench b = {
+		.rate = DEFAULT_RATE,
+		.kbps = DEFAULT_BITRATE,
+		.port = 5300,
+		.iterations = 2000
+	};
+	int f, c, x;
+	unsigned int s;
+
+	format_parse(DEFAULT_FORMAT, &b.format);
+
+	for (;;) {
+		int opt;
+
+		opt = getopt(argc, argv, "b:c:f:i:p:r:x:F:");
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'b':
+			b.kbps = atoi(optarg);
+			break;
+		case 'c':
+			nr_channels = parse_list(optarg, channels);
+			break;
+		case 'f':
+			nr_frames = parse_list(optarg, frames);
+			break;
+		case 'i':
+			b.iterations = atoi(optarg);
+			break;
+		case 'p':
+			b.port = atoi(optarg);
+			break;
+		case 'r':
+			b.rate = atoi(optarg);
+			break;
+		case 'x':
+			nr_complexities = parse_list(optarg, complexities);
+			break;
+		case 'F':
+			if (format_parse(optarg, &b.format) == -1) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (nr_frames == -1 || nr_channels == -1 || nr_complexities == -1 ||
+		b.iterations == 0 || b.format == FORMAT_AUTO || optind != argc)
+	{
+		usage(stderr);
+		return -1;
+	}
+
+	for (s = 0; s < NR_STAGES; s++) {
+		b.ns[s] = malloc(sizeof *b.ns[s] * b.iterations);
+		if (b.ns[s] == NULL) {
+			perror("malloc");
+			return -1;
+		}
+	}
+
+	calibrate();
+
+	printf("# rate %u, bitrate %u, format %s, %u frames each\n",
+		b.rate, b.kbps, snd_pcm_format_name(b.format), b.iterations);
+	printf("# frame channels complexity stage "
+		"p50-ns p90-ns p99-ns max-ns p50-cycles p99-cycles\n");
+
+	for (f = 0; f < nr_frames; f++) {
+		for (c = 0; c < nr_channels; c++) {
+			for (x = 0; x < nr_complexities; x++) {
+				if (measure(&b, frames[f], channels[c],
+							complexities[x]) == -1)
+				{
+					return -1;
+				}
+			}
+		}
+	}
+
+	for (s = 0; s < NR_STAGES; s++)
+		free(b.ns[s]);
+
+	return 0;
+}
@@ -0,0 +1,255 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "impair.h"
+
+/* A trace longer than this is taken to be something else */
+
+#define MAX_TRACE (1 << 24)
+
+/* RTP timestamps are 8kHz, see defaults.h */
+
+#define NS_PER_TS 125000
+
+struct arrival {
+	long seq; /* unwrapped, from the first */
+	long transit;
+};
+
+/*
+ * Read a trace as written by rx_runlib.c, one packet per line:
+ * arrival (ns), sequence number, timestamp and length
+ */
+
+struct impair_trace* impair_trace_load(const char *path)
+{
+	struct impair_trace *t = NULL;
+	struct arrival *a = NULL, *grown;
+	unsigned int n, nr = 0, size = 0;
+	unsigned long ns;
+	unsigned int seq, ts;
+	size_t len;
+	uint16_t last_seq = 0;
+	uint32_t last_ts = 0;
+	long ext_seq = 0, ext_ts = 0, first = 0, last = 0, quickest = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	while (fscanf(f, "%lu %u %u %zu", &ns, &seq, &ts, &len) == 4) {
+		if (nr == size) {
+			size = size ? size * 2 : 1024;
+			grown = realloc(a, sizeof *a * size);
+			if (grown == NULL) {
+				perror("realloc");
+				goto fail;
+			}
+			a = grown;
+		}
+
+		if (nr > 0) {
+			ext_seq += (int16_t)(seq - last_seq);
+			ext_ts += (int32_t)(ts - last_ts);
+		}
+		last_seq = seq;
+		last_ts = ts;
+
+		a[nr].seq = ext_seq;
+		a[nr].transit = ns - ext_ts * NS_PER_TS;
+
+		if (nr == 0 || ext_seq < first)
+			first = ext_seq;
+		if (nr == 0 || ext_seq > last)
+			last = ext_seq;
+		if (nr == 0 || a[nr].transit < quickest)
+			quickest = a[nr].transit;
+		nr++;
+	}
+
+	if (nr == 0) {
+		fprintf(stderr, "%s: empty trace\n", path);
+		goto fail;
+	}
+	if (last - first >= MAX_TRACE) {
+		fprintf(stderr, "%s: trace too long\n", path);
+		goto fail;
+	}
+
+	t = calloc(1, sizeof *t);
+	if (t == NULL) {
+		perror("calloc");
+		goto fail;
+	}
+	t->len = last - first + 1;
+	t->delay_ns = malloc(sizeof *t->delay_ns * t->len);
+	if (t->delay_ns == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+
+	/* Whatever did not arrive was lost; of duplicates, the first
+	 * to arrive counts */
+
+	for (n = 0; n < t->len; n++)
+		t->delay_ns[n] = -1;
+	for (n = 0; n < nr; n++) {
+		long *d = &t->delay_ns[a[n].seq - first];
+
+		if (*d == -1)
+			*d = a[n].transit - quickest;
+	}
+
+	free(a);
+	fclose(f);
+	return t;
+
+fail:
+	if (t)
+		impair_trace_free(t);
+	free(a);
+	fclose(f);
+	return NULL;
+}
+
+void impair_trace_free(struct impair_trace *t)
+{
+	free(t->delay_ns);
+	free(t);
+}
+
+void impair_init(struct impair *im, const struct impair_config *c,
+		uint64_t seed)
+{
+	memset(im, 0, sizeof *im);
+	im->c = *c;
+	im->state = seed;
+}
+
+/*
+ * splitmix64; small, and good enough for drawing fates
+ */
+
+static uint64_t next(struct impair *im)
+{
+	uint64_t z = (im->state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Uniform on [0, 1) */
+
+static double uniform(struct impair *im)
+{
+	return (next(im) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static bool chance(struct impair *im, double p)
+{
+	return p > 0 && uniform(im) < p;
+}
+
+/*
+ * Pareto, less its scale so that it starts at zero, and scaled so
+ * that its mean is the jitter asked for
+ */
+
+static unsigned long jitter(struct impair *im)
+{
+	double alpha = im->c.alpha, scale;
+
+	if (im->c.jitter_ns == 0)
+		return 0;
+
+	scale = im->c.jitter_ns * (alpha - 1);
+	return scale * (pow(1 - uniform(im), -1 / alpha) - 1);
+}
+
+/*
+ * The lost packets, and the delays of the others, of the model or
+ * the trace; returns false if the packet is lost
+ */
+
+static bool fate(struct impair *im, unsigned long *delay)
+{
+	const struct impair_trace *t = im->c.trace;
+	bool lost;
+
+	if (t) {
+		long d = t->delay_ns[im->trace_pos];
+
+		im->trace_pos = (im->trace_pos + 1) % t->len;
+		*delay = im->c.delay_ns + (d < 0 ? 0 : d);
+		return d >= 0;
+	}
+
+	lost = chance(im, im->bad ? im->c.burst_loss : im->c.loss);
+	if (im->bad)
+		im->bad = !chance(im, im->c.burst_leave);
+	else
+		im->bad = chance(im, im->c.burst_enter);
+
+	*delay = im->c.delay_ns + jitter(im);
+	if (chance(im, im->c.reorder))
+		*delay += im->c.reorder_ns;
+
+	return !lost;
+}
+
+/*
+ * Decide what becomes of a packet of 'len' bytes, received at 'now':
+ * returns the number of copies to deliver (0, 1, or 2 if duplicated)
+ * and when, in 'deliver'
+ */
+
+unsigned int impair_packet(struct impair *im, unsigned long now, size_t len,
+		unsigned long deliver[2])
+{
+	unsigned long start = now, delay;
+	unsigned int n, copies = 1;
+
+	im->stats.packets++;
+
+	/* Fates are drawn before the queue can drop the packet, so that
+	 * they follow from its place in the stream alone */
+
+	if (!fate(im, &delay)) {
+		im->stats.lost++;
+		return 0;
+	}
+	deliver[0] = delay;
+	if (chance(im, im->c.duplicate)) {
+		copies = 2;
+		deliver[1] = deliver[0] + jitter(im);
+	}
+
+	if (im->c.rate) {
+		if (im->link_free > start)
+			start = im->link_free;
+		if (im->c.queue_ns && start - now > im->c.queue_ns) {
+			im->stats.queue_dropped++;
+			return 0;
+		}
+		im->link_free = start + len * 8 * 1000000000ULL / im->c.rate;
+		start = im->link_free;
+	}
+
+	for (n = 0; n < copies; n++) {
+		deliver[n] += start;
+		if (im->c.keep_order && deliver[n] < im->last_deliver)
+			deliver[n] = im->last_deliver;
+		im->last_deliver = deliver[n];
+	}
+
+	if (copies == 2)
+		im->stats.duplicated++;
+
+	return copies;
+}
@@ -0,0 +1,76 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Models of a poor network, to put between a sender and a receiver
+ * on one machine in place of a real one (see netsim.c)
+ *
+ * The fate of each packet is drawn from a generator seeded up front,
+ * so the same seed gives the same losses and delays on every run:
+ *
+ *   - loss is Gilbert-Elliott, a good and a bad (bursty) state each
+ *     with its own loss, or none at all in the bad state for plain
+ *     random loss
+ *   - jitter is Pareto (Lomax, shifted to start at zero), which has
+ *     the long tail of a real queue; packets overtake one another by
+ *     it, unless order is to be kept
+ *   - a bandwidth cap queues packets behind one another, and drops
+ *     them beyond a given queue
+ *
+ * In place of the loss and jitter models, a trace recorded by rx or
+ * trx with -T can be replayed: losses and delays, relative to the
+ * quickest packet, are taken packet by packet from it, in a loop.
+ *
+ * Times are nanoseconds, on the timescale of stats_now().
+ */
+
+struct impair_config {
+	double loss; /* probabilities, 0 to 1; in the good state */
+	double burst_enter, burst_leave, burst_loss; /* the bad state */
+	double duplicate;
+	double reorder; /* packets held back by reorder_ns more */
+
+	unsigned long delay_ns, jitter_ns, reorder_ns;
+	double alpha; /* of the jitter; the tail is longer as it nears 1 */
+
+	unsigned long rate; /* bits per second, or 0 */
+	unsigned long queue_ns; /* longest wait for the link, or 0 */
+	bool keep_order;
+
+	const struct impair_trace *trace;
+};
+
+struct impair_trace {
+	unsigned int len;
+	long *delay_ns; /* -1 if lost */
+};
+
+struct impair_stats {
+	unsigned long packets, lost, queue_dropped, duplicated;
+};
+
+struct impair {
+	struct impair_config c;
+	uint64_t state; /* of the generator */
+
+	bool bad;
+	unsigned int trace_pos;
+	unsigned long link_free, last_deliver;
+
+	struct impair_stats stats;
+};
+
+struct impair_trace* impair_trace_load(const char *path);
+void impair_trace_free(struct impair_trace *t);
+
+void impair_init(struct impair *im, const struct impair_config *c,
+		uint64_t seed);
+
+unsigned int impair_packet(struct impair *im, unsigned long now, size_t len,
+		unsigned long deliver[2]);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Replay a trace of packet arrivals, as recorded by rx or trx with
+ * -T, through the jitter buffer; so that its parameters can be
+ * compared offline against the same network conditions
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "jbuf.h"
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: jbsim [<parameters>] <trace>\n"
+		"Replay recorded packet arrivals through the jitter buffer\n");
+
+	fprintf(fd, "\nJitter buffer parameters:\n");
+	fprintf(fd, "  -j <ms>     Target, and minimum (default %d milliseconds)\n",
+		DEFAULT_JITTER);
+	fprintf(fd, "  -J <ms>     Maximum (default %d milliseconds)\n",
+		DEFAULT_JITTER_MAX(DEFAULT_JITTER));
+	fprintf(fd, "  -d <ms>     Decay interval (default %d milliseconds)\n",
+		DEFAULT_JITTER_DECAY);
+}
+
+struct arrival {
+	long long ns;
+	unsigned int seq, ts, len;
+};
+
+static int next_arrival(FILE *f, struct arrival *a)
+{
+	return fscanf(f, "%lld %u %u %u", &a->ns, &a->seq, &a->ts,
+			&a->len) == 4;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	struct jbuf *jb;
+	struct arrival a;
+	bool more;
+	long long clock, period_ns;
+	unsigned long periods = 0, depth_sum = 0;
+	static const unsigned char payload[JBUF_MAX_PACKET];
+
+	unsigned int jitter = DEFAULT_JITTER,
+		max = 0,
+		decay = DEFAULT_JITTER_DECAY;
+
+	for (;;) {
+		int c;
+
+		c = getopt(argc, argv, "d:j:J:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			decay = atoi(optarg);
+			break;
+		case 'j':
+			jitter = atoi(optarg);
+			break;
+		case 'J':
+			max = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(stderr);
+		return -1;
+	}
+
+	if (max == 0)
+		max = DEFAULT_JITTER_MAX(jitter);
+
+	f = fopen(argv[optind], "r");
+	if (f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	jb = jbuf_new(jitter, max, decay);
+	if (jb == NULL)
+		return -1;
+
+	more = next_arrival(f, &a);
+	if (!more) {
+		fprintf(stderr, "Empty trace\n");
+		return -1;
+	}
+
+	/* The playout clock starts with the first packet, and ticks
+	 * once per frame when the frame size is known */
+
+	clock = a.ns;
+	period_ns = 0;
+
+	while (more) {
+		const void *packet;
+		size_t len;
+
+		while (more && a.ns <= clock) {
+			jbuf_put(jb, a.seq, a.ts, a.ns, payload, a.len);
+			more = next_arrival(f, &a);
+		}
+
+		if (period_ns == 0) {
+			if (jb->frame_ts == 0) {
+				clock = a.ns;
+				continue;
+			}
+			period_ns = jb->frame_ts * 1000000LL / 8;
+		}
+
+		jbuf_get(jb, &packet, &len);
+
+		depth_sum += jbuf_depth(jb);
+		periods++;
+		clock += period_ns;
+	}
+
+	fclose(f);
+
+	printf("{\n");
+	printf("  \"periods\": %lu,\n", periods);
+	printf("  \"frame-ms\": %.2f,\n", jb->frame_ts / 8.0);
+	printf("  \"mean-depth-ms\": %.2f,\n",
+		periods ? (double)jbuf_ms(jb, 1) * depth_sum / periods : 0.0);
+	printf("  \"final-target-ms\": %u,\n", jbuf_ms(jb, jb->target));
+	printf("  \"jitter-ms\": %.2f,\n", jb->jitter_ns / 1e6);
+	printf("  \"received\": %lu,\n", jb->stats.received);
+	printf("  \"played\": %lu,\n", jb->stats.played);
+	printf("  \"lost\": %lu,\n", jb->stats.lost);
+	printf("  \"late\": %lu,\n", jb->stats.late);
+	printf("  \"early\": %lu,\n", jb->stats.early);
+	printf("  \"duplicate\": %lu,\n", jb->stats.duplicate);
+	printf("  \"fec\": %lu,\n", jb->stats.fec);
+	printf("  \"underrun\": %lu,\n", jb->stats.underrun);
+	printf("  \"dropped\": %lu\n", jb->stats.dropped);
+	printf("}\n");
+
+	jbuf_free(jb);
+
+	return 0;
+}
@@ -0,0 +1,350 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jbuf.h"
+
+#define MASK (JBUF_SLOTS - 1)
+
+/* RTP timestamps follow the RFC, payload 0 has 8kHz reference rate */
+
+#define TS_PER_MS 8
+#define NS_PER_TS (1000000 / TS_PER_MS)
+
+/* The depth kept is at least this many times the jitter, which
+ * covers all but the tail of arrivals */
+
+#define JITTER_MARGIN 3
+
+/* A larger step in transit time is a pause or a restart of the
+ * sender, not jitter */
+
+#define MAX_TRANSIT_NS 1000000000L
+
+struct jbuf* jbuf_new(unsigned int target_ms, unsigned int max_ms,
+		unsigned int decay_ms)
+{
+	struct jbuf *jb;
+
+	jb = malloc(sizeof *jb);
+	if (jb == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+
+	jbuf_init(jb, target_ms, max_ms, decay_ms);
+
+	return jb;
+}
+
+/*
+ * Start over with new parameters, and statistics, as if the buffer
+ * were new
+ */
+
+void jbuf_init(struct jbuf *jb, unsigned int target_ms, unsigned int max_ms,
+		unsigned int decay_ms)
+{
+	jb->target_ms = jb->min_ms = target_ms;
+	jb->max_ms = max_ms > target_ms ? max_ms : target_ms;
+	jb->decay_ms = decay_ms;
+
+	memset(&jb->stats, 0, sizeof jb->stats);
+	jbuf_reset(jb);
+}
+
+void jbuf_free(struct jbuf *jb)
+{
+	free(jb);
+}
+
+/*
+ * Forget all packets and wait to see a stream again, as if just
+ * created; statistics are kept
+ */
+
+void jbuf_reset(struct jbuf *jb)
+{
+	unsigned int n;
+
+	for (n = 0; n < JBUF_SLOTS; n++)
+		jb->slot[n].used = false;
+
+	jb->frame_ts = 0;
+	jb->target = jb->min = jb->max = jb->decay = 0;
+	jb->primed = false;
+	jb->started = false;
+	jb->low = UINT_MAX;
+	jb->periods = 0;
+	jb->hold = 0;
+	jb->last_arrival = 0;
+	jb->played_arrival = 0;
+	jb->jitter_ns = 0;
+}
+
+static unsigned int to_frames(const struct jbuf *jb, unsigned int ms)
+{
+	unsigned int f;
+
+	f = (ms * TS_PER_MS + jb->frame_ts - 1) / jb->frame_ts;
+	return f > 0 ? f : 1;
+}
+
+unsigned int jbuf_ms(const struct jbuf *jb, unsigned int frames)
+{
+	return frames * jb->frame_ts / TS_PER_MS;
+}
+
+/*
+ * The least depth to decay to: the minimum, or enough to cover the
+ * jitter if that is more
+ */
+
+static unsigned int floor_depth(const struct jbuf *jb)
+{
+	unsigned int f;
+
+	f = (JITTER_MARGIN * jb->jitter_ns / NS_PER_TS + jb->frame_ts - 1)
+		/ jb->frame_ts;
+	if (f < jb->min)
+		f = jb->min;
+	if (f > jb->max)
+		f = jb->max;
+
+	return f;
+}
+
+/*
+ * Follow the variation in transit time, as RFC 3550 A.8, in order
+ * of arrival
+ */
+
+static void transit(struct jbuf *jb, uint32_t ts, unsigned long arrival)
+{
+	long d;
+
+	if (arrival == 0)
+		return;
+
+	if (jb->last_arrival != 0) {
+		d = (long)(arrival - jb->last_arrival)
+			- (long)(int32_t)(ts - jb->last_ts) * NS_PER_TS;
+		if (d < 0)
+			d = -d;
+		if (d < MAX_TRANSIT_NS)
+			jb->jitter_ns += (d - jb->jitter_ns) / 16;
+	}
+
+	jb->last_arrival = arrival;
+	jb->last_ts = ts;
+}
+
+/*
+ * The frame size is learned from the first two consecutive packets,
+ * and with it the depths in frames
+ */
+
+static void learn(struct jbuf *jb, uint32_t frame_ts)
+{
+	jb->frame_ts = frame_ts;
+
+	jb->min = to_frames(jb, jb->min_ms);
+	jb->max = to_frames(jb, jb->max_ms);
+	if (jb->max >= JBUF_SLOTS)
+		jb->max = JBUF_SLOTS - 1;
+	if (jb->min > jb->max)
+		jb->min = jb->max;
+
+	jb->target = to_frames(jb, jb->target_ms);
+	if (jb->target < jb->min)
+		jb->target = jb->min;
+	if (jb->target > jb->max)
+		jb->target = jb->max;
+
+	jb->decay = to_frames(jb, jb->decay_ms);
+}
+
+static void attack(struct jbuf *jb)
+{
+	if (jb->target < jb->max) {
+		jb->target++;
+		jb->hold++;
+	}
+
+	jb->low = UINT_MAX;
+	jb->periods = 0;
+}
+
+unsigned int jbuf_depth(const struct jbuf *jb)
+{
+	int16_t d;
+
+	if (!jb->primed)
+		return 0;
+
+	d = jb->newest - jb->next;
+	return d < 0 ? 0 : d + 1;
+}
+
+void jbuf_put(struct jbuf *jb, uint16_t seq, uint32_t ts,
+		unsigned long arrival, const void *data, size_t len)
+{
+	int16_t d;
+	struct jbuf_slot *s, *prev;
+
+	jb->stats.received++;
+	transit(jb, ts, arrival);
+
+	if (len > JBUF_MAX_PACKET) {
+		jb->stats.dropped++;
+		return;
+	}
+
+	if (!jb->primed) {
+		jb->next = jb->newest = seq;
+		jb->primed = true;
+	}
+
+	d = seq - jb->next;
+
+	if (d < 0) {
+		if (jb->started) {
+			jb->stats.late++;
+			attack(jb);
+			return;
+		}
+
+		/* Still buffering, so there is time to play it; unless it
+		 * is too far behind the newest to share the slots */
+
+		if ((int16_t)(jb->newest - seq) >= JBUF_SLOTS) {
+			jb->stats.late++;
+			return;
+		}
+
+		jb->next = seq;
+		d = 0;
+	}
+
+	if (d >= JBUF_SLOTS) {
+		/* The stream has moved on without us, most likely the
+		 * sender restarted */
+
+		jb->stats.early++;
+		jbuf_reset(jb);
+		jb->next = jb->newest = seq;
+		jb->primed = true;
+	}
+
+	s = &jb->slot[seq & MASK];
+	if (s->used && s->seq == seq) {
+		jb->stats.duplicate++;
+		return;
+	}
+
+	s->used = true;
+	s->seq = seq;
+	s->ts = ts;
+	s->arrival = arrival;
+	s->len = len;
+	memcpy(s->data, data, len);
+
+	if ((int16_t)(seq - jb->newest) > 0)
+		jb->newest = seq;
+
+	if (jb->frame_ts == 0) {
+		prev = &jb->slot[(uint16_t)(seq - 1) & MASK];
+		if (prev->used && prev->seq == (uint16_t)(seq - 1)
+				&& ts != prev->ts)
+		{
+			learn(jb, ts - prev->ts);
+		}
+	}
+}
+
+/*
+ * The playout decision, made once per audio period
+ *
+ * Return JBUF_PACKET with the packet to decode next, which remains
+ * valid until the next call to jbuf_put(), or JBUF_MISSING if the
+ * caller should conceal instead.
+ *
+ * Where the packet is lost but the one after it has arrived, return
+ * JBUF_FEC with that packet; it may carry enough of the lost one
+ * (Opus in-band FEC) to recover it. The packet stays in the buffer,
+ * to be returned as usual next time.
+ */
+
+int jbuf_get(struct jbuf *jb, const void **data, size_t *len)
+{
+	unsigned int depth;
+	struct jbuf_slot *s;
+
+	depth = jbuf_depth(jb);
+
+	if (!jb->started) {
+		if (jb->frame_ts == 0 || depth < jb->target)
+			return JBUF_MISSING;
+		jb->started = true;
+	}
+
+	if (depth == 0) {
+		jb->stats.underrun++;
+		jb->started = false;
+		attack(jb);
+		jb->hold = 0;
+		return JBUF_MISSING;
+	}
+
+	if (jb->hold > 0) {
+		jb->hold--;
+		return JBUF_MISSING;
+	}
+
+	/* Decay; if the buffer never came within a frame of its target
+	 * for a whole window, then it is holding more than needed. The
+	 * measured jitter is always covered */
+
+	if (depth < jb->low)
+		jb->low = depth;
+
+	if (++jb->periods >= jb->decay) {
+		if (jb->target > floor_depth(jb))
+			jb->target--;
+
+		if (jb->low > jb->target + 1) {
+			s = &jb->slot[jb->next & MASK];
+			s->used = false;
+			jb->next++;
+			jb->stats.dropped++;
+		}
+
+		jb->low = UINT_MAX;
+		jb->periods = 0;
+	}
+
+	s = &jb->slot[jb->next & MASK];
+	jb->next++;
+
+	if (!s->used || s->seq != (uint16_t)(jb->next - 1)) {
+		jb->stats.lost++;
+
+		s = &jb->slot[jb->next & MASK];
+		if (!s->used || s->seq != jb->next)
+			return JBUF_MISSING;
+
+		jb->stats.fec++;
+		*data = s->data;
+		*len = s->len;
+		return JBUF_FEC;
+	}
+
+	s->used = false;
+	jb->stats.played++;
+	jb->played_arrival = s->arrival;
+	*data = s->data;
+	*len = s->len;
+
+	return JBUF_PACKET;
+}
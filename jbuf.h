@@ -0,0 +1,86 @@
+#ifndef JBUF_H
+#define JBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Jitter buffer: a ring of packets indexed by RTP sequence number
+ *
+ * Packets are put as they arrive, and one is taken for each audio
+ * period. The depth aimed for rises by a frame as soon as a packet
+ * is late or the buffer runs dry (attack), playout being held for
+ * a period to make up the difference, and falls by a frame
+ * each 'decay' period in which that did not happen and the buffer
+ * never came close to empty (decay).
+ *
+ * Given the time each packet arrived, the buffer also follows the
+ * interarrival jitter (as RFC 3550), and does not decay below a
+ * depth which covers it. Arrival times are best taken by the kernel
+ * (see rtp.h), so that our own scheduling is not counted as jitter.
+ */
+
+#define JBUF_SLOTS 64 /* power of two */
+#define JBUF_MAX_PACKET 1500
+
+struct jbuf_slot {
+	bool used;
+	uint16_t seq;
+	uint32_t ts;
+	unsigned long arrival;
+	size_t len;
+	unsigned char data[JBUF_MAX_PACKET];
+};
+
+struct jbuf_stats {
+	unsigned long received, played,
+		lost, /* missing at its turn to play */
+		late, /* arrived after its turn */
+		early, /* too far ahead of the buffer */
+		duplicate,
+		fec, /* lost, but the next packet was at hand to recover it */
+		underrun, /* buffer ran dry */
+		dropped; /* discarded to reduce latency */
+};
+
+struct jbuf {
+	unsigned int target_ms, min_ms, max_ms, decay_ms;
+
+	/* In frames, known once the frame size is */
+
+	unsigned int target, min, max, decay;
+	uint32_t frame_ts;
+
+	bool primed, started;
+	uint16_t next, newest;
+	unsigned int low, periods, hold;
+
+	unsigned long last_arrival; /* nanoseconds, 0 if not known */
+	uint32_t last_ts;
+	long jitter_ns;
+	unsigned long played_arrival; /* of the last packet played */
+
+	struct jbuf_stats stats;
+	struct jbuf_slot slot[JBUF_SLOTS];
+};
+
+#define JBUF_MISSING 0
+#define JBUF_PACKET 1
+#define JBUF_FEC 2
+
+struct jbuf* jbuf_new(unsigned int target_ms, unsigned int max_ms,
+		unsigned int decay_ms);
+void jbuf_free(struct jbuf *jb);
+void jbuf_init(struct jbuf *jb, unsigned int target_ms, unsigned int max_ms,
+		unsigned int decay_ms);
+void jbuf_reset(struct jbuf *jb);
+
+void jbuf_put(struct jbuf *jb, uint16_t seq, uint32_t ts,
+		unsigned long arrival, const void *data, size_t len);
+int jbuf_get(struct jbuf *jb, const void **data, size_t *len);
+
+unsigned int jbuf_depth(const struct jbuf *jb);
+unsigned int jbuf_ms(const struct jbuf *jb, unsigned int frames);
+
+#endif
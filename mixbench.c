@@ -0,0 +1,121 @@
+/*
+ * Microbenchmark of the mixer: the cost of summing one period per
+ * peer, for increasing numbers of peers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "mixer.h"
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: mixbench [<parameters>]\n"
+		"Measure the cost of mixing decoded audio\n");
+
+	fprintf(fd, "\nParameters:\n");
+	fprintf(fd, "  -n <n>      Maximum number of peers (default 32)\n");
+	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
+		DEFAULT_CHANNELS);
+	fprintf(fd, "  -f <n>      Frame size (default %d samples)\n",
+		DEFAULT_FRAME);
+	fprintf(fd, "  -i <n>      Periods to mix per measurement (default 100000)\n");
+	fprintf(fd, "  -g <dB>     Gain applied to every peer (default 0)\n");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int n, p, i;
+	int16_t *out, **in, gain;
+	size_t samples;
+
+	unsigned int peers = 32,
+		channels = DEFAULT_CHANNELS,
+		frame = DEFAULT_FRAME,
+		iterations = 100000;
+	double db = 0.0;
+
+	for (;;) {
+		int c;
+
+		c = getopt(argc, argv, "c:f:g:i:n:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			channels = atoi(optarg);
+			break;
+		case 'f':
+			frame = atoi(optarg);
+			break;
+		case 'g':
+			db = atof(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'n':
+			peers = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	gain = mix_gain(db);
+	samples = frame * channels;
+
+	out = malloc(sizeof(*out) * samples);
+	in = calloc(peers, sizeof(*in));
+	if (out == NULL || in == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (p = 0; p < peers; p++) {
+		in[p] = malloc(sizeof(*in[p]) * samples);
+		if (in[p] == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		for (i = 0; i < samples; i++)
+			in[p][i] = rand();
+	}
+
+	printf("# frame %u, channels %u, gain %d\n", frame, channels, gain);
+	printf("# peers ns/period ns/peer\n");
+
+	for (n = 1; n <= peers; n *= 2) {
+		double start, elapsed;
+
+		start = now();
+		for (i = 0; i < iterations; i++) {
+			mix_clear(out, samples);
+			for (p = 0; p < n; p++)
+				mix_add(out, in[p], samples, gain);
+		}
+		elapsed = (now() - start) / iterations;
+
+		printf("%u %.1f %.1f\n", n, elapsed, elapsed / n);
+	}
+
+	for (p = 0; p < peers; p++)
+		free(in[p]);
+	free(in);
+	free(out);
+
+	return 0;
+}
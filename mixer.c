@@ -0,0 +1,132 @@
+/*
+ * Summing of decoded streams into a single period
+ *
+ * Each input is scaled by its gain and added to the output with
+ * saturation, eight samples at a time where the CPU allows. Float
+ * streams are summed without saturation, leaving the headroom to
+ * the conversion to the device format
+ */
+
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "mixer.h"
+
+int16_t mix_gain(double db)
+{
+	double g;
+
+	g = pow(10.0, db / 20.0) * MIX_UNITY;
+	if (g > INT16_MAX)
+		return INT16_MAX;
+	if (g < 0.0)
+		return 0;
+
+	return (int16_t)lrint(g);
+}
+
+void mix_clear(int16_t *out, size_t samples)
+{
+	memset(out, 0, sizeof(*out) * samples);
+}
+
+static inline int16_t saturate(int32_t x)
+{
+	if (x > INT16_MAX)
+		return INT16_MAX;
+	if (x < INT16_MIN)
+		return INT16_MIN;
+	return x;
+}
+
+void mix_add(int16_t *out, const int16_t *in, size_t samples, int16_t gain)
+{
+	size_t n = 0;
+
+#if defined(__SSE2__)
+	if (gain == MIX_UNITY) {
+		for (; n + 8 <= samples; n += 8) {
+			__m128i a, b;
+
+			a = _mm_loadu_si128((const __m128i*)(out + n));
+			b = _mm_loadu_si128((const __m128i*)(in + n));
+			_mm_storeu_si128((__m128i*)(out + n), _mm_adds_epi16(a, b));
+		}
+	} else {
+		/* pmaddwd of (x, x) against (g, 0) gives x * g in each
+		 * 32-bit lane, without needing SSE4.1 */
+
+		const __m128i g = _mm_set1_epi32((uint16_t)gain);
+
+		for (; n + 8 <= samples; n += 8) {
+			__m128i a, b, lo, hi;
+
+			a = _mm_loadu_si128((const __m128i*)(out + n));
+			b = _mm_loadu_si128((const __m128i*)(in + n));
+
+			lo = _mm_madd_epi16(_mm_unpacklo_epi16(b, b), g);
+			hi = _mm_madd_epi16(_mm_unpackhi_epi16(b, b), g);
+			lo = _mm_srai_epi32(lo, 14);
+			hi = _mm_srai_epi32(hi, 14);
+
+			b = _mm_packs_epi32(lo, hi);
+			_mm_storeu_si128((__m128i*)(out + n), _mm_adds_epi16(a, b));
+		}
+	}
+#elif defined(__ARM_NEON)
+	if (gain == MIX_UNITY) {
+		for (; n + 8 <= samples; n += 8)
+			vst1q_s16(out + n, vqaddq_s16(vld1q_s16(out + n),
+						vld1q_s16(in + n)));
+	} else {
+		for (; n + 8 <= samples; n += 8) {
+			int16x8_t b;
+			int32x4_t lo, hi;
+
+			b = vld1q_s16(in + n);
+			lo = vmull_n_s16(vget_low_s16(b), gain);
+			hi = vmull_n_s16(vget_high_s16(b), gain);
+			b = vcombine_s16(vqshrn_n_s32(lo, 14), vqshrn_n_s32(hi, 14));
+
+			vst1q_s16(out + n, vqaddq_s16(vld1q_s16(out + n), b));
+		}
+	}
+#endif
+
+	for (; n < samples; n++)
+		out[n] = saturate(out[n] + saturate(((int32_t)in[n] * gain) >> 14));
+}
+
+void mix_clear_float(float *out, size_t samples)
+{
+	memset(out, 0, sizeof(*out) * samples);
+}
+
+void mix_add_float(float *out, const float *in, size_t samples, int16_t gain)
+{
+	size_t n = 0;
+	const float g = (float)gain / MIX_UNITY;
+
+#if defined(__SSE2__)
+	const __m128 vg = _mm_set1_ps(g);
+
+	for (; n + 4 <= samples; n += 4) {
+		__m128 a = _mm_loadu_ps(out + n), b = _mm_loadu_ps(in + n);
+		_mm_storeu_ps(out + n, _mm_add_ps(a, _mm_mul_ps(b, vg)));
+	}
+#elif defined(__ARM_NEON)
+	for (; n + 4 <= samples; n += 4)
+		vst1q_f32(out + n, vmlaq_n_f32(vld1q_f32(out + n),
+					vld1q_f32(in + n), g));
+#endif
+
+	for (; n < samples; n++)
+		out[n] += in[n] * g;
+}
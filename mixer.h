@@ -0,0 +1,20 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Gains are fixed point with 14 fractional bits, so just under 2.0
+ * (+6dB) is the maximum */
+
+#define MIX_UNITY (1 << 14)
+
+int16_t mix_gain(double db);
+
+void mix_clear(int16_t *out, size_t samples);
+void mix_add(int16_t *out, const int16_t *in, size_t samples, int16_t gain);
+
+void mix_clear_float(float *out, size_t samples);
+void mix_add_float(float *out, const float *in, size_t samples, int16_t gain);
+
+#endif
@@ -0,0 +1,458 @@
+/*
+ * Forward UDP from one port to another address, through a poor
+ * network of our own (see impair.h); so that rx and trx can be run
+ * under loss and jitter on one machine, and the same conditions had
+ * again with the same seed
+ *
+ * Only the one direction is impaired. On SIGINT or SIGTERM, what was
+ * done to the packets is printed as JSON.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "impair.h"
+#include "stats.h"
+
+#define MAX_PORTS 64
+#define MAX_PACKET 1500
+#define MAX_PENDING 4096 /* packets held at once */
+#define MAX_EVENTS 16
+
+#define DEFAULT_ALPHA 3.0
+
+struct port {
+	int fd;
+	int port;
+	struct sockaddr_storage to;
+	socklen_t tolen;
+	struct impair impair;
+	unsigned long delivered, dropped;
+};
+
+struct pending {
+	unsigned long deliver;
+	unsigned long order; /* of arrival, between equal times */
+	struct port *port;
+	size_t len;
+	unsigned char data[MAX_PACKET];
+};
+
+/* Packets on their way, in a heap by the time they are due; the
+ * entries not in it are kept on a free list */
+
+static struct pending *pending;
+static struct pending **heap, **free_list;
+static unsigned int nr_pending, nr_free;
+static unsigned long order;
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: netsim [<parameters>] <port> <addr> <port>\n"
+		"Forward UDP to <addr>, with loss, delay and reordering\n");
+
+	fprintf(fd, "\nParameters:\n");
+	fprintf(fd, "  -n <n>      Forward this many ports onwards (default 1)\n");
+	fprintf(fd, "  -s <seed>   Seed of the losses and delays (default 1)\n");
+
+	fprintf(fd, "\nNetwork parameters:\n");
+	fprintf(fd, "  -l <%%>      Random loss\n");
+	fprintf(fd, "  -g <%%>,<%%>[,<%%>]  Bursts of loss: chance of starting and of ending\n"
+		"              one, per packet, and the loss in one (default 100%%)\n");
+	fprintf(fd, "  -d <ms>     Delay\n");
+	fprintf(fd, "  -j <ms>[,<alpha>]  Mean jitter, Pareto distributed (default\n"
+		"              alpha %.1f); packets are reordered by it\n", DEFAULT_ALPHA);
+	fprintf(fd, "  -o          Keep packets in order, despite jitter\n");
+	fprintf(fd, "  -r <%%>,<ms> Hold back this many packets by this much more\n");
+	fprintf(fd, "  -u <%%>      Duplicate packets\n");
+	fprintf(fd, "  -b <kbps>   Bandwidth\n");
+	fprintf(fd, "  -q <ms>     Longest queue for the bandwidth, beyond which\n"
+		"              packets are dropped\n");
+	fprintf(fd, "  -t <file>   Replay losses and delays from a trace written by\n"
+		"              rx or trx with -T, in place of -l, -g and -j\n");
+}
+
+static unsigned long ms_to_ns(double ms)
+{
+	return ms * 1000000;
+}
+
+static bool before(const struct pending *a, const struct pending *b)
+{
+	return a->deliver < b->deliver ||
+		(a->deliver == b->deliver && a->order < b->order);
+}
+
+static void heap_push(struct pending *p)
+{
+	unsigned int n = nr_pending++;
+
+	while (n > 0 && before(p, heap[(n - 1) / 2])) {
+		heap[n] = heap[(n - 1) / 2];
+		n = (n - 1) / 2;
+	}
+	heap[n] = p;
+}
+
+static void heap_pop(void)
+{
+	struct pending *last = heap[--nr_pending];
+	unsigned int n = 0, child;
+
+	for (;;) {
+		child = 2 * n + 1;
+		if (child >= nr_pending)
+			break;
+		if (child + 1 < nr_pending && before(heap[child + 1], heap[child]))
+			child++;
+		if (!before(heap[child], last))
+			break;
+		heap[n] = heap[child];
+		n = child;
+	}
+	heap[n] = last;
+}
+
+static int open_port(struct port *p, int listen_port, const char *addr,
+		int port)
+{
+	int r;
+	char service[8];
+	struct addrinfo *ai, hints = {
+		.ai_socktype = SOCK_DGRAM,
+		.ai_flags = AI_NUMERICSERV
+	};
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(listen_port),
+		.sin_addr.s_addr = htonl(INADDR_ANY)
+	};
+
+	snprintf(service, sizeof service, "%d", port);
+	r = getaddrinfo(addr, service, &hints, &ai);
+	if (r != 0) {
+		fprintf(stderr, "getaddrinfo: %s: %s\n", addr, gai_strerror(r));
+		return -1;
+	}
+	memcpy(&p->to, ai->ai_addr, ai->ai_addrlen);
+	p->tolen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	p->port = listen_port;
+	p->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (p->fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (bind(p->fd, (struct sockaddr*)&sin, sizeof sin) == -1) {
+		perror("bind");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Take everything waiting on a port, and decide its fate
+ */
+
+static int receive(struct port *p)
+{
+	struct pending *e;
+	unsigned long deliver[2];
+	unsigned int n, copies;
+	ssize_t len;
+
+	for (;;) {
+		unsigned char buf[MAX_PACKET];
+
+		len = recv(p->fd, buf, sizeof buf, MSG_DONTWAIT);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			perror("recv");
+			return -1;
+		}
+
+		copies = impair_packet(&p->impair, stats_now(), len, deliver);
+
+		for (n = 0; n < copies; n++) {
+			if (nr_free == 0) {
+				p->dropped++;
+				continue;
+			}
+			e = free_list[--nr_free];
+			e->deliver = deliver[n];
+			e->order = order++;
+			e->port = p;
+			e->len = len;
+			memcpy(e->data, buf, len);
+			heap_push(e);
+		}
+	}
+}
+
+/*
+ * Send whatever is due, and wake again when the next is
+ */
+
+static int deliver(int timer)
+{
+	struct itimerspec its = { };
+	unsigned long now = stats_now();
+	struct pending *e;
+	struct port *p;
+
+	while (nr_pending && heap[0]->deliver <= now) {
+		e = heap[0];
+		p = e->port;
+		heap_pop();
+
+		if (sendto(p->fd, e->data, e->len, 0, (struct sockaddr*)&p->to,
+					p->tolen) == -1)
+		{
+			if (errno != ECONNREFUSED && errno != EAGAIN) {
+				perror("sendto");
+				return -1;
+			}
+			p->dropped++;
+		} else {
+			p->delivered++;
+		}
+		free_list[nr_free++] = e;
+	}
+
+	if (nr_pending) {
+		its.it_value.tv_sec = heap[0]->deliver / 1000000000;
+		its.it_value.tv_nsec = heap[0]->deliver % 1000000000;
+	}
+	if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void print_stats(const struct port *port, unsigned int nr_ports)
+{
+	unsigned int n;
+
+	printf("[\n");
+	for (n = 0; n < nr_ports; n++) {
+		const struct port *p = &port[n];
+		const struct impair_stats *s = &p->impair.stats;
+
+		printf("  {\"port\": %d, \"packets\": %lu, \"lost\": %lu, "
+			"\"queue-dropped\": %lu, \"duplicated\": %lu, "
+			"\"delivered\": %lu, \"dropped\": %lu}%s\n",
+			p->port, s->packets, s->lost, s->queue_dropped,
+			s->duplicated, p->delivered, p->dropped,
+			n + 1 < nr_ports ? "," : "");
+	}
+	printf("]\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct impair_config config = { .alpha = DEFAULT_ALPHA };
+	struct port port[MAX_PORTS];
+	struct epoll_event ev;
+	sigset_t set;
+	double a, b, c;
+	int epfd, timer, sigfd, listen_port, to_port;
+	unsigned int n, nr_ports = 1;
+	unsigned long seed = 1;
+	const char *trace = NULL;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt(argc, argv, "b:d:g:j:l:n:oq:r:s:t:u:");
+		if (opt == -1)
+			break;
+
+		switch (opt) {
+		case 'b':
+			config.rate = atol(optarg) * 1000;
+			break;
+		case 'd':
+			config.delay_ns = ms_to_ns(atof(optarg));
+			break;
+		case 'g':
+			c = 100;
+			if (sscanf(optarg, "%lf,%lf,%lf", &a, &b, &c) < 2) {
+				usage(stderr);
+				return -1;
+			}
+			config.burst_enter = a / 100;
+			config.burst_leave = b / 100;
+			config.burst_loss = c / 100;
+			break;
+		case 'j':
+			b = DEFAULT_ALPHA;
+			if (sscanf(optarg, "%lf,%lf", &a, &b) < 1 || b <= 1) {
+				fprintf(stderr, "Jitter alpha must be more than 1\n");
+				return -1;
+			}
+			config.jitter_ns = ms_to_ns(a);
+			config.alpha = b;
+			break;
+		case 'l':
+			config.loss = atof(optarg) / 100;
+			break;
+		case 'n':
+			nr_ports = atoi(optarg);
+			break;
+		case 'o':
+			config.keep_order = true;
+			break;
+		case 'q':
+			config.queue_ns = ms_to_ns(atof(optarg));
+			break;
+		case 'r':
+			if (sscanf(optarg, "%lf,%lf", &a, &b) != 2) {
+				usage(stderr);
+				return -1;
+			}
+			config.reorder = a / 100;
+			config.reorder_ns = ms_to_ns(b);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		case 'u':
+			config.duplicate = atof(optarg) / 100;
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 3 || nr_ports < 1 || nr_ports > MAX_PORTS) {
+		usage(stderr);
+		return -1;
+	}
+	listen_port = atoi(argv[optind]);
+	to_port = atoi(argv[optind + 2]);
+
+	if (trace) {
+		config.trace = impair_trace_load(trace);
+		if (config.trace == NULL)
+			return -1;
+	}
+
+	pending = malloc(sizeof *pending * MAX_PENDING);
+	heap = malloc(sizeof *heap * MAX_PENDING);
+	free_list = malloc(sizeof *free_list * MAX_PENDING);
+	if (pending == NULL || heap == NULL || free_list == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	for (n = 0; n < MAX_PENDING; n++)
+		free_list[nr_free++] = &pending[n];
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	/* Each port draws from its own generator, so that what happens
+	 * on one does not depend on the traffic on another */
+
+	memset(port, 0, sizeof port);
+	for (n = 0; n < nr_ports; n++) {
+		if (open_port(&port[n], listen_port + n, argv[optind + 1],
+					to_port + n) == -1)
+		{
+			return -1;
+		}
+		impair_init(&port[n].impair, &config, seed + n);
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &port[n];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, port[n].fd, &ev) == -1) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &timer;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, timer, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &set, NULL) == -1) {
+		perror("sigprocmask");
+		return -1;
+	}
+	sigfd = signalfd(-1, &set, SFD_CLOEXEC);
+	if (sigfd == -1) {
+		perror("signalfd");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &sigfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	for (;;) {
+		struct epoll_event events[MAX_EVENTS];
+		int e, z;
+
+		z = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (z == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		for (e = 0; e < z; e++) {
+			void *p = events[e].data.ptr;
+
+			if (p == &sigfd) {
+				print_stats(port, nr_ports);
+				return 0;
+			}
+			if (p != &timer && receive(p) == -1)
+				return -1;
+		}
+
+		/* The timer is only ever read by being set again */
+
+		if (deliver(timer) == -1)
+			return -1;
+	}
+}
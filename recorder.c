@@ -0,0 +1,512 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+/* Room on each stream's ring, about a second of the highest bitrate */
+
+#define RING_SIZE (128 * 1024)
+
+/* Pages are kept until there is this much to write */
+
+#define BUFFER_SIZE (256 * 1024)
+
+/* The writer wakes this often, and writes out anything it has held
+ * for IDLE_PASSES */
+
+#define TICK_MS 20
+#define IDLE_PASSES 250
+
+/* A page holds up to a second of audio */
+
+#define PAGE_GRANULES 48000
+
+/* Ogg Opus counts in samples at 48kHz; RTP time is at 8kHz, see
+ * rx_runlib.c */
+
+#define GRANULES_PER_TS 6
+
+/* A gap longer than this is not filled with lost frames, the sender
+ * having most likely started again */
+
+#define MAX_GAP_TS (8000 * 2)
+
+/* The encoder's lookahead at 48kHz, as set up by codec.c */
+
+#define PRE_SKIP 312
+
+#define VENDOR "trx"
+
+extern unsigned int verbose;
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+	unsigned int n, k;
+
+	for (n = 0; n < 256; n++) {
+		uint32_t c = n << 24;
+
+		for (k = 0; k < 8; k++)
+			c = c & 0x80000000 ? c << 1 ^ 0x04c11db7 : c << 1;
+		crc_table[n] = c;
+	}
+}
+
+static uint32_t crc(const unsigned char *p, size_t len)
+{
+	uint32_t c = 0;
+
+	while (len--)
+		c = c << 8 ^ crc_table[(c >> 24) ^ *p++];
+
+	return c;
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+/*
+ * Write out the pages held; if that fails, the rest of the
+ * recording is thrown away
+ */
+
+static void write_out(struct record_stream *s)
+{
+	size_t done = 0;
+
+	while (s->fd != -1 && done < s->buf_len) {
+		ssize_t z;
+
+		z = write(s->fd, s->buf + done, s->buf_len - done);
+		if (z == -1) {
+			if (errno == EINTR)
+				continue;
+			perror(s->path);
+			close(s->fd);
+			s->fd = -1;
+			break;
+		}
+		done += z;
+	}
+
+	s->buf_len = 0;
+	s->idle = 0;
+}
+
+#define OGG_BOS 0x2
+#define OGG_EOS 0x4
+
+static void flush_page(struct record_stream *s, int flags)
+{
+	unsigned char *p;
+	size_t len;
+
+	len = 27 + s->segments + s->body_len;
+	if (s->buf_len + len > BUFFER_SIZE)
+		write_out(s);
+
+	p = s->buf + s->buf_len;
+	memcpy(p, "OggS", 4);
+	p[4] = 0; /* version */
+	p[5] = flags;
+	put64(p + 6, s->granule);
+	put32(p + 14, s->serial);
+	put32(p + 18, s->page_no++);
+	put32(p + 22, 0);
+	p[26] = s->segments;
+	memcpy(p + 27, s->lacing, s->segments);
+	memcpy(p + 27 + s->segments, s->body, s->body_len);
+	put32(p + 22, crc(p, len));
+
+	s->buf_len += len;
+	s->segments = 0;
+	s->body_len = 0;
+	s->page_start = s->granule;
+}
+
+static void add_packet(struct record_stream *s, const unsigned char *packet,
+		size_t len, unsigned int granules)
+{
+	unsigned int segments = len / 255 + 1;
+
+	if (s->segments + segments > sizeof s->lacing ||
+			s->granule - s->page_start >= PAGE_GRANULES)
+	{
+		flush_page(s, 0);
+	}
+
+	memset(s->lacing + s->segments, 255, segments - 1);
+	s->lacing[s->segments + segments - 1] = len % 255;
+	s->segments += segments;
+
+	memcpy(s->body + s->body_len, packet, len);
+	s->body_len += len;
+
+	s->granule += granules;
+}
+
+/*
+ * The identification and comment headers, each on a page of its
+ * own (RFC 7845)
+ */
+
+static void write_headers(struct record_stream *s)
+{
+	const struct codec_layout *l = s->layout;
+	unsigned char h[21 + CODEC_MAX_CHANNELS];
+	size_t len = 19;
+	unsigned int n;
+	bool simple;
+
+	memcpy(h, "OpusHead", 8);
+	h[8] = 1; /* version */
+	h[9] = l->channels;
+	put16(h + 10, PRE_SKIP);
+	put32(h + 12, s->rate);
+	put16(h + 16, 0); /* gain */
+
+	/* One or two channels in a single stream need no table */
+
+	simple = l->streams == 1 && l->coupled == (int)l->channels - 1;
+	for (n = 0; n < l->channels; n++) {
+		if (l->mapping[n] != n)
+			simple = false;
+	}
+
+	if (simple) {
+		h[18] = 0;
+	} else {
+		h[18] = 255;
+		h[19] = l->streams;
+		h[20] = l->coupled;
+		memcpy(h + 21, l->mapping, l->channels);
+		len = 21 + l->channels;
+	}
+
+	add_packet(s, h, len, 0);
+	flush_page(s, OGG_BOS);
+
+	memcpy(h, "OpusTags", 8);
+	put32(h + 8, strlen(VENDOR));
+	memcpy(h + 12, VENDOR, strlen(VENDOR));
+	put32(h + 12 + strlen(VENDOR), 0); /* comments */
+
+	add_packet(s, h, 16 + strlen(VENDOR), 0);
+	flush_page(s, 0);
+}
+
+/*
+ * Record frames lost before this packet, as a packet of the same
+ * kind whose frame in each stream is empty, which a decoder
+ * conceals (RFC 6716, section 3.2.1)
+ */
+
+static void fill_gap(struct record_stream *s, unsigned char toc,
+		uint32_t gap)
+{
+	unsigned char filler[2 * CODEC_MAX_CHANNELS];
+	size_t len = 0;
+	int n, granules;
+
+	/* Every stream but the last is self-delimited (appendix B) */
+
+	for (n = 0; n < s->layout->streams - 1; n++) {
+		filler[len++] = toc & 0xfc;
+		filler[len++] = 0;
+	}
+	filler[len++] = toc & 0xfc;
+
+	granules = opus_packet_get_nb_samples(filler, len, 48000);
+	if (granules <= 0)
+		return;
+
+	while (gap * GRANULES_PER_TS >= (unsigned int)granules) {
+		add_packet(s, filler, len, granules);
+		gap -= granules / GRANULES_PER_TS;
+	}
+}
+
+static void record_packet(struct record_stream *s, uint32_t ts,
+		const unsigned char *packet, size_t len)
+{
+	int granules;
+	int32_t gap;
+
+	granules = opus_packet_get_nb_samples(packet, len, 48000);
+	if (granules <= 0)
+		return;
+
+	if (!s->started) {
+		write_headers(s);
+		s->next_ts = ts;
+		s->started = true;
+	}
+
+	gap = ts - s->next_ts;
+	if (gap < 0)
+		return; /* late, or a duplicate */
+	if (gap <= MAX_GAP_TS)
+		fill_gap(s, packet[0], gap);
+
+	add_packet(s, packet, len, granules);
+	s->next_ts = ts + granules / GRANULES_PER_TS;
+}
+
+static void drain(struct record_stream *s)
+{
+	const unsigned char *r;
+	size_t len;
+	unsigned long overflows;
+
+	while ((r = ring_peek(&s->ring, &len)) != NULL) {
+		uint32_t ts;
+
+		memcpy(&ts, r, sizeof ts);
+		record_packet(s, ts, r + sizeof ts, len - sizeof ts);
+		ring_release(&s->ring);
+	}
+
+	overflows = atomic_load_explicit(&s->overflows, memory_order_relaxed);
+	if (overflows != s->reported) {
+		fprintf(stderr, "%s: %lu packets not recorded\n",
+			s->path, overflows - s->reported);
+		s->reported = overflows;
+	}
+}
+
+static void stream_free(struct record_stream *s)
+{
+	ring_clear(&s->ring);
+	free(s->buf);
+	free(s->path);
+	free(s);
+}
+
+static void finish(struct record_stream *s)
+{
+	if (s->started) {
+		flush_page(s, OGG_EOS);
+		write_out(s);
+	}
+
+	if (s->fd != -1 && close(s->fd) == -1)
+		perror(s->path);
+
+	if (verbose)
+		fprintf(stderr, "Recorded %s\n", s->path);
+
+	stream_free(s);
+}
+
+static void* run_writer(void *arg)
+{
+	struct recorder *r = arg;
+	const struct timespec tick = { .tv_nsec = TICK_MS * 1000000 };
+
+	for (;;) {
+		bool quit;
+		unsigned int n;
+
+		quit = atomic_load(&r->quit);
+
+		for (n = 0; n < r->nr_streams; n++) {
+			struct record_stream *s;
+			bool closing;
+
+			s = atomic_load(&r->stream[n]);
+			if (s == NULL)
+				continue;
+
+			/* Anything put before the close is on the ring */
+
+			closing = atomic_load(&s->closing);
+			drain(s);
+
+			if (closing || quit) {
+				atomic_store(&r->stream[n], NULL);
+				finish(s);
+			} else if (s->buf_len && ++s->idle >= IDLE_PASSES) {
+				write_out(s);
+			}
+		}
+
+		if (quit)
+			return NULL;
+
+		nanosleep(&tick, NULL);
+	}
+}
+
+struct recorder* recorder_new(unsigned int nr_streams,
+		const struct codec_layout *layout, unsigned int rate)
+{
+	struct recorder *r;
+
+	r = calloc(1, sizeof *r);
+	if (r == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	r->stream = calloc(nr_streams, sizeof *r->stream);
+	if (r->stream == NULL) {
+		perror("calloc");
+		free(r);
+		return NULL;
+	}
+
+	r->layout = *layout;
+	r->rate = rate;
+	r->nr_streams = nr_streams;
+	crc_init();
+
+	return r;
+}
+
+/*
+ * Start the writer, which never runs at realtime priority even if
+ * whoever starts it does
+ */
+
+int recorder_start(struct recorder *r)
+{
+	pthread_attr_t attr;
+	struct sched_param param = { .sched_priority = 0 };
+	int err;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &param);
+
+	err = pthread_create(&r->thread, &attr, run_writer, r);
+	pthread_attr_destroy(&attr);
+	if (err != 0) {
+		errno = err;
+		perror("pthread_create");
+		return -1;
+	}
+	r->started = true;
+
+	return 0;
+}
+
+/*
+ * Finish every recording and stop the writer
+ */
+
+void recorder_free(struct recorder *r)
+{
+	atomic_store(&r->quit, true);
+	if (r->started)
+		pthread_join(r->thread, NULL);
+	else
+		run_writer(r);
+
+	free(r->stream);
+	free(r);
+}
+
+struct record_stream* record_open(struct recorder *r, const char *path)
+{
+	struct record_stream *s;
+	unsigned int n;
+
+	for (n = 0; n < r->nr_streams; n++) {
+		if (atomic_load(&r->stream[n]) == NULL)
+			break;
+	}
+	if (n == r->nr_streams) {
+		fprintf(stderr, "Too many recordings\n");
+		return NULL;
+	}
+
+	s = calloc(1, sizeof *s);
+	if (s == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	s->fd = -1;
+
+	if (ring_init(&s->ring, RING_SIZE) == -1) {
+		free(s);
+		return NULL;
+	}
+
+	s->path = strdup(path);
+	s->buf = malloc(BUFFER_SIZE);
+	if (s->path == NULL || s->buf == NULL) {
+		perror("malloc");
+		stream_free(s);
+		return NULL;
+	}
+
+	s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (s->fd == -1) {
+		perror(path);
+		stream_free(s);
+		return NULL;
+	}
+
+	s->layout = &r->layout;
+	s->rate = r->rate;
+	s->serial = time(NULL) ^ (uintptr_t)s;
+
+	atomic_store(&r->stream[n], s);
+
+	return s;
+}
+
+/*
+ * Hand the stream back to the writer to finish; it must no longer
+ * be given packets
+ */
+
+void record_close(struct record_stream *s)
+{
+	atomic_store(&s->closing, true);
+}
+
+/*
+ * Called from the receiving thread, for each packet as it arrives
+ */
+
+void record_put(struct record_stream *s, uint32_t ts,
+		const void *packet, size_t len)
+{
+	unsigned char *r;
+
+	r = ring_reserve(&s->ring, sizeof ts + len);
+	if (r == NULL) {
+		atomic_fetch_add_explicit(&s->overflows, 1,
+				memory_order_relaxed);
+		return;
+	}
+
+	memcpy(r, &ts, sizeof ts);
+	memcpy(r + sizeof ts, packet, len);
+	ring_commit(&s->ring, sizeof ts + len);
+}
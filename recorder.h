@@ -0,0 +1,84 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "codec.h"
+#include "ring.h"
+
+/*
+ * Recording of received streams, as Ogg Opus files
+ *
+ * Packets are recorded as they arrive, without being decoded. The
+ * receiving thread puts each one on a ring for its stream, and a
+ * writer thread of ordinary priority turns them into Ogg pages and
+ * writes them out in large blocks, so that the disk never holds up
+ * the audio path. If the writer falls so far behind that a ring is
+ * full, packets are left out of the recording.
+ *
+ * Streams may be opened before the writer is started, and opened
+ * and closed while it runs.
+ *
+ * Packets which arrive late are left out, and those lost are
+ * recorded as such (empty frames) so that the recording keeps time
+ * with the sender.
+ */
+
+struct record_stream {
+	struct ring ring;
+	atomic_bool closing;
+	atomic_ulong overflows; /* packets the ring had no room for */
+
+	/* Used by the writer only */
+
+	int fd;
+	char *path;
+	const struct codec_layout *layout;
+	unsigned int rate;
+
+	uint32_t serial, page_no;
+	bool started;
+	uint32_t next_ts; /* expected of the next packet */
+	uint64_t granule;
+	unsigned long reported;
+
+	/* The page being built */
+
+	unsigned char lacing[255];
+	unsigned int segments;
+	unsigned char body[255 * 255];
+	size_t body_len;
+	uint64_t page_start; /* granule */
+
+	unsigned char *buf; /* pages not yet written */
+	size_t buf_len;
+	unsigned int idle; /* writer passes since 'buf' was last written */
+};
+
+struct recorder {
+	struct codec_layout layout; /* of every stream */
+	unsigned int rate;
+
+	pthread_t thread;
+	bool started;
+	atomic_bool quit;
+
+	unsigned int nr_streams;
+	_Atomic(struct record_stream*) *stream;
+};
+
+struct recorder* recorder_new(unsigned int nr_streams,
+		const struct codec_layout *layout, unsigned int rate);
+int recorder_start(struct recorder *r);
+void recorder_free(struct recorder *r);
+
+struct record_stream* record_open(struct recorder *r, const char *path);
+void record_close(struct record_stream *s);
+
+void record_put(struct record_stream *s, uint32_t ts,
+		const void *packet, size_t len);
+
+#endif
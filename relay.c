@@ -0,0 +1,287 @@
+#define _GNU_SOURCE /* recvmmsg */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "jbuf.h"
+#include "relay.h"
+#include "rtp.h"
+
+#define MAX_EVENTS 64
+
+/* Payload type of the forwarded streams, as trx_rtplib.c */
+
+#define PAYLOAD_TYPE 120
+
+/* A jump in sequence numbers beyond this is taken as the sender
+ * starting again */
+
+#define MAX_JUMP 1000
+
+struct relay* relay_new(unsigned int nr_sources)
+{
+	struct relay *r;
+	unsigned int n;
+
+	r = calloc(1, sizeof *r);
+	if (r == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	r->source = calloc(nr_sources, sizeof *r->source);
+	if (r->source == NULL) {
+		perror("calloc");
+		free(r);
+		return NULL;
+	}
+	r->nr_sources = nr_sources;
+	for (n = 0; n < nr_sources; n++)
+		r->source[n].fd = -1;
+
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd == -1) {
+		perror("epoll_create1");
+		relay_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+void relay_free(struct relay *r)
+{
+	unsigned int n;
+
+	for (n = 0; n < r->nr_sources; n++) {
+		struct relay_source *s = &r->source[n];
+
+		if (s->fd != -1)
+			close(s->fd);
+		if (s->out)
+			fanout_free(s->out);
+		free(s->addr);
+	}
+
+	if (r->epfd != -1)
+		close(r->epfd);
+	free(r->source);
+	free(r);
+}
+
+static int listen_on(int port)
+{
+	int fd;
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY)
+	};
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr*)&sin, sizeof sin) == -1) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Take participant 'n', heard on 'rx_port' and listening at 'addr'
+ * and 'port' onwards, and join it up with those added before it
+ */
+
+int relay_add(struct relay *r, unsigned int n, int rx_port, uint32_t ssrc,
+		const char *addr, int port, struct stats_peer *stats)
+{
+	struct relay_source *s = &r->source[n];
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = s
+	};
+	unsigned int m;
+
+	s->fd = listen_on(rx_port);
+	if (s->fd == -1)
+		return -1;
+
+	s->out = fanout_new(r->nr_sources, PAYLOAD_TYPE);
+	if (s->out == NULL)
+		return -1;
+
+	s->addr = strdup(addr);
+	if (s->addr == NULL) {
+		perror("strdup");
+		return -1;
+	}
+	s->ssrc = ssrc;
+	s->port = port;
+	s->stats = stats;
+
+	for (m = 0; m < n; m++) {
+		struct relay_source *t = &r->source[m];
+
+		if (fanout_add(s->out, m, t->addr, t->port + 2 * n, s->ssrc,
+					t->fd) == -1)
+		{
+			return -1;
+		}
+		if (fanout_add(t->out, n, s->addr, s->port + 2 * m, t->ssrc,
+					s->fd) == -1)
+		{
+			return -1;
+		}
+	}
+
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, s->fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	if (stats) {
+		stats->ssrc = ssrc;
+		stats->rx_port = rx_port;
+		stats->tx_port = port;
+		snprintf(stats->tx_addr, sizeof stats->tx_addr, "%s", addr);
+		stats_set(&stats->active, 1);
+	}
+
+	return 0;
+}
+
+/*
+ * Map the sender's numbering onto our own, which carries on from
+ * the last packet forwarded if the sender starts again
+ */
+
+static void renumber(struct relay_source *s, uint32_t ssrc,
+		uint16_t *seq, uint32_t *ts)
+{
+	int16_t d = *seq - s->last_seq;
+	bool restart;
+
+	restart = s->started &&
+		(ssrc != s->in_ssrc || d > MAX_JUMP || d < -MAX_JUMP);
+
+	if (!s->started) {
+		s->seq_offset = random();
+		s->ts_offset = random();
+	} else if (restart) {
+		s->seq_offset = (uint16_t)(s->last_seq + s->seq_offset + 1) - *seq;
+		s->ts_offset = s->last_ts + s->ts_offset + s->frame_ts - *ts;
+	}
+
+	if (!s->started || restart || d > 0) {
+		if (d == 1 && !restart)
+			s->frame_ts = *ts - s->last_ts;
+		s->last_seq = *seq;
+		s->last_ts = *ts;
+		s->in_ssrc = ssrc;
+		s->started = true;
+	}
+
+	*seq += s->seq_offset;
+	*ts += s->ts_offset;
+}
+
+/*
+ * Pass on one packet, less its RTP header; returns the number of
+ * participants it was sent to, or -1 if it is not an RTP packet
+ */
+
+static int forward(struct relay_source *s, const unsigned char *p, size_t len)
+{
+	struct rtp_packet packet;
+
+	if (rtp_parse(p, len, &packet) == -1)
+		return -1;
+
+	renumber(s, packet.ssrc, &packet.seq, &packet.ts);
+
+	return fanout_forward(s->out, packet.payload, packet.len,
+			packet.seq, packet.ts);
+}
+
+/*
+ * Forward everything waiting from a participant, a batch at a time
+ */
+
+static int drain(struct relay_source *s)
+{
+	unsigned char buf[RELAY_BATCH][JBUF_MAX_PACKET];
+	struct iovec iov[RELAY_BATCH];
+	struct mmsghdr msg[RELAY_BATCH];
+	unsigned int n;
+	int r;
+
+	for (n = 0; n < RELAY_BATCH; n++) {
+		iov[n].iov_base = buf[n];
+		iov[n].iov_len = sizeof buf[n];
+		memset(&msg[n].msg_hdr, 0, sizeof msg[n].msg_hdr);
+		msg[n].msg_hdr.msg_iov = &iov[n];
+		msg[n].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (;;) {
+		r = recvmmsg(s->fd, msg, RELAY_BATCH, MSG_DONTWAIT, NULL);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			perror("recvmmsg");
+			return -1;
+		}
+
+		for (n = 0; n < (unsigned int)r; n++) {
+			int sent = forward(s, buf[n], msg[n].msg_len);
+
+			if (sent == -1) {
+				if (s->stats)
+					stats_add(&s->stats->dropped, 1);
+				continue;
+			}
+			if (s->stats) {
+				stats_add(&s->stats->received, 1);
+				stats_add(&s->stats->sent, sent);
+			}
+		}
+
+		if (r < RELAY_BATCH)
+			return 0;
+	}
+}
+
+void* run_relay(struct relay *r)
+{
+	for (;;) {
+		struct epoll_event ev[MAX_EVENTS];
+		int n, z;
+
+		z = epoll_wait(r->epfd, ev, MAX_EVENTS, -1);
+		if (z == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return (void*)-1;
+		}
+
+		for (n = 0; n < z; n++) {
+			if (drain(ev[n].data.ptr) == -1)
+				return (void*)-1;
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fanout.h"
+#include "stats.h"
+
+/*
+ * Selective forwarding: each participant sends its stream to the
+ * relay once, and the relay passes every packet on to all the other
+ * participants, as it arrives and without decoding it.
+ *
+ * Participant n is heard on its own port, and its stream is sent to
+ * each other participant at their address and port + 2n, so that
+ * every stream arrives on a port of its own, with the one after it
+ * left free for RTCP. All a participant is sent leaves from the port
+ * it is heard on, to pass any NAT on the way back. Each stream leaves
+ * the relay with the SSRC given for it, and sequence numbers and
+ * timestamps that carry on across a restart of the participant, so
+ * receivers see one steady stream.
+ */
+
+#define RELAY_BATCH 32
+
+struct relay_source {
+	int fd;
+	uint32_t ssrc;
+	char *addr; /* where this participant listens */
+	int port;
+	struct fanout *out; /* to everyone else */
+	struct stats_peer *stats; /* if given */
+
+	bool started;
+	uint32_t in_ssrc;
+	uint16_t last_seq, seq_offset;
+	uint32_t last_ts, ts_offset, frame_ts;
+};
+
+struct relay {
+	unsigned int nr_sources;
+	struct relay_source *source;
+	int epfd;
+};
+
+struct relay* relay_new(unsigned int nr_sources);
+void relay_free(struct relay *r);
+
+int relay_add(struct relay *r, unsigned int n, int rx_port, uint32_t ssrc,
+		const char *addr, int port, struct stats_peer *stats);
+
+void* run_relay(struct relay *r);
+
+#endif
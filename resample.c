@@ -0,0 +1,252 @@
+/*
+ * Fractional resampling
+ *
+ * Input is held as float, behind the last HISTORY samples of the
+ * previous call. The interpolation weights and sums are worked out
+ * for four output samples at a time where the CPU allows, the taps
+ * being gathered per channel; int16 output is rounded and
+ * saturated as it is stored.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "resample.h"
+
+/* Samples before the current position which are still needed */
+
+#define HISTORY 3
+
+int resampler_init(struct resampler *r, unsigned int channels, size_t max)
+{
+	r->channels = channels;
+	r->max = max;
+
+	r->in = malloc(sizeof(float) * (HISTORY + max) * channels);
+	if (r->in == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	r->out = malloc(sizeof(float) * (max + RESAMPLE_SLACK(max))
+			* channels);
+	if (r->out == NULL) {
+		perror("malloc");
+		free(r->in);
+		return -1;
+	}
+
+	resampler_reset(r);
+
+	return 0;
+}
+
+void resampler_clear(struct resampler *r)
+{
+	free(r->in);
+	free(r->out);
+}
+
+void resampler_reset(struct resampler *r)
+{
+	memset(r->in, 0, sizeof(float) * HISTORY * r->channels);
+	r->pos = 1.0;
+}
+
+static inline void weights(float t, float *w)
+{
+	float t2 = t * t, t3 = t2 * t;
+
+	w[0] = 0.5f * (-t3 + 2.0f * t2 - t);
+	w[1] = 0.5f * (3.0f * t3 - 5.0f * t2 + 2.0f);
+	w[2] = 0.5f * (-3.0f * t3 + 4.0f * t2 + t);
+	w[3] = 0.5f * (t3 - t2);
+}
+
+/*
+ * Interpolate output from the input held, for as long as there
+ * are taps on either side; returns the number of samples
+ */
+
+static size_t interpolate(struct resampler *r, double step, size_t frames,
+		float *out)
+{
+	const unsigned int channels = r->channels;
+	const double end = frames + 1.0;
+	const float *x = r->in;
+	double pos = r->pos;
+	size_t n = 0;
+	unsigned int c;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+	while (pos + 3 * step < end) {
+		size_t i[4];
+		float t[4], tap[4][4], y[4];
+		unsigned int k, m;
+
+		for (k = 0; k < 4; k++) {
+			double p = pos + k * step;
+
+			i[k] = (size_t)p - 1;
+			t[k] = p - (size_t)p;
+		}
+
+#if defined(__SSE2__)
+		__m128 vt = _mm_loadu_ps(t),
+			t2 = _mm_mul_ps(vt, vt),
+			t3 = _mm_mul_ps(t2, vt),
+			half = _mm_set1_ps(0.5f),
+			w0, w1, w2, w3;
+
+		w0 = _mm_sub_ps(_mm_add_ps(t2, t2), _mm_add_ps(t3, vt));
+		w1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.0f), t3),
+					_mm_mul_ps(_mm_set1_ps(5.0f), t2)),
+				_mm_set1_ps(2.0f));
+		w2 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(4.0f), t2),
+					_mm_mul_ps(_mm_set1_ps(3.0f), t3)), vt);
+		w3 = _mm_sub_ps(t3, t2);
+		w0 = _mm_mul_ps(w0, half);
+		w1 = _mm_mul_ps(w1, half);
+		w2 = _mm_mul_ps(w2, half);
+		w3 = _mm_mul_ps(w3, half);
+#else
+		float32x4_t vt = vld1q_f32(t),
+			t2 = vmulq_f32(vt, vt),
+			t3 = vmulq_f32(t2, vt),
+			w0, w1, w2, w3;
+
+		w0 = vsubq_f32(vaddq_f32(t2, t2), vaddq_f32(t3, vt));
+		w1 = vaddq_f32(vmlsq_n_f32(vmulq_n_f32(t3, 3.0f), t2, 5.0f),
+				vdupq_n_f32(2.0f));
+		w2 = vaddq_f32(vmlsq_n_f32(vmulq_n_f32(t2, 4.0f), t3, 3.0f), vt);
+		w3 = vsubq_f32(t3, t2);
+		w0 = vmulq_n_f32(w0, 0.5f);
+		w1 = vmulq_n_f32(w1, 0.5f);
+		w2 = vmulq_n_f32(w2, 0.5f);
+		w3 = vmulq_n_f32(w3, 0.5f);
+#endif
+
+		for (c = 0; c < channels; c++) {
+			for (m = 0; m < 4; m++) {
+				for (k = 0; k < 4; k++)
+					tap[m][k] = x[(i[k] + m) * channels + c];
+			}
+
+#if defined(__SSE2__)
+			__m128 v;
+
+			v = _mm_mul_ps(w0, _mm_loadu_ps(tap[0]));
+			v = _mm_add_ps(v, _mm_mul_ps(w1, _mm_loadu_ps(tap[1])));
+			v = _mm_add_ps(v, _mm_mul_ps(w2, _mm_loadu_ps(tap[2])));
+			v = _mm_add_ps(v, _mm_mul_ps(w3, _mm_loadu_ps(tap[3])));
+			_mm_storeu_ps(y, v);
+#else
+			float32x4_t v;
+
+			v = vmulq_f32(w0, vld1q_f32(tap[0]));
+			v = vmlaq_f32(v, w1, vld1q_f32(tap[1]));
+			v = vmlaq_f32(v, w2, vld1q_f32(tap[2]));
+			v = vmlaq_f32(v, w3, vld1q_f32(tap[3]));
+			vst1q_f32(y, v);
+#endif
+
+			for (k = 0; k < 4; k++)
+				out[(n + k) * channels + c] = y[k];
+		}
+
+		n += 4;
+		pos += 4 * step;
+	}
+#endif
+
+	for (; pos < end; pos += step, n++) {
+		size_t i = (size_t)pos - 1;
+		float w[4];
+
+		weights(pos - (size_t)pos, w);
+
+		for (c = 0; c < channels; c++) {
+			const float *a = x + i * channels + c;
+
+			out[n * channels + c] = w[0] * a[0]
+				+ w[1] * a[channels]
+				+ w[2] * a[2 * channels]
+				+ w[3] * a[3 * channels];
+		}
+	}
+
+	/* Keep the tail for the next call */
+
+	memmove(r->in, r->in + frames * channels,
+			sizeof(float) * HISTORY * channels);
+	r->pos = pos - frames;
+
+	return n;
+}
+
+static double clamp_step(double step)
+{
+	const double max = RESAMPLE_MAX_PPM / 1e6;
+
+	if (step > 1.0 + max)
+		return 1.0 + max;
+	if (step < 1.0 - max)
+		return 1.0 - max;
+	return step;
+}
+
+size_t resample(struct resampler *r, double step,
+		const int16_t *in, size_t frames, int16_t *out)
+{
+	float *x = r->in + HISTORY * r->channels;
+	size_t n, samples, s = 0;
+
+	if (frames > r->max)
+		abort();
+
+	samples = frames * r->channels;
+	for (n = 0; n < samples; n++)
+		x[n] = in[n];
+
+	samples = interpolate(r, clamp_step(step), frames, r->out)
+		* r->channels;
+
+#ifdef __SSE2__
+	for (; s + 8 <= samples; s += 8) {
+		__m128i lo, hi;
+
+		lo = _mm_cvtps_epi32(_mm_loadu_ps(r->out + s));
+		hi = _mm_cvtps_epi32(_mm_loadu_ps(r->out + s + 4));
+		_mm_storeu_si128((__m128i*)(out + s), _mm_packs_epi32(lo, hi));
+	}
+#endif
+
+	for (; s < samples; s++) {
+		long y = lrintf(r->out[s]);
+
+		out[s] = y > INT16_MAX ? INT16_MAX : (y < INT16_MIN ? INT16_MIN : y);
+	}
+
+	return samples / r->channels;
+}
+
+size_t resample_float(struct resampler *r, double step,
+		const float *in, size_t frames, float *out)
+{
+	if (frames > r->max)
+		abort();
+
+	memcpy(r->in + HISTORY * r->channels, in,
+			sizeof(float) * frames * r->channels);
+
+	return interpolate(r, clamp_step(step), frames, out);
+}
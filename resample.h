@@ -0,0 +1,40 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fractional resampling of a stream, by a ratio very close to one
+ *
+ * Each output sample is interpolated (Catmull-Rom) from the four
+ * input samples around it; 'step' is the input advanced per output
+ * sample. The last few input samples of each call are kept, so
+ * that a stream can be passed through in pieces of any size.
+ */
+
+/* The most the ratio may stray from one, in parts per million */
+
+#define RESAMPLE_MAX_PPM 2000
+
+/* Output, beyond 'frames', that a call may produce */
+
+#define RESAMPLE_SLACK(frames) ((frames) / 256 + 2)
+
+struct resampler {
+	unsigned int channels;
+	size_t max; /* input per call */
+	double pos;
+	float *in, *out;
+};
+
+int resampler_init(struct resampler *r, unsigned int channels, size_t max);
+void resampler_clear(struct resampler *r);
+void resampler_reset(struct resampler *r);
+
+size_t resample(struct resampler *r, double step,
+		const int16_t *in, size_t frames, int16_t *out);
+size_t resample_float(struct resampler *r, double step,
+		const float *in, size_t frames, float *out);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ring.h"
+
+/*
+ * Each record is a header giving its length, then the record, padded
+ * to ALIGN. A record which would run off the end of the buffer is
+ * put at the start instead, behind a header marking the rest as PAD
+ */
+
+#define ALIGN 16
+#define HEADER ALIGN
+#define PAD SIZE_MAX
+
+static size_t space(size_t len)
+{
+	return HEADER + ((len + ALIGN - 1) & ~(size_t)(ALIGN - 1));
+}
+
+int ring_init(struct ring *r, size_t size)
+{
+	if (size & (size - 1) || size < ALIGN) {
+		fprintf(stderr, "Ring size must be a power of two\n");
+		return -1;
+	}
+
+	r->buf = aligned_alloc(ALIGN, size);
+	if (r->buf == NULL) {
+		perror("aligned_alloc");
+		return -1;
+	}
+
+	r->size = size;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	r->reserved = 0;
+
+	return 0;
+}
+
+void ring_clear(struct ring *r)
+{
+	free(r->buf);
+}
+
+/*
+ * Return room for a record of 'len' bytes, or NULL if the ring is
+ * too full
+ */
+
+void* ring_reserve(struct ring *r, size_t len)
+{
+	size_t head, tail, offset, need, waste = 0;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	need = space(len);
+	offset = tail & (r->size - 1);
+	if (need > r->size - offset)
+		waste = r->size - offset;
+
+	if (tail + waste + need - head > r->size)
+		return NULL;
+
+	if (waste) {
+		*(size_t*)(r->buf + offset) = PAD;
+		offset = 0;
+	}
+	r->reserved = tail + waste;
+
+	return r->buf + offset + HEADER;
+}
+
+/*
+ * Pass on the record last reserved, which may be shorter than the
+ * room asked for
+ */
+
+void ring_commit(struct ring *r, size_t len)
+{
+	size_t offset = r->reserved & (r->size - 1);
+
+	*(size_t*)(r->buf + offset) = len;
+	atomic_store_explicit(&r->tail, r->reserved + space(len),
+			memory_order_release);
+}
+
+/*
+ * Return the oldest record, or NULL if there is none. It stays
+ * until released
+ */
+
+const void* ring_peek(struct ring *r, size_t *len)
+{
+	size_t head, tail, offset;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (head == tail)
+		return NULL;
+
+	offset = head & (r->size - 1);
+	if (*(size_t*)(r->buf + offset) == PAD) {
+		head += r->size - offset;
+		atomic_store_explicit(&r->head, head, memory_order_release);
+		offset = 0;
+	}
+
+	*len = *(size_t*)(r->buf + offset);
+	return r->buf + offset + HEADER;
+}
+
+void ring_release(struct ring *r)
+{
+	size_t head, len;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	len = *(size_t*)(r->buf + (head & (r->size - 1)));
+
+	atomic_store_explicit(&r->head, head + space(len),
+			memory_order_release);
+}
@@ -0,0 +1,36 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Ring of variable-sized records, from one thread to another
+ *
+ * The producer reserves room for a record, fills it in and commits
+ * it; the consumer peeks at the oldest record and releases it when
+ * done. Neither side ever waits for the other, takes a lock or makes
+ * a syscall: a full ring refuses the record, an empty one has none
+ * to give.
+ *
+ * A record is always contiguous in memory, and aligned for any type.
+ */
+
+struct ring {
+	size_t size; /* power of two */
+	unsigned char *buf;
+
+	atomic_size_t head, tail; /* bytes ever taken, and given */
+	size_t reserved; /* producer only, where the record goes */
+};
+
+int ring_init(struct ring *r, size_t size);
+void ring_clear(struct ring *r);
+
+void* ring_reserve(struct ring *r, size_t len);
+void ring_commit(struct ring *r, size_t len);
+
+const void* ring_peek(struct ring *r, size_t *len);
+void ring_release(struct ring *r);
+
+#endif
@@ -0,0 +1,573 @@
+#define _GNU_SOURCE /* recvmmsg */
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "rtp.h"
+#include "stats.h"
+
+/* Match the sessions set up by oRTP, see trx_rtplib.c */
+
+#define DSCP 40
+#define REPORT_INTERVAL 5000000000UL /* ns */
+
+/* Sequence numbers further apart than this are taken as the sender
+ * starting again, as RFC 3550 appendix A.1 */
+
+#define MAX_DROPOUT 3000
+#define MAX_MISORDER 100
+
+#define RTCP_SR 200
+#define RTCP_RR 201
+#define RTCP_SDES 202
+#define RTCP_MAX_PACKET 512
+
+#define CNAME "trx"
+
+#define CONTROL CMSG_SPACE(sizeof(struct timespec))
+
+/* Follow the RFC, payload 0 has 8kHz reference rate */
+
+#define TS_RATE 8000
+
+static inline uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * Find the payload of an RTP packet, skipping any CSRCs, header
+ * extension and padding; returns -1 if it is not an RTP packet
+ */
+
+int rtp_parse(const unsigned char *p, size_t len, struct rtp_packet *out)
+{
+	size_t start = 12, end = len;
+
+	if (len < start || p[0] >> 6 != 2)
+		return -1;
+
+	start += 4 * (p[0] & 0x0f); /* CSRC */
+	out->ext_len = 0;
+	if (p[0] & 0x10) {
+		if (len < start + 4)
+			return -1;
+		out->ext_profile = p[start] << 8 | p[start + 1];
+		out->ext_len = 4 * (p[start + 2] << 8 | p[start + 3]);
+		out->ext = p + start + 4;
+		start += 4 + out->ext_len;
+	}
+	if (p[0] & 0x20)
+		end -= p[len - 1];
+	if (start >= end || end > len)
+		return -1;
+
+	out->payload_type = p[1] & 0x7f;
+	out->seq = p[2] << 8 | p[3];
+	out->ts = get32(p + 4);
+	out->ssrc = get32(p + 8);
+	out->payload = p + start;
+	out->len = end - start;
+
+	return 0;
+}
+
+/*
+ * Open a socket bound to the given address and port, joining the
+ * group if it is a multicast address
+ */
+
+static int open_socket(const char *addr, int port)
+{
+	int fd, r, tos = DSCP << 2, one = 1;
+	char service[NI_MAXSERV];
+	struct addrinfo *ai, hints = {
+		.ai_socktype = SOCK_DGRAM,
+		.ai_flags = AI_NUMERICSERV | AI_PASSIVE
+	};
+
+	snprintf(service, sizeof service, "%d", port);
+	r = getaddrinfo(addr, service, &hints, &ai);
+	if (r != 0) {
+		fprintf(stderr, "getaddrinfo: %s: %s\n", addr, gai_strerror(r));
+		return -1;
+	}
+
+	fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		goto fail;
+	}
+
+	if (ai->ai_family == AF_INET6) {
+		r = setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof tos);
+	} else {
+		r = setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof tos);
+	}
+	if (r == -1) {
+		perror("setsockopt");
+		goto fail;
+	}
+
+	if (ai->ai_family == AF_INET) {
+		const struct sockaddr_in *sin = (void *)ai->ai_addr;
+
+		if (IN_MULTICAST(ntohl(sin->sin_addr.s_addr))) {
+			struct ip_mreq mreq = {
+				.imr_multiaddr = sin->sin_addr,
+				.imr_interface.s_addr = htonl(INADDR_ANY)
+			};
+
+			if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+					&one, sizeof one) == -1 ||
+				setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+					&mreq, sizeof mreq) == -1)
+			{
+				perror("setsockopt");
+				goto fail;
+			}
+		}
+	} else if (ai->ai_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (void *)ai->ai_addr;
+
+		if (IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr)) {
+			struct ipv6_mreq mreq = {
+				.ipv6mr_multiaddr = sin6->sin6_addr
+			};
+
+			if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+					&one, sizeof one) == -1 ||
+				setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+					&mreq, sizeof mreq) == -1)
+			{
+				perror("setsockopt");
+				goto fail;
+			}
+		}
+	}
+
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+		perror("bind");
+		goto fail;
+	}
+
+	freeaddrinfo(ai);
+	return fd;
+
+fail:
+	if (fd != -1)
+		close(fd);
+	freeaddrinfo(ai);
+	return -1;
+}
+
+/*
+ * Return NULL if the port could not be opened, eg. it is in use
+ */
+
+struct rtp* rtp_new(const char *addr, int port)
+{
+	struct rtp *r;
+	unsigned int n;
+	int one = 1;
+
+	r = calloc(1, sizeof *r);
+	if (r == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	r->fd = r->rtcp_fd = -1;
+
+	r->slab = calloc(RTP_BATCH, sizeof *r->slab);
+	r->iov = calloc(RTP_BATCH, sizeof *r->iov);
+	r->msg = calloc(RTP_BATCH, sizeof *r->msg);
+	r->control = calloc(RTP_BATCH, CONTROL);
+	if (r->slab == NULL || r->iov == NULL || r->msg == NULL ||
+		r->control == NULL)
+	{
+		perror("calloc");
+		rtp_free(r);
+		return NULL;
+	}
+
+	for (n = 0; n < RTP_BATCH; n++) {
+		r->iov[n].iov_base = r->slab[n];
+		r->iov[n].iov_len = sizeof r->slab[n];
+		r->msg[n].msg_hdr.msg_iov = &r->iov[n];
+		r->msg[n].msg_hdr.msg_iovlen = 1;
+		r->msg[n].msg_hdr.msg_control = r->control + n * CONTROL;
+	}
+
+	r->fd = open_socket(addr, port);
+	if (r->fd == -1) {
+		rtp_free(r);
+		return NULL;
+	}
+
+	/* Without kernel timestamps, the time the batch was read is
+	 * used instead */
+
+	if (setsockopt(r->fd, SOL_SOCKET, SO_TIMESTAMPNS,
+			&one, sizeof one) == -1)
+	{
+		perror("setsockopt");
+	}
+
+	return r;
+}
+
+void rtp_free(struct rtp *r)
+{
+	if (r->fd != -1)
+		close(r->fd);
+	if (r->rtcp_fd != -1)
+		close(r->rtcp_fd);
+	free(r->slab);
+	free(r->iov);
+	free(r->msg);
+	free(r->control);
+	free(r);
+}
+
+/*
+ * Exchange RTCP with the sender at 'addr' and 'port', reporting as
+ * 'ssrc'; the RTCP port is opened alongside the RTP one
+ */
+
+int rtp_reports(struct rtp *r, const char *addr, int port, uint32_t ssrc)
+{
+	struct sockaddr_storage local;
+	socklen_t len = sizeof local;
+	char service[NI_MAXSERV], host[NI_MAXHOST];
+	struct addrinfo *ai, hints = {
+		.ai_socktype = SOCK_DGRAM,
+		.ai_flags = AI_NUMERICSERV
+	};
+	int e;
+
+	if (getsockname(r->fd, (struct sockaddr *)&local, &len) == -1) {
+		perror("getsockname");
+		return -1;
+	}
+	e = getnameinfo((struct sockaddr *)&local, len, host, sizeof host,
+			service, sizeof service, NI_NUMERICHOST | NI_NUMERICSERV);
+	if (e != 0) {
+		fprintf(stderr, "getnameinfo: %s\n", gai_strerror(e));
+		return -1;
+	}
+
+	r->rtcp_fd = open_socket(host, atoi(service) + 1);
+	if (r->rtcp_fd == -1)
+		return -1;
+
+	snprintf(service, sizeof service, "%d", port + 1);
+	e = getaddrinfo(addr, service, &hints, &ai);
+	if (e != 0) {
+		fprintf(stderr, "getaddrinfo: %s: %s\n", addr, gai_strerror(e));
+		return -1;
+	}
+	memcpy(&r->rtcp_addr, ai->ai_addr, ai->ai_addrlen);
+	r->rtcp_addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	r->ssrc = ssrc;
+	r->last_report = stats_now();
+
+	return 0;
+}
+
+/*
+ * Follow the sender's sequence and timing, as RFC 3550 appendix A
+ */
+
+static void track(struct rtp *r, const struct rtp_packet *p)
+{
+	struct rtp_stats *s = &r->stats;
+	uint16_t delta = p->seq - r->max_seq;
+	int32_t transit, d;
+
+	if (!r->started || p->ssrc != r->sender ||
+		(delta >= MAX_DROPOUT && delta <= 65536 - MAX_MISORDER))
+	{
+		r->started = true;
+		r->sender = p->ssrc;
+		r->base_seq = r->max_seq = p->seq;
+		r->cycles = 0;
+		r->expected_prior = r->received_prior = 0;
+		r->transit = 0;
+		s->received = 0;
+	} else if (delta < MAX_DROPOUT) {
+		if (p->seq < r->max_seq)
+			r->cycles += 65536;
+		r->max_seq = p->seq;
+	}
+
+	s->received++;
+	s->octets += p->len;
+	s->cum_loss = (long)(r->cycles + r->max_seq - r->base_seq + 1)
+		- (long)s->received;
+
+	/* Arrival in timestamp units; only differences matter */
+
+	transit = (int32_t)(p->arrival / (1000000000 / TS_RATE)) - p->ts;
+	if (r->transit != 0) {
+		d = transit - r->transit;
+		if (d < 0)
+			d = -d;
+		r->jitter16 += d - ((r->jitter16 + 8) >> 4);
+		s->jitter = r->jitter16 >> 4;
+		if (s->jitter > s->max_jitter)
+			s->max_jitter = s->jitter;
+	}
+	r->transit = transit;
+}
+
+/*
+ * The time the kernel received a message, as CLOCK_MONOTONIC
+ */
+
+static unsigned long arrival(const struct rtp *r, struct msghdr *hdr)
+{
+	struct cmsghdr *c;
+
+	for (c = CMSG_FIRSTHDR(hdr); c; c = CMSG_NXTHDR(hdr, c)) {
+		struct timespec ts;
+
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS)
+			continue;
+
+		memcpy(&ts, CMSG_DATA(c), sizeof ts);
+		return ts.tv_sec * 1000000000UL + ts.tv_nsec - r->offset;
+	}
+
+	return r->batch_at;
+}
+
+/*
+ * Hand out the next packet; returns 1 if there is one, 0 if none
+ * is waiting, or -1 on error
+ */
+
+int rtp_recv(struct rtp *r, struct rtp_packet *packet)
+{
+	struct timespec real;
+	unsigned int n;
+	int z;
+
+	for (;;) {
+		while (r->next < r->count) {
+			n = r->next++;
+
+			if (rtp_parse(r->slab[n], r->msg[n].msg_len, packet) == -1) {
+				r->stats.dropped++;
+				continue;
+			}
+
+			packet->arrival = arrival(r, &r->msg[n].msg_hdr);
+			track(r, packet);
+			return 1;
+		}
+
+		r->next = r->count = 0;
+
+		for (n = 0; n < RTP_BATCH; n++)
+			r->msg[n].msg_hdr.msg_controllen = CONTROL;
+
+		z = recvmmsg(r->fd, r->msg, RTP_BATCH, MSG_DONTWAIT, NULL);
+		if (z == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			perror("recvmmsg");
+			return -1;
+		}
+
+		/* Kernel timestamps are CLOCK_REALTIME; they are moved onto
+		 * our own clock, which does not jump */
+
+		clock_gettime(CLOCK_REALTIME, &real);
+		r->batch_at = stats_now();
+		r->offset = real.tv_sec * 1000000000L + real.tv_nsec - r->batch_at;
+		r->count = z;
+	}
+}
+
+/*
+ * Look through a compound RTCP packet for a report of our own
+ * stream, and note the time of any sender report; returns the
+ * fraction lost, or -1 if there is no report of our stream
+ */
+
+static int read_compound(struct rtp *r, const unsigned char *p, size_t len)
+{
+	int fraction = -1;
+
+	while (len >= 8 && p[0] >> 6 == 2) {
+		size_t size = 4 * ((p[2] << 8 | p[3]) + 1), off = 8;
+		unsigned int n, count = p[0] & 0x1f;
+
+		if (size > len)
+			break;
+
+		if (p[1] == RTCP_SR) {
+			if (size < 28)
+				break;
+			r->last_sr = get32(p + 10);
+			r->last_sr_at = stats_now();
+			off = 28;
+		}
+
+		if (p[1] == RTCP_SR || p[1] == RTCP_RR) {
+			for (n = 0; n < count && off + 24 <= size; n++, off += 24) {
+				if (get32(p + off) == r->ssrc)
+					fraction = p[off + 4];
+			}
+		}
+
+		p += size;
+		len -= size;
+	}
+
+	return fraction;
+}
+
+/*
+ * Build our receiver report, with its CNAME as RTCP requires
+ */
+
+static size_t build_report(struct rtp *r, unsigned char *p, unsigned long now)
+{
+	struct rtp_stats *s = &r->stats;
+	unsigned long expected, interval, received, elapsed;
+	long cum_loss = s->cum_loss;
+	unsigned int fraction = 0;
+	uint32_t dlsr = 0;
+	size_t len, sdes;
+
+	/* Loss since the last report, as RFC 3550 appendix A.3 */
+
+	expected = r->cycles + r->max_seq - r->base_seq + 1;
+	interval = expected - r->expected_prior;
+	received = s->received - r->received_prior;
+	if (interval > received)
+		fraction = ((interval - received) << 8) / interval;
+	r->expected_prior = expected;
+	r->received_prior = s->received;
+
+	if (cum_loss > 0x7fffff)
+		cum_loss = 0x7fffff;
+	if (cum_loss < -0x800000)
+		cum_loss = -0x800000;
+
+	if (r->last_sr_at)
+		dlsr = (now - r->last_sr_at) * 65536 / 1000000000;
+
+	elapsed = now - r->last_report;
+	if (elapsed > 0) {
+		s->bandwidth = (s->octets - r->octets_prior) * 8 * 1000000000.0
+			/ elapsed;
+	}
+	r->octets_prior = s->octets;
+
+	/* Receiver report, with one block if we have heard the sender */
+
+	p[0] = 0x80 | (r->started ? 1 : 0);
+	p[1] = RTCP_RR;
+	put32(p + 4, r->ssrc);
+	len = 8;
+
+	if (r->started) {
+		put32(p + 8, r->sender);
+		put32(p + 12, (uint32_t)cum_loss & 0xffffff);
+		p[12] = fraction;
+		put32(p + 16, r->cycles + r->max_seq);
+		put32(p + 20, s->jitter);
+		put32(p + 24, r->last_sr);
+		put32(p + 28, dlsr);
+		len += 24;
+	}
+	p[2] = 0;
+	p[3] = len / 4 - 1;
+
+	/* Source description, padded to a whole number of words */
+
+	p += len;
+	memset(p, 0, 12 + sizeof CNAME);
+	p[0] = 0x81;
+	p[1] = RTCP_SDES;
+	put32(p + 4, r->ssrc);
+	p[8] = 1; /* CNAME */
+	p[9] = sizeof CNAME - 1;
+	memcpy(p + 10, CNAME, sizeof CNAME - 1);
+
+	sdes = (10 + sizeof CNAME - 1 + 1 + 3) & ~3;
+	p[2] = 0;
+	p[3] = sdes / 4 - 1;
+
+	return len + sdes;
+}
+
+/*
+ * Read any RTCP waiting, and send our own report when it is due;
+ * called as often as packets are taken. Returns the fraction lost
+ * in the latest report of our own stream, or -1 if there was none
+ */
+
+int rtp_rtcp(struct rtp *r)
+{
+	unsigned char buf[RTCP_MAX_PACKET];
+	unsigned long now;
+	int fraction = -1;
+	ssize_t z;
+
+	if (r->rtcp_fd == -1)
+		return -1;
+
+	for (;;) {
+		int f;
+
+		z = recv(r->rtcp_fd, buf, sizeof buf, MSG_DONTWAIT);
+		if (z == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				perror("recv");
+			break;
+		}
+
+		f = read_compound(r, buf, z);
+		if (f != -1)
+			fraction = f;
+	}
+
+	now = stats_now();
+	if (now - r->last_report >= REPORT_INTERVAL) {
+		size_t len;
+
+		len = build_report(r, buf, now);
+		if (sendto(r->rtcp_fd, buf, len, MSG_DONTWAIT,
+				(struct sockaddr *)&r->rtcp_addr, r->rtcp_addrlen) == -1
+			&& errno != EAGAIN)
+		{
+			perror("sendto");
+		}
+		r->last_report = now;
+	}
+
+	return fraction;
+}
@@ -0,0 +1,98 @@
+#ifndef RTP_H
+#define RTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * Native RTP receiver, in place of an oRTP session on the hot path
+ *
+ * Packets are read a batch at a time with recvmmsg() into buffers
+ * allocated up front, and handed out one by one from there, so
+ * receiving needs no allocation or locking. The header is parsed in
+ * place; the payload stays in the buffer until the next call.
+ *
+ * Each packet carries the time the kernel received it (on the
+ * CLOCK_MONOTONIC timescale of stats_now()), so that the jitter seen
+ * is the network's, and not also the wakeups of our own thread.
+ *
+ * If given the sender's address, RTCP is exchanged with it as an
+ * oRTP session would: receiver reports are sent to its port + 1,
+ * from our own port + 1, and reports of our stream are read there.
+ * Together with fanout.h this is wire compatible with oRTP peers.
+ */
+
+#define RTP_BATCH 32
+#define RTP_MAX_PACKET 1500
+
+struct rtp_packet {
+	uint16_t seq;
+	uint32_t ts, ssrc;
+	unsigned char payload_type;
+	const unsigned char *payload;
+	size_t len;
+	unsigned long arrival; /* nanoseconds */
+
+	uint16_t ext_profile; /* header extension, if ext_len */
+	const unsigned char *ext;
+	size_t ext_len;
+};
+
+/*
+ * Reception of the stream, as RFC 3550 appendix A; jitter is in
+ * timestamp units
+ */
+
+struct rtp_stats {
+	unsigned long received, octets, dropped;
+	long cum_loss;
+	uint32_t jitter, max_jitter;
+	unsigned long bandwidth; /* bits per second, at the last report */
+};
+
+struct rtp {
+	int fd, rtcp_fd;
+	uint32_t ssrc; /* our own, as reported on */
+
+	struct sockaddr_storage rtcp_addr;
+	socklen_t rtcp_addrlen; /* 0 if there is no one to report to */
+
+	/* The current batch */
+
+	unsigned char (*slab)[RTP_MAX_PACKET];
+	struct iovec *iov;
+	struct mmsghdr *msg;
+	unsigned char *control;
+	unsigned int next, count;
+	long offset; /* CLOCK_REALTIME less CLOCK_MONOTONIC, for the batch */
+	unsigned long batch_at;
+
+	/* Sequence and timing of the sender */
+
+	bool started;
+	uint32_t sender, cycles;
+	uint16_t base_seq, max_seq;
+	unsigned long expected_prior, received_prior, octets_prior;
+	int32_t transit;
+	uint32_t jitter16; /* jitter, scaled by 16 */
+
+	uint32_t last_sr; /* middle of the NTP time of the last SR */
+	unsigned long last_sr_at, last_report; /* nanoseconds */
+
+	struct rtp_stats stats;
+};
+
+int rtp_parse(const unsigned char *p, size_t len, struct rtp_packet *out);
+
+struct rtp* rtp_new(const char *addr, int port);
+void rtp_free(struct rtp *r);
+
+int rtp_reports(struct rtp *r, const char *addr, int port, uint32_t ssrc);
+
+int rtp_recv(struct rtp *r, struct rtp_packet *packet);
+int rtp_rtcp(struct rtp *r);
+
+#endif
@@ -20,15 +20,21 @@
 #include <netdb.h>
 #include <string.h>
 #include <alsa/asoundlib.h>
-#include <opus/opus.h>
+#include <opus/opus_multistream.h>
 #include <ortp/ortp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "backend.h"
+#include "codec.h"
 #include "defaults.h"
 #include "device.h"
+#include "format.h"
 #include "notice.h"
+#include "recorder.h"
+#include "rx_net.h"
 #include "sched.h"
+#include "stats.h"
 #include "rx_alsalib.h"
 #include "rx_rtplib.h"
 #include "rx_runlib.h"
@@ -41,53 +47,81 @@ static void usage(FILE *fd)
 		"Real-time audio receiver over IP\n");
 
 	fprintf(fd, "\nAudio device (ALSA) parameters:\n");
-	fprintf(fd, "  -d <dev>    Device name (default '%s')\n",
+	fprintf(fd, "  -d <dev>    Device name, or file:<path> or null (default '%s')\n",
 		DEFAULT_DEVICE);
 	fprintf(fd, "  -m <ms>     Buffer time (default %d milliseconds)\n",
 		DEFAULT_BUFFER);
+	fprintf(fd, "  -M          Access the device buffer directly (memory-mapped)\n");
+	fprintf(fd, "  -F <fmt>    Sample format: s16, s24, s32, float or auto (default %s)\n",
+		DEFAULT_FORMAT);
 
 	fprintf(fd, "\nNetwork parameters:\n");
 	fprintf(fd, "  -h <addr>   IP address to listen on (default %s)\n",
 		DEFAULT_ADDR);
 	fprintf(fd, "  -p <port>   UDP port number (default %d)\n",
 		DEFAULT_PORT);
+	fprintf(fd, "  -U          Receive with the built-in RTP, in place of oRTP\n");
 	fprintf(fd, "  -j <ms>     Jitter buffer (default %d milliseconds)\n",
 		DEFAULT_JITTER);
+	fprintf(fd, "  -T <file>   Record packet arrivals to the given file, see jbsim; a\n"
+		"              diagnostic, written on the audio path, which may upset timing\n");
+	fprintf(fd, "  -W <file>   Record the stream, as received, to an Ogg Opus file\n");
 
 	fprintf(fd, "\nEncoding parameters (must match sender):\n");
 	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
 		DEFAULT_RATE);
 	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
 		DEFAULT_CHANNELS);
+	fprintf(fd, "  -L <layout> Channels over Opus streams: pairs, mono or\n"
+		"              <streams>:<coupled>:<mapping>,... (default pairs)\n");
 
 	fprintf(fd, "\nProgram parameters:\n");
 	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
 		DEFAULT_VERBOSE);
 	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
+	fprintf(fd, "  -R <name>   Publish statistics in shared memory, see trxstat\n");
+
+	fprintf(fd, "\nIn place of a device, audio can be written to a raw file, or be\n"
+		"discarded (null), at the pace of a device.\n");
 }
 
 int main(int argc, char *argv[])
 {
-	int r, error;
+	int r;
+	struct codec_layout layout;
+	struct backend *backend = NULL;
+	struct recorder *recorder = NULL;
+	struct rx_net *net;
+	struct stats *stats = NULL;
 	struct rx_args rx = {
 		.channels = DEFAULT_CHANNELS,
 		.rate = DEFAULT_RATE
 	};
+	struct rx_args *rxp = &rx;
 
 	/* command-line options */
 	const char *device = DEFAULT_DEVICE,
 		*addr = DEFAULT_ADDR,
-		*pid = NULL;
+		*trace = NULL,
+		*record = NULL,
+		*layout_name = NULL,
+		*pid = NULL,
+		*stats_name = NULL;
+	bool native = false;
+	snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	snd_pcm_format_t format;
 	unsigned int buffer = DEFAULT_BUFFER,
 		jitter = DEFAULT_JITTER,
 		port = DEFAULT_PORT;
 
 	fputs(COPYRIGHT "\n", stderr);
 
+	format_parse(DEFAULT_FORMAT, &format);
+
 	for (;;) {
 		int c;
 
-		c = getopt(argc, argv, "c:d:h:j:m:p:r:v:");
+		c = getopt(argc, argv, "c:d:h:j:m:p:r:v:D:F:L:MR:T:UW:");
 		if (c == -1)
 			break;
 		switch (c) {
@@ -106,6 +140,12 @@ int main(int argc, char *argv[])
 		case 'm':
 			buffer = atoi(optarg);
 			break;
+		case 'L':
+			layout_name = optarg;
+			break;
+		case 'M':
+			access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+			break;
 		case 'p':
 			port = atoi(optarg);
 			break;
@@ -118,48 +158,150 @@ int main(int argc, char *argv[])
 		case 'D':
 			pid = optarg;
 			break;
+		case 'F':
+			if (format_parse(optarg, &format) == -1) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'R':
+			stats_name = optarg;
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'U':
+			native = true;
+			break;
+		case 'W':
+			record = optarg;
+			break;
 		default:
 			usage(stderr);
 			return -1;
 		}
 	}
 
-	rx.decoder = opus_decoder_create(rx.rate, rx.channels, &error);
-	if (rx.decoder == NULL) {
-		fprintf(stderr, "opus_decoder_create: %s\n",
-			opus_strerror(error));
+	if (codec_layout(&layout, rx.channels, layout_name) == -1)
+		return -1;
+	rx.decoder = codec_decoder(&layout, rx.rate);
+	if (rx.decoder == NULL)
+		return -1;
+
+	rx.jb = jbuf_new(jitter, DEFAULT_JITTER_MAX(jitter), DEFAULT_JITTER_DECAY);
+	if (rx.jb == NULL)
 		return -1;
+
+	if (trace) {
+		rx.trace = fopen(trace, "w");
+		if (rx.trace == NULL) {
+			perror("fopen");
+			return -1;
+		}
+	}
+
+	if (record) {
+		recorder = recorder_new(1, &layout, rx.rate);
+		if (recorder == NULL)
+			return -1;
+		rx.record = record_open(recorder, record);
+		if (rx.record == NULL)
+			return -1;
 	}
 
 	ortp_init();
 	ortp_scheduler_init();
-	rx.session = create_rtp_recv(addr, port, jitter);
-	assert(rx.session != NULL);
 
-	r = snd_pcm_open(&rx.snd, device, SND_PCM_STREAM_PLAYBACK, 0);
-	if (r < 0) {
-		aerror("snd_pcm_open", r);
-		return -1;
+	if (native) {
+		rx.rtp = rtp_new(addr, port);
+		if (rx.rtp == NULL)
+			return -1;
+	} else {
+		rx.session = create_rtp_recv(addr, port);
+		assert(rx.session != NULL);
 	}
-	if (set_alsa_hw(rx.snd, rx.rate, rx.channels, buffer * 1000) == -1)
-		return -1;
-	if (set_alsa_sw(rx.snd) == -1)
+
+	if (backend_is(device)) {
+		rx.snd = NULL;
+		backend = backend_open(device, false, rx.rate, rx.channels,
+				&format);
+		if (backend == NULL)
+			return -1;
+		access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	} else {
+		r = snd_pcm_open(&rx.snd, device, SND_PCM_STREAM_PLAYBACK, 0);
+		if (r < 0) {
+			aerror("snd_pcm_open", r);
+			return -1;
+		}
+		if (set_alsa_hw(rx.snd, rx.rate, rx.channels, buffer * 1000,
+				access, &format) == -1)
+		{
+			return -1;
+		}
+		if (set_alsa_sw(rx.snd) == -1)
+			return -1;
+	}
+
+	if (rx_stream_init(&rx.stream, rx.channels, MAX_SAMPLES, format) == -1)
 		return -1;
 
+	if (stats_name) {
+		stats = stats_new(stats_name, 1);
+		if (stats == NULL)
+			return -1;
+		stats->peer[0].rx_port = port;
+		stats_set(&stats->peer[0].active, 1);
+		rx.stats = &stats->peer[0];
+		rx.stream.decode_ns = &stats->peer[0].decode_ns;
+	}
+	rx.stream.mmap = (access == SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	rx.stream.backend = backend;
+
 	if (pid)
 		go_daemon(pid);
 
+	if (recorder && recorder_start(recorder) == -1)
+		return -1;
+
+	lock_memory();
 	go_realtime();
+
+	/* Packets are received on a thread of their own, which takes
+	 * the scheduling just set */
+
+	net = rx_net_new(&rxp, 1);
+	if (net == NULL)
+		return -1;
+	if (rx_net_start(net) == -1)
+		return -1;
+
 	r = (long)run_rx(&rx);
 
-	if (snd_pcm_close(rx.snd) < 0)
+	rx_net_free(net);
+
+	if (rx.snd && snd_pcm_close(rx.snd) < 0)
 		abort();
+	if (backend)
+		backend_close(backend);
 
-	rtp_session_destroy(rx.session);
+	if (rx.rtp)
+		rtp_free(rx.rtp);
+	else
+		rtp_session_destroy(rx.session);
 	ortp_exit();
 	ortp_global_stats_display();
 
-	opus_decoder_destroy(rx.decoder);
+	opus_multistream_decoder_destroy(rx.decoder);
+	rx_stream_clear(&rx.stream);
+	jbuf_free(rx.jb);
+
+	if (rx.trace)
+		fclose(rx.trace);
+	if (recorder)
+		recorder_free(recorder);
+	if (stats)
+		stats_free(stats, stats_name);
 
 	return r;
 }
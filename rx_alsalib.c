@@ -1,27 +1,224 @@
 #include "rx_alsalib.h"
 #include "device.h"
+#include "format.h"
 
-int play_one_frame(void *packet,
+int rx_stream_init(struct rx_stream *stream,
+		const unsigned int channels,
+		const snd_pcm_sframes_t samples,
+		const snd_pcm_format_t format)
+{
+	stream->ts = 0;
+	stream->format = format;
+	stream->samples = samples;
+	stream->last = PLC_SAMPLES;
+	stream->dev = NULL;
+	stream->backend = NULL;
+	stream->decode_ns = NULL;
+
+	stream->pcm = alloc_pcm(format_work_bytes(format) * samples * channels);
+	if (stream->pcm == NULL)
+		return -1;
+
+	if (format_needs_conversion(format)) {
+		stream->dev = alloc_pcm(format_bytes(format) * samples * channels);
+		if (stream->dev == NULL) {
+			free(stream->pcm);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void rx_stream_clear(struct rx_stream *stream)
+{
+	free(stream->pcm);
+	free(stream->dev);
+	stream->pcm = NULL;
+	stream->dev = NULL;
+}
+
+/*
+ * Decode a frame, or conceal a missing one if 'packet' is NULL, as
+ * int16_t or float depending on the device format. If 'fec' is set,
+ * 'packet' is the one following the missing frame, which is
+ * recovered from it where it carries in-band FEC (and concealed
+ * where it does not)
+ */
+
+int decode_one_frame(void *packet,
 		size_t len,
-		OpusDecoder *decoder,
+		bool fec,
+		OpusMSDecoder *decoder,
+		const snd_pcm_format_t format,
+		void *pcm,
+		snd_pcm_sframes_t samples)
+{
+	int r;
+
+	if (format_is_float(format)) {
+		r = opus_multistream_decode_float(decoder, packet, packet ? len : 0,
+				pcm, samples, fec);
+	} else {
+		r = opus_multistream_decode(decoder, packet, packet ? len : 0,
+				pcm, samples, fec);
+	}
+	if (r < 0) {
+		fprintf(stderr, "opus_multistream_decode: %s\n", opus_strerror(r));
+		return -1;
+	}
+
+	return r;
+}
+
+/*
+ * Decode for playback, timing it
+ */
+
+static int decode(void *packet, size_t len, bool fec,
+		OpusMSDecoder *decoder, struct rx_stream *stream, void *pcm,
+		snd_pcm_sframes_t samples)
+{
+	unsigned long start;
+	int r;
+
+	start = stats_now();
+	r = decode_one_frame(packet, len, fec, decoder, stream->format, pcm,
+			samples);
+	stream->last_decode_ns = stats_now() - start;
+
+	if (stream->decode_ns)
+		stats_hist_add(stream->decode_ns, stream->last_decode_ns);
+
+	return r;
+}
+
+/*
+ * Decode straight into the device's buffer where the frame fits
+ * without wrapping; otherwise decode as usual and copy
+ */
+
+static int play_mmap(void *packet,
+		size_t len,
+		bool fec,
+		OpusMSDecoder *decoder,
 		snd_pcm_t *snd,
-		const unsigned int channels)
+		const unsigned int channels,
+		struct rx_stream *stream)
 {
 	int r;
-	int16_t *pcm;
-	snd_pcm_sframes_t f, samples = 1920;
+	void *buf;
+	bool convert = format_needs_conversion(stream->format);
+	snd_pcm_uframes_t offset;
+	snd_pcm_sframes_t f, n;
 
-	pcm = alloca(sizeof(*pcm) * samples * channels);
+	if (packet == NULL || fec) {
+		n = stream->last;
+	} else {
+		opus_int32 rate;
 
-	if (packet == NULL) {
-		r = opus_decode(decoder, NULL, 0, pcm, samples, 1);
+		/* The first stream's size is that of them all */
+
+		opus_multistream_decoder_ctl(decoder, OPUS_GET_SAMPLE_RATE(&rate));
+		n = opus_packet_get_nb_samples(packet, len, rate);
+	}
+	if (n < 0 || n > stream->samples)
+		n = stream->samples;
+
+	r = pcm_mmap_wait(snd, n);
+	if (r < 0)
+		goto recover;
+
+	r = pcm_mmap_begin(snd, n, &buf, &offset);
+	if (r < 0)
+		goto recover;
+
+	if (r == 1) {
+		/* Where a conversion is needed, it is the conversion
+		 * which writes to the device */
+
+		r = decode(packet, len, fec, decoder, stream,
+				convert ? stream->pcm : buf, n);
+		if (r < 0) {
+			pcm_mmap_commit(snd, offset, 0);
+			return -1;
+		}
+		if (convert) {
+			format_from_float(stream->format, buf, stream->pcm,
+					r * channels);
+		}
+
+		f = pcm_mmap_commit(snd, offset, r);
+		if (f < 0) {
+			r = f;
+			goto recover;
+		}
 	} else {
-		r = opus_decode(decoder, packet, len, pcm, samples, 0);
+		r = decode(packet, len, fec, decoder, stream, stream->pcm, n);
+		if (r < 0)
+			return -1;
+		if (convert) {
+			format_from_float(stream->format, stream->dev,
+					stream->pcm, r * channels);
+		}
+
+		f = snd_pcm_mmap_writei(snd, convert ? stream->dev : stream->pcm,
+				r);
+		if (f < 0) {
+			r = f;
+			goto recover;
+		}
 	}
+
+	stream->last = r;
+	return r;
+
+recover:
+	r = snd_pcm_recover(snd, r, 0);
 	if (r < 0) {
-		fprintf(stderr, "opus_decode: %s\n", opus_strerror(r));
+		aerror("snd_pcm_mmap_commit", r);
 		return -1;
 	}
+	return 0;
+}
+
+int play_one_frame(void *packet,
+		size_t len,
+		bool fec,
+		OpusMSDecoder *decoder,
+		snd_pcm_t *snd,
+		const unsigned int channels,
+		struct rx_stream *stream)
+{
+	int r;
+	void *pcm;
+	snd_pcm_sframes_t f;
+
+	if (stream->mmap)
+		return play_mmap(packet, len, fec, decoder, snd, channels, stream);
+
+	/* A recovered frame is the size of the one lost, which is taken
+	 * to be the same as the last */
+
+	r = decode(packet, len, fec, decoder, stream, stream->pcm,
+			(packet && !fec) ? stream->samples : stream->last);
+	if (r < 0)
+		return -1;
+	stream->last = r;
+
+	if (format_needs_conversion(stream->format)) {
+		format_from_float(stream->format, stream->dev, stream->pcm,
+				r * channels);
+		pcm = stream->dev;
+	} else {
+		pcm = stream->pcm;
+	}
+
+	if (stream->backend) {
+		if (backend_write(stream->backend, pcm, r) == -1)
+			return -1;
+		return r;
+	}
 
 	f = snd_pcm_writei(snd, pcm, r);
 	if (f < 0) {
@@ -37,4 +234,3 @@ int play_one_frame(void *packet,
 
 	return r;
 }
-
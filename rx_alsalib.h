@@ -1,13 +1,61 @@
 #ifndef RX_ALSALIB_H
 #define RX_ALSALIB_H
 
+#include <stdbool.h>
 #include <alsa/asoundlib.h>
-#include <opus/opus.h>
+#include <opus/opus_multistream.h>
+
+#include "backend.h"
+#include "stats.h"
+
+/* Largest frame we are prepared to decode */
+
+#define MAX_SAMPLES 1920
+
+/* Concealment before the first packet; a whole number of 2.5ms
+ * periods at every rate Opus supports */
+
+#define PLC_SAMPLES 120
+
+/*
+ * State of one decoded stream, so that playing a frame needs no
+ * allocation. Audio is decoded to 'pcm' in the working format (see
+ * format.h) and, if the device needs something else, converted to
+ * 'dev'
+ */
+
+struct rx_stream {
+	void *pcm, *dev;
+	snd_pcm_format_t format;
+	snd_pcm_sframes_t samples,
+		last; /* size of the last frame, for concealment */
+	unsigned int ts;
+	bool mmap; /* device uses SND_PCM_ACCESS_MMAP_INTERLEAVED */
+	struct backend *backend; /* in place of the device, if given */
+	struct stats_hist *decode_ns; /* if given */
+	unsigned long last_decode_ns;
+};
+
+int rx_stream_init(struct rx_stream *stream,
+		const unsigned int channels,
+		const snd_pcm_sframes_t samples,
+		const snd_pcm_format_t format);
+void rx_stream_clear(struct rx_stream *stream);
+
+int decode_one_frame(void *packet,
+		size_t len,
+		bool fec,
+		OpusMSDecoder *decoder,
+		const snd_pcm_format_t format,
+		void *pcm,
+		snd_pcm_sframes_t samples);
 
 int play_one_frame(void *packet,
 		size_t len,
-		OpusDecoder *decoder,
+		bool fec,
+		OpusMSDecoder *decoder,
 		snd_pcm_t *snd,
-		const unsigned int channels);
+		const unsigned int channels,
+		struct rx_stream *stream);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,716 @@
+#include <sys/epoll.h>
+
+#include "rx_looplib.h"
+#include "rx_alsalib.h"
+#include "backend.h"
+#include "device.h"
+#include "drift.h"
+#include "format.h"
+#include "mixer.h"
+#include "resample.h"
+#include "stats.h"
+
+#define MAX_EVENTS 64
+#define SOCKET UINT32_MAX
+
+extern unsigned int verbose;
+
+/*
+ * A playback device and the audio queued for it, in the device
+ * format. Audio is kept here until the device has taken all of it,
+ * as a non-blocking write may accept only part of a frame
+ */
+
+struct rx_out {
+	snd_pcm_t *snd;
+	struct backend *backend; /* in place of the device, if given */
+	bool mmap;
+	size_t frame_bytes;
+	char *pcm;
+	snd_pcm_sframes_t offset, pending;
+	unsigned int nfds;
+	struct pollfd *pfds;
+	stats_counter *xruns; /* if given */
+};
+
+/*
+ * Audio decoded for a peer, in the working format, and not yet
+ * played or mixed
+ */
+
+struct rx_queue {
+	size_t frame_bytes;
+	char *pcm;
+	snd_pcm_sframes_t offset, pending;
+};
+
+/*
+ * When correcting for drift, frames are decoded aside and resampled
+ * into the queue
+ */
+
+struct rx_peer {
+	struct rx_args *rx;
+	struct rx_queue q;
+	struct rx_out out;
+
+	void *decoded; /* if correcting for drift */
+	struct resampler rs;
+	struct drift drift;
+	unsigned int target; /* of the jitter buffer, when last anchored */
+};
+
+struct mix {
+	struct rx_loop *loop;
+	struct rx_peer *peers;
+	struct rx_out out;
+	void *sum; /* if the device format is not a working format */
+};
+
+/*
+ * Number of workers to use for the given number of peers, which
+ * is never more than the number of processors (or 'max', if given)
+ */
+
+unsigned int rx_loop_workers(unsigned int nr_peers, unsigned int max)
+{
+	long cpus;
+
+	if (max == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		max = cpus > 0 ? cpus : 1;
+	}
+
+	return nr_peers < max ? nr_peers : max;
+}
+
+/*
+ * Resample a decoded frame onto the end of the queue, at the rate
+ * which holds the audio waiting for this peer steady; returns the
+ * number of samples queued
+ */
+
+static size_t retime(struct rx_peer *p, unsigned int samples)
+{
+	const struct jbuf *jb = p->rx->jb;
+	struct rx_queue *q = &p->q;
+	void *out = q->pcm + q->pending * q->frame_bytes;
+	double step = p->drift.step;
+
+	/* The jitter buffer sets the level while it fills, and again
+	 * whenever it changes its mind */
+
+	if (!jb->started || jb->target != p->target) {
+		drift_anchor(&p->drift);
+		p->target = jb->target;
+	} else {
+		double level;
+
+		level = (double)jbuf_depth(jb) * jb->frame_ts * p->rx->rate / 8000
+			+ q->pending;
+		step = drift_update(&p->drift, level, samples);
+	}
+
+	if (format_is_float(p->rx->stream.format))
+		return resample_float(&p->rs, step, p->decoded, samples, out);
+	else
+		return resample(&p->rs, step, p->decoded, samples, out);
+}
+
+/*
+ * Receive and decode the next frame for the peer, appending it to
+ * the audio already queued. A packet which does not decode is
+ * counted and concealed, as if lost; it is one host's trouble, and
+ * the others carry on
+ */
+
+static void next_frame(struct rx_peer *p)
+{
+	int r, got;
+	const void *packet;
+	size_t len;
+	unsigned long start;
+	void *pcm;
+	struct rx_queue *q = &p->q;
+	struct rx_stream *s = &p->rx->stream;
+	struct stats_peer *st = p->rx->stats;
+
+	if (q->offset > 0) {
+		memmove(q->pcm, q->pcm + q->offset * q->frame_bytes,
+				q->pending * q->frame_bytes);
+		q->offset = 0;
+	}
+
+	drain_rx(p->rx, s->ts);
+
+	got = jbuf_get(p->rx->jb, &packet, &len);
+	if (got == JBUF_MISSING) {
+		packet = NULL;
+		len = 0;
+	}
+	if (verbose > 1)
+		fputc(got == JBUF_PACKET ? '.' :
+			got == JBUF_FEC ? '+' : '#', stderr);
+
+	start = stats_now();
+
+	pcm = p->decoded ? p->decoded : q->pcm + q->pending * q->frame_bytes;
+	r = decode_one_frame((void *)packet, len, got == JBUF_FEC,
+			p->rx->decoder, s->format, pcm,
+			got == JBUF_PACKET ? MAX_SAMPLES : s->last);
+	if (r == -1) {
+		if (st)
+			stats_add(&st->decode_errors, 1);
+		got = JBUF_MISSING;
+		r = decode_one_frame(NULL, 0, false, p->rx->decoder, s->format,
+				pcm, s->last);
+	}
+	if (r == -1) {
+		memset(pcm, 0, s->last * q->frame_bytes);
+		r = s->last;
+	}
+	s->last = r;
+
+	/* Follow the RFC, payload 0 has 8kHz reference rate */
+	s->ts += r * 8000 / p->rx->rate;
+
+	if (p->decoded)
+		q->pending += retime(p, r);
+	else
+		q->pending += r;
+
+	if (st) {
+		stats_hist_add(&st->decode_ns, stats_now() - start);
+		if (got != JBUF_PACKET)
+			stats_add(&st->concealed, 1);
+		if (p->decoded)
+			stats_set(&st->drift_ppm, drift_ppm(&p->drift));
+		publish_rx(p->rx);
+	}
+}
+
+/*
+ * Forget a peer's stream, so that its slot can be used by another
+ */
+
+static void reset(struct rx_peer *p)
+{
+	struct rx_stream *s = &p->rx->stream;
+
+	p->q.offset = p->q.pending = 0;
+	s->ts = 0;
+	s->last = PLC_SAMPLES;
+
+	if (p->decoded) {
+		resampler_reset(&p->rs);
+		drift_reset(&p->drift);
+	}
+}
+
+/*
+ * Take over a peer handed to us, at the first period or packet,
+ * whichever comes first; a packet must not be left unread, or the
+ * socket wakes us again at once. Returns false if the peer was
+ * removed before it could be taken, and is to be let go instead
+ */
+
+static bool take(struct rx_peer *p)
+{
+	reset(p);
+	return slot_cas(&p->rx->state, SLOT_STARTING, SLOT_ACTIVE);
+}
+
+/*
+ * Sum one period from every peer into the given buffer, in the
+ * device format
+ */
+
+static void next_period(struct mix *m, void *pcm)
+{
+	unsigned int n;
+	struct rx_loop *loop = m->loop;
+	size_t samples = loop->frame * loop->channels;
+	bool fl = format_is_float(loop->format);
+	void *sum = m->sum ? m->sum : pcm;
+
+	if (fl)
+		mix_clear_float(sum, samples);
+	else
+		mix_clear(sum, samples);
+
+	for (n = 0; n < loop->nr_peers; n++) {
+		struct rx_peer *p = &m->peers[n];
+		const void *in;
+
+		/* Peers come and go between periods */
+
+		switch (slot_get(&p->rx->state)) {
+		case SLOT_ACTIVE:
+			break;
+		case SLOT_STARTING:
+			if (take(p))
+				break;
+			/* fall through */
+		case SLOT_REMOVING:
+			slot_set(&p->rx->state, SLOT_REMOVED);
+			/* fall through */
+		default:
+			continue;
+		}
+
+		while (p->q.pending < loop->frame)
+			next_frame(p);
+
+		in = p->q.pcm + p->q.offset * p->q.frame_bytes;
+		if (fl)
+			mix_add_float(sum, in, samples, p->rx->gain);
+		else
+			mix_add(sum, in, samples, p->rx->gain);
+
+		p->q.offset += loop->frame;
+		p->q.pending -= loop->frame;
+	}
+
+	if (m->sum)
+		format_from_float(loop->format, pcm, m->sum, samples);
+}
+
+/*
+ * Fill the device's buffer for as long as it will accept audio
+ * without blocking, calling refill() when the queue runs dry.
+ *
+ * A memory-mapped device may also be given direct(), which renders
+ * a period straight into the device's buffer, returning 1; or 0 if
+ * it could not, as the buffer wraps.
+ */
+
+static int service(struct rx_out *o, int (*refill)(void *),
+		int (*direct)(void *), void *arg)
+{
+	int r;
+	snd_pcm_sframes_t f;
+
+	for (;;) {
+		if (o->pending == 0 && direct) {
+			r = direct(arg);
+			if (r == -EAGAIN)
+				return 0;
+			if (r == -1)
+				return -1;
+			if (r < 0) {
+				f = r;
+				goto recover;
+			}
+			if (r == 1)
+				continue;
+		}
+
+		if (o->pending == 0 && refill(arg) == -1)
+			return -1;
+
+		if (o->backend) {
+			f = backend_write_nonblock(o->backend,
+					o->pcm + o->offset * o->frame_bytes,
+					o->pending);
+			if (f == -1)
+				return -1;
+		} else if (o->mmap) {
+			f = snd_pcm_mmap_writei(o->snd,
+					o->pcm + o->offset * o->frame_bytes,
+					o->pending);
+		} else {
+			f = snd_pcm_writei(o->snd,
+					o->pcm + o->offset * o->frame_bytes,
+					o->pending);
+		}
+		if (f == -EAGAIN)
+			return 0;
+		if (f < 0)
+			goto recover;
+
+		o->offset += f;
+		o->pending -= f;
+		continue;
+
+recover:
+		if (o->xruns)
+			stats_add(o->xruns, 1);
+
+		/* A backend has already started again */
+
+		if (o->backend == NULL) {
+			f = snd_pcm_recover(o->snd, f, 0);
+			if (f < 0) {
+				aerror("snd_pcm_writei", f);
+				return -1;
+			}
+		}
+		o->offset = o->pending = 0;
+	}
+}
+
+/*
+ * Hand the peer's next frame to its own device, converting it if
+ * need be
+ */
+
+static int refill_peer(void *arg)
+{
+	struct rx_peer *p = arg;
+	struct rx_stream *s = &p->rx->stream;
+
+	next_frame(p);
+
+	if (s->dev) {
+		format_from_float(s->format, s->dev, (float *)p->q.pcm,
+				p->q.pending * p->rx->channels);
+	}
+
+	p->out.offset = 0;
+	p->out.pending = p->q.pending;
+	p->q.pending = 0;
+
+	return 0;
+}
+
+static int refill_mix(void *arg)
+{
+	struct mix *m = arg;
+
+	next_period(m, m->out.pcm);
+
+	m->out.offset = 0;
+	m->out.pending = m->loop->frame;
+
+	return 0;
+}
+
+/*
+ * Mix in place, saving a copy of every period. ALSA errors are
+ * returned negative, as is -EAGAIN when the device is full
+ */
+
+static int direct_mix(void *arg)
+{
+	int r;
+	void *buf;
+	struct mix *m = arg;
+	snd_pcm_t *snd = m->out.snd;
+	snd_pcm_uframes_t offset;
+	snd_pcm_sframes_t avail;
+
+	avail = snd_pcm_avail_update(snd);
+	if (avail < 0)
+		return avail;
+	if ((snd_pcm_uframes_t)avail < m->loop->frame)
+		return -EAGAIN;
+
+	r = pcm_mmap_begin(snd, m->loop->frame, &buf, &offset);
+	if (r <= 0)
+		return r;
+
+	next_period(m, buf);
+
+	r = pcm_mmap_commit(snd, offset, m->loop->frame);
+	if (r < 0)
+		return r;
+
+	return 1;
+}
+
+static void init_out(struct rx_out *o, snd_pcm_t *snd,
+		struct backend *backend, bool mmap, size_t frame_bytes, void *pcm,
+		stats_counter *xruns)
+{
+	o->snd = snd;
+	o->backend = backend;
+	o->xruns = xruns;
+	o->mmap = mmap;
+	o->frame_bytes = frame_bytes;
+	o->pcm = pcm;
+	o->offset = o->pending = 0;
+}
+
+/*
+ * Events are tagged with an index in the upper half (the peer, or
+ * nr_peers for the mixed device) and the descriptor index, or
+ * SOCKET, in the lower half
+ */
+
+int rx_loop_init(struct rx_loop *loop)
+{
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start or stop taking packets from a peer's session; may be called
+ * from any thread
+ */
+
+int rx_loop_watch(struct rx_loop *loop, unsigned int n)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u64 = (uint64_t)n << 32 | SOCKET
+	};
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD,
+			rx_socket(loop->peers[n]), &ev) == -1)
+	{
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+int rx_loop_unwatch(struct rx_loop *loop, unsigned int n)
+{
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL,
+			rx_socket(loop->peers[n]), NULL) == -1)
+	{
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int watch_out(int epfd, struct rx_out *o, unsigned int index)
+{
+	unsigned int n;
+	int r;
+
+	/* A backend wakes us on its timer alone */
+
+	if (o->backend) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.u64 = (uint64_t)index << 32
+		};
+
+		o->nfds = 0;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, o->backend->timer, &ev) == -1) {
+			perror("epoll_ctl");
+			return -1;
+		}
+		return 0;
+	}
+
+	r = snd_pcm_poll_descriptors_count(o->snd);
+	if (r <= 0) {
+		aerror("snd_pcm_poll_descriptors_count", r);
+		return -1;
+	}
+	o->nfds = r;
+
+	o->pfds = calloc(o->nfds, sizeof(*o->pfds));
+	if (o->pfds == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	r = snd_pcm_poll_descriptors(o->snd, o->pfds, o->nfds);
+	if (r < 0) {
+		aerror("snd_pcm_poll_descriptors", r);
+		return -1;
+	}
+
+	for (n = 0; n < o->nfds; n++) {
+		struct epoll_event ev = {
+			.events = o->pfds[n].events,
+			.data.u64 = (uint64_t)index << 32 | n
+		};
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, o->pfds[n].fd, &ev) == -1) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Translate an epoll event on one of the device's descriptors into
+ * ALSA's view of the device; some plugins depend on this to
+ * acknowledge the wakeup
+ */
+
+static int ready(struct rx_out *o, unsigned int fd, uint32_t events)
+{
+	unsigned int n;
+	unsigned short revents;
+	int r;
+
+	if (o->backend)
+		return backend_ready(o->backend) == -1 ? -1 : 1;
+
+	for (n = 0; n < o->nfds; n++)
+		o->pfds[n].revents = (n == fd) ? events : 0;
+
+	r = snd_pcm_poll_descriptors_revents(o->snd, o->pfds, o->nfds,
+			&revents);
+	if (r < 0) {
+		aerror("snd_pcm_poll_descriptors_revents", r);
+		return -1;
+	}
+
+	return (revents & (POLLOUT | POLLERR)) != 0;
+}
+
+void *run_rx_loop(struct rx_loop *loop)
+{
+	int epfd = loop->epfd;
+	unsigned int n;
+	struct rx_peer *peers;
+	int (*direct)(void *) = loop->mmap && !loop->backend ? direct_mix : NULL;
+	bool mixed = loop->snd || loop->backend;
+	size_t dev_bytes = format_bytes(loop->format) * loop->channels;
+	struct mix mix = {
+		.loop = loop
+	};
+
+	peers = calloc(loop->nr_peers, sizeof(*peers));
+	if (peers == NULL) {
+		perror("calloc");
+		return (void *)-1;
+	}
+	mix.peers = peers;
+
+	for (n = 0; n < loop->nr_peers; n++) {
+		struct rx_peer *p = &peers[n];
+		struct rx_args *rx = loop->peers[n];
+		struct rx_stream *s = &rx->stream;
+
+		p->rx = rx;
+
+		/* Room for a whole frame, resampled, on top of the
+		 * remains of the last period */
+
+		if (rx_stream_init(s, rx->channels, MAX_SAMPLES
+					+ RESAMPLE_SLACK(MAX_SAMPLES) + loop->frame,
+					loop->format) == -1)
+		{
+			return (void *)-1;
+		}
+
+		p->q.frame_bytes = format_work_bytes(loop->format) * rx->channels;
+		p->q.pcm = s->pcm;
+		p->q.offset = p->q.pending = 0;
+
+		if (loop->drift) {
+			p->decoded = alloc_pcm(MAX_SAMPLES * p->q.frame_bytes);
+			if (p->decoded == NULL)
+				return (void *)-1;
+			if (resampler_init(&p->rs, rx->channels, MAX_SAMPLES) == -1)
+				return (void *)-1;
+			drift_init(&p->drift, rx->rate, loop->drift);
+		}
+
+		/* Packets are taken off the socket as soon as they arrive,
+		 * whether or not the device needs audio. Peers added later
+		 * are watched as they are added */
+
+		if (slot_get(&rx->state) != SLOT_ACTIVE)
+			continue;
+		if (rx_loop_watch(loop, n) == -1)
+			return (void *)-1;
+
+		if (mixed)
+			continue;
+
+		init_out(&p->out, rx->snd, NULL, loop->mmap, dev_bytes,
+				s->dev ? s->dev : s->pcm,
+				rx->stats ? &rx->stats->xruns : NULL);
+		if (watch_out(epfd, &p->out, n) == -1)
+			return (void *)-1;
+
+		/* Prime the device so that it has something to wake on */
+
+		if (service(&p->out, refill_peer, NULL, p) == -1)
+			return (void *)-1;
+	}
+
+	if (mixed) {
+		void *pcm;
+
+		pcm = alloc_pcm(loop->frame * dev_bytes);
+		if (pcm == NULL)
+			return (void *)-1;
+
+		if (format_needs_conversion(loop->format)) {
+			mix.sum = alloc_pcm(sizeof(float) * loop->frame
+					* loop->channels);
+			if (mix.sum == NULL)
+				return (void *)-1;
+		}
+
+		init_out(&mix.out, loop->snd, loop->backend,
+				loop->mmap && !loop->backend, dev_bytes, pcm, loop->xruns);
+		if (watch_out(epfd, &mix.out, loop->nr_peers) == -1)
+			return (void *)-1;
+		if (service(&mix.out, refill_mix, direct, &mix) == -1)
+			return (void *)-1;
+	}
+
+	for (;;) {
+		struct epoll_event ev[MAX_EVENTS];
+		int e, nev;
+
+		nev = epoll_wait(epfd, ev, MAX_EVENTS, -1);
+		if (nev == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return (void *)-1;
+		}
+
+		for (e = 0; e < nev; e++) {
+			unsigned int index = ev[e].data.u64 >> 32,
+				fd = ev[e].data.u64 & 0xffffffff;
+			int r;
+
+			if (fd == SOCKET) {
+				struct rx_peer *p = &peers[index];
+
+				/* A peer is watched only while it is ours, but
+				 * the event may be from before it was removed */
+
+				switch (slot_get(&p->rx->state)) {
+				case SLOT_STARTING:
+					if (!take(p)) {
+						slot_set(&p->rx->state, SLOT_REMOVED);
+						break;
+					}
+					/* fall through */
+				case SLOT_ACTIVE:
+					drain_rx(p->rx, p->rx->stream.ts);
+					break;
+				}
+				continue;
+			}
+
+			if (index == loop->nr_peers) {
+				r = ready(&mix.out, fd, ev[e].events);
+				if (r == 1)
+					r = service(&mix.out, refill_mix, direct, &mix);
+			} else {
+				struct rx_peer *p = &peers[index];
+
+				r = ready(&p->out, fd, ev[e].events);
+				if (r == 1)
+					r = service(&p->out, refill_peer, NULL, p);
+			}
+
+			if (r == -1)
+				return (void *)-1;
+		}
+	}
+}
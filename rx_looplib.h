@@ -0,0 +1,51 @@
+#ifndef RX_LOOPLIB_H
+#define RX_LOOPLIB_H
+
+#include "rx_runlib.h"
+
+/*
+ * A receive worker services any number of peers from a single
+ * thread, sleeping in epoll until a packet arrives or a playback
+ * device has room.
+ *
+ * If 'snd' is given, the peers are mixed into that one device in
+ * periods of 'frame' samples. Otherwise each peer plays to its own
+ * device. Either way, devices must be opened with SND_PCM_NONBLOCK
+ * and set up with the given 'format'.
+ * Memory-mapped devices are mixed into in place. In place of 'snd',
+ * the peers may be mixed to a sink of backend.h, which the loop
+ * writes without blocking.
+ *
+ * With 'drift', each peer is resampled to hold steady the audio
+ * waiting for it, against the drift of its clock from ours (see
+ * drift.h).
+ *
+ * When mixing, peers may be added and removed as the loop runs (see
+ * slot.h); only those ACTIVE at the start are watched by the loop
+ * itself.
+ */
+
+struct rx_loop {
+	unsigned int nr_peers;
+	struct rx_args **peers;
+
+	snd_pcm_t *snd;
+	struct backend *backend; /* in place of 'snd', if given */
+	snd_pcm_format_t format;
+	unsigned int channels;
+	snd_pcm_uframes_t frame;
+
+	bool mmap; /* devices use SND_PCM_ACCESS_MMAP_INTERLEAVED */
+	stats_counter *xruns; /* of 'snd', if given */
+	unsigned int drift; /* most to correct clock drift by, in ppm */
+
+	int epfd;
+};
+
+unsigned int rx_loop_workers(unsigned int nr_peers, unsigned int max);
+int rx_loop_init(struct rx_loop *loop);
+int rx_loop_watch(struct rx_loop *loop, unsigned int n);
+int rx_loop_unwatch(struct rx_loop *loop, unsigned int n);
+void *run_rx_loop(struct rx_loop *loop);
+
+#endif
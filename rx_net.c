@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "rx_net.h"
+
+#define MAX_EVENTS 64
+#define WAKE UINT32_MAX
+
+/*
+ * Give each receiver its queue; the receivers' sockets belong to
+ * the network stage from here on
+ */
+
+struct rx_net* rx_net_new(struct rx_args **rx, unsigned int nr_rx)
+{
+	struct rx_net *n;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = WAKE
+	};
+	unsigned int i;
+
+	n = calloc(1, sizeof *n);
+	if (n == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	n->nr_rx = nr_rx;
+	n->rx = rx;
+	n->epfd = n->wake = -1;
+
+	n->queue = calloc(nr_rx, sizeof *n->queue);
+	if (n->queue == NULL) {
+		perror("calloc");
+		goto fail;
+	}
+
+	n->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (n->epfd == -1) {
+		perror("epoll_create1");
+		goto fail;
+	}
+
+	n->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (n->wake == -1) {
+		perror("eventfd");
+		goto fail;
+	}
+	if (epoll_ctl(n->epfd, EPOLL_CTL_ADD, n->wake, &ev) == -1) {
+		perror("epoll_ctl");
+		goto fail;
+	}
+
+	for (i = 0; i < nr_rx; i++) {
+		if (ring_init(&n->queue[i], RX_NET_QUEUE) == -1)
+			goto fail;
+
+		ev.data.u32 = i;
+		if (epoll_ctl(n->epfd, EPOLL_CTL_ADD, rx_socket(rx[i]), &ev) == -1) {
+			perror("epoll_ctl");
+			goto fail;
+		}
+
+		rx[i]->queue = &n->queue[i];
+	}
+
+	return n;
+
+fail:
+	rx_net_free(n);
+	return NULL;
+}
+
+void rx_net_free(struct rx_net *n)
+{
+	unsigned int i;
+	uint64_t one = 1;
+
+	if (n->started) {
+		atomic_store(&n->quit, true);
+		if (write(n->wake, &one, sizeof one) == -1)
+			perror("write");
+		pthread_join(n->thread, NULL);
+	}
+
+	for (i = 0; n->queue && i < n->nr_rx; i++) {
+		if (n->rx[i]->queue == &n->queue[i])
+			n->rx[i]->queue = NULL;
+		if (n->queue[i].buf)
+			ring_clear(&n->queue[i]);
+	}
+
+	if (n->wake != -1)
+		close(n->wake);
+	if (n->epfd != -1)
+		close(n->epfd);
+	free(n->queue);
+	free(n);
+}
+
+static void* run_net(void *arg)
+{
+	struct rx_net *n = arg;
+
+	while (!atomic_load(&n->quit)) {
+		struct epoll_event ev[MAX_EVENTS];
+		int e, nev;
+
+		nev = epoll_wait(n->epfd, ev, MAX_EVENTS, -1);
+		if (nev == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return (void *)-1;
+		}
+
+		for (e = 0; e < nev; e++) {
+			unsigned int i = ev[e].data.u32;
+
+			/* oRTP's own jitter buffer is not used, so the
+			 * timestamp asked for does not matter */
+
+			if (i != WAKE)
+				receive_rx(n->rx[i], 0);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the stage on a thread of its own, with the scheduling of
+ * the caller
+ */
+
+int rx_net_start(struct rx_net *n)
+{
+	int r;
+
+	r = pthread_create(&n->thread, NULL, run_net, n);
+	if (r != 0) {
+		errno = r;
+		perror("pthread_create");
+		return -1;
+	}
+	n->started = true;
+
+	return 0;
+}
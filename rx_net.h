@@ -0,0 +1,42 @@
+#ifndef RX_NET_H
+#define RX_NET_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "ring.h"
+#include "rx_runlib.h"
+
+/*
+ * Network stage: a thread of its own receives packets for any number
+ * of receivers as they arrive, and queues them for the playback
+ * stage, which takes them into the jitter buffer at the pace of the
+ * audio clock (see drain_rx). So a stall in playback does not hold
+ * up the socket, and the kernel's buffer does not overflow.
+ *
+ * Each receiver has a ring (see ring.h) between the two stages, so
+ * neither ever waits for the other; if playback falls so far behind
+ * that the ring is full, the packet is dropped and counted, as if
+ * the socket buffer had overflowed.
+ */
+
+#define RX_NET_QUEUE (128 * 1024) /* bytes, for each receiver */
+
+struct rx_net {
+	unsigned int nr_rx;
+	struct rx_args **rx;
+	struct ring *queue;
+
+	int epfd, wake;
+	pthread_t thread;
+	bool started;
+	atomic_bool quit;
+};
+
+struct rx_net* rx_net_new(struct rx_args **rx, unsigned int nr_rx);
+void rx_net_free(struct rx_net *n);
+
+int rx_net_start(struct rx_net *n);
+
+#endif
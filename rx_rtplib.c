@@ -1,16 +1,6 @@
 #include "rx_rtplib.h"
 
-extern unsigned int verbose;
-
-static void timestamp_jump(RtpSession *session, void *a, void *b, void *c)
-{
-	if (verbose > 1)
-		fputc('|', stderr);
-	rtp_session_resync(session);
-}
-
-RtpSession* create_rtp_recv(const char *addr_desc, const int port,
-		unsigned int jitter)
+RtpSession* create_rtp_recv(const char *addr_desc, const int port)
 {
 	RtpSession *session;
 
@@ -19,17 +9,14 @@ RtpSession* create_rtp_recv(const char *addr_desc, const int port,
 	rtp_session_set_blocking_mode(session, FALSE);
 	rtp_session_set_local_addr(session, addr_desc, port, -1);
 	rtp_session_set_connected_mode(session, FALSE);
-	rtp_session_enable_adaptive_jitter_compensation(session, TRUE);
-	rtp_session_set_jitter_compensation(session, jitter); /* ms */
-	rtp_session_set_time_jump_limit(session, jitter * 16); /* ms */
+
+	/* Packets are handed over as they arrive, to our own jitter
+	 * buffer (jbuf.c) */
+
+	rtp_session_enable_jitter_buffer(session, FALSE);
 	rtp_profile_set_payload(&av_profile, 120, &payload_type_opus);
 	if (rtp_session_set_payload_type(session, 120) != 0)
 		abort();
-	if (rtp_session_signal_connect(session, "timestamp_jump",
-					timestamp_jump, 0) != 0)
-	{
-		abort();
-	}
 
 	/*
 	 * oRTP in RECVONLY mode attempts to send RTCP packets and
@@ -3,7 +3,6 @@
 
 #include <ortp/ortp.h>
 
-RtpSession* create_rtp_recv(const char *addr_desc, const int port,
-		unsigned int jitter);
+RtpSession* create_rtp_recv(const char *addr_desc, const int port);
 
 #endif
\ No newline at end of file
@@ -1,36 +1,332 @@
+#include <string.h>
+#include <time.h>
+
 #include "rx_runlib.h"
 #include "rx_alsalib.h"
 
 extern unsigned int verbose;
 
-void *run_rx(struct rx_args *rx)
+/*
+ * Pass on what the peer reports of the loss of our own stream
+ */
+
+static void read_reports(struct rx_args *rx)
+{
+	OrtpEvent *ev;
+	uint32_t ssrc = rtp_session_get_send_ssrc(rx->session);
+
+	while ((ev = ortp_ev_queue_get(rx->events)) != NULL) {
+		mblk_t *m;
+
+		if (ortp_event_get_type(ev) != ORTP_EVENT_RTCP_PACKET_RECEIVED) {
+			ortp_event_destroy(ev);
+			continue;
+		}
+
+		m = ortp_event_get_data(ev)->packet;
+		do {
+			const report_block_t *rb = NULL;
+
+			if (rtcp_is_SR(m))
+				rb = rtcp_SR_get_report_block(m, 0);
+			else if (rtcp_is_RR(m))
+				rb = rtcp_RR_get_report_block(m, 0);
+
+			if (rb && report_block_get_ssrc(rb) == ssrc)
+				adapt_report(rx->adapt, report_block_get_fraction_lost(rb));
+		} while (rtcp_next_packet(m));
+
+		ortp_event_destroy(ev);
+	}
+}
+
+/*
+ * The socket which packets arrive on, for polling
+ */
+
+int rx_socket(const struct rx_args *rx)
+{
+	if (rx->rtp)
+		return rx->rtp->fd;
+	else
+		return rtp_session_get_rtp_socket(rx->session);
+}
+
+/*
+ * A packet on its way from the network stage to the playback stage
+ */
+
+struct queued {
+	uint16_t seq;
+	uint32_t ts;
+	unsigned long arrival, queued;
+	size_t len;
+	unsigned char payload[];
+};
+
+static void enqueue(struct rx_args *rx, uint16_t seq, uint32_t ts,
+		unsigned long arrival, const void *payload, size_t len)
+{
+	struct queued *q;
+
+	q = ring_reserve(rx->queue, sizeof *q + len);
+	if (q == NULL) {
+		if (rx->stats)
+			stats_add(&rx->stats->queue_full, 1);
+		return;
+	}
+
+	q->seq = seq;
+	q->ts = ts;
+	q->arrival = arrival;
+	q->queued = stats_now();
+	q->len = len;
+	memcpy(q->payload, payload, len);
+	ring_commit(rx->queue, sizeof *q + len);
+
+	if (rx->stats)
+		stats_hist_add(&rx->stats->net_ns, q->queued - arrival);
+}
+
+/*
+ * Take everything the network stage has queued into the jitter
+ * buffer
+ */
+
+static void dequeue(struct rx_args *rx)
+{
+	const struct queued *q;
+	size_t len;
+
+	while ((q = ring_peek(rx->queue, &len)) != NULL) {
+		jbuf_put(rx->jb, q->seq, q->ts, q->arrival, q->payload, q->len);
+		if (rx->stats)
+			stats_hist_add(&rx->stats->queue_ns, stats_now() - q->queued);
+		ring_release(rx->queue);
+	}
+}
+
+/*
+ * Take one packet into the jitter buffer, or queue it for the
+ * playback stage; recording its arrival if a trace was asked for,
+ * and the packet itself if the stream is being recorded. oRTP gives
+ * no arrival time, so packets from a session are taken as arriving
+ * now
+ *
+ * The stamp is taken here, on arrival, and not when played.
+ *
+ * The trace is plain stdio, so this thread may wait on the disk
+ * whenever its buffer is flushed; unlike a recording (see
+ * recorder.h) it is a diagnostic, and may upset the timing it
+ * records
+ */
+
+static void take(struct rx_args *rx, uint16_t seq, uint32_t ts,
+		unsigned long arrival, const void *payload, size_t len,
+		uint16_t ext_profile, const void *ext, size_t ext_len)
+{
+	struct stamp stamp;
+
+	if (rx->stamp.enabled &&
+		stamp_parse(ext_profile, ext, ext_len, &stamp) == 0)
+	{
+		stamp_received(&rx->stamp, &stamp, arrival, rx->stats);
+	}
+
+	if (rx->trace)
+		fprintf(rx->trace, "%lu %u %u %zu\n", arrival, seq, ts, len);
+
+	if (rx->record)
+		record_put(rx->record, ts, payload, len);
+
+	if (rx->queue)
+		enqueue(rx, seq, ts, arrival, payload, len);
+	else
+		jbuf_put(rx->jb, seq, ts, arrival, payload, len);
+}
+
+static void drain_native(struct rx_args *rx)
+{
+	struct rtp_packet p;
+	int fraction;
+
+	while (rtp_recv(rx->rtp, &p) == 1)
+		take(rx, p.seq, p.ts, p.arrival, p.payload, p.len,
+				p.ext_profile, p.ext, p.ext_len);
+
+	fraction = rtp_rtcp(rx->rtp);
+	if (fraction != -1 && rx->adapt)
+		adapt_report(rx->adapt, fraction);
+}
+
+/*
+ * Receive every packet waiting on the session; called by whichever
+ * stage owns the socket
+ */
+
+void receive_rx(struct rx_args *rx, uint32_t ts)
 {
-	int ts = 0;
+	mblk_t *mp;
+
+	if (rx->rtp) {
+		drain_native(rx);
+		return;
+	}
+
+	while ((mp = rtp_session_recvm_with_ts(rx->session, ts)) != NULL) {
+		unsigned char *payload, *ext = NULL;
+		uint16_t profile = 0;
+		int len, ext_len;
+
+		len = rtp_get_payload(mp, &payload);
+		ext_len = rtp_get_extheader(mp, &profile, &ext);
+		if (ext_len < 0)
+			ext_len = 0;
+
+		take(rx, rtp_get_seqnumber(mp), rtp_get_timestamp(mp),
+				stats_now(), payload, len, profile, ext, ext_len);
+		freemsg(mp);
+	}
+
+	/* RTCP is read by the same call as the packets */
+
+	if (rx->events)
+		read_reports(rx);
+}
+
+/*
+ * Bring the jitter buffer up to date, from the network stage if
+ * there is one, or the socket
+ */
+
+void drain_rx(struct rx_args *rx, uint32_t ts)
+{
+	if (rx->queue)
+		dequeue(rx);
+	else
+		receive_rx(rx, ts);
+}
+
+/*
+ * Complete the path measured from stamps with our own side of it:
+ * how long the packet just played waited since it arrived, and how
+ * long its first sample has to go before it is heard
+ */
+
+static void publish_latency(struct rx_args *rx)
+{
+	struct stats_peer *st = rx->stats;
+	const struct jbuf *jb = rx->jb;
+	unsigned long jitter, playback = 0, total;
+	snd_pcm_sframes_t delay;
+
+	if (!rx->stamp.synced || jb->played_arrival == 0)
+		return;
+
+	jitter = (stats_now() - jb->played_arrival) / 1000;
+
+	if (rx->out && snd_pcm_delay(rx->out, &delay) == 0 && delay > 0) {
+		playback = delay * 1000000UL / rx->rate;
+		/* 125us per timestamp unit, as the RFC's 8kHz */
+		playback -= playback > jb->frame_ts * 125UL ?
+			jb->frame_ts * 125UL : playback;
+	}
 
+	total = stats_get(&st->e2e_capture_us) + stats_get(&st->e2e_encode_us)
+		+ stats_get(&st->e2e_network_us) + jitter + playback;
+
+	stats_set(&st->e2e_jitter_us, jitter);
+	stats_set(&st->e2e_playback_us, playback);
+	stats_set(&st->e2e_total_us, total);
+}
+
+/*
+ * Copy out the jitter buffer's view of the stream, and now and
+ * then the session's; called once per period
+ */
+
+#define SESSION_PERIODS 256
+#define LATENCY_PERIODS 32
+
+void publish_rx(struct rx_args *rx)
+{
+	struct stats_peer *st = rx->stats;
+	const struct jbuf *jb = rx->jb;
+	unsigned long periods;
+	unsigned int depth;
+
+	depth = jbuf_ms(jb, jbuf_depth(jb));
+
+	stats_set(&st->received, jb->stats.received);
+	stats_set(&st->played, jb->stats.played);
+	stats_set(&st->lost, jb->stats.lost);
+	stats_set(&st->fec, jb->stats.fec);
+	stats_set(&st->late, jb->stats.late);
+	stats_set(&st->early, jb->stats.early);
+	stats_set(&st->duplicate, jb->stats.duplicate);
+	stats_set(&st->underrun, jb->stats.underrun);
+	stats_set(&st->dropped, jb->stats.dropped);
+	stats_set(&st->depth_ms, depth);
+	stats_set(&st->target_ms, jbuf_ms(jb, jb->target));
+	stats_hist_add(&st->depth_ms_hist, depth);
+
+	periods = stats_get(&st->periods);
+	stats_set(&st->periods, periods + 1);
+
+	if (periods % LATENCY_PERIODS == 0 && rx->stamp.enabled)
+		publish_latency(rx);
+
+	if (periods % SESSION_PERIODS == 0 && rx->rtp) {
+		const struct rtp_stats *rs = &rx->rtp->stats;
+
+		stats_set(&st->jitter, rs->jitter);
+		stats_set(&st->max_jitter, rs->max_jitter);
+		stats_set(&st->cum_loss, rs->cum_loss);
+		stats_set(&st->recv_bandwidth, rs->bandwidth);
+	} else if (periods % SESSION_PERIODS == 0) {
+		const struct jitter_stats *jitter;
+
+		jitter = rtp_session_get_jitter_stats(rx->session);
+		stats_set(&st->jitter, jitter->jitter);
+		stats_set(&st->max_jitter, jitter->max_jitter);
+		stats_set(&st->round_trip_us,
+			rtp_session_get_round_trip_propagation(rx->session) * 1e6);
+		stats_set(&st->cum_loss, rtp_session_get_cum_loss(rx->session));
+		stats_set(&st->recv_bandwidth,
+			rtp_session_get_recv_bandwidth(rx->session));
+	}
+}
+
+void *run_rx(struct rx_args *rx)
+{
 	for (;;) {
-		int r, have_more;
-		char buf[32768];
-		void *packet;
-
-		r = rtp_session_recv_with_ts(rx->session, (uint8_t*)buf,
-				sizeof(buf), ts, &have_more);
-		assert(r >= 0);
-		assert(have_more == 0);
-		if (r == 0) {
+		int r, got;
+		const void *packet;
+		size_t len;
+
+		drain_rx(rx, rx->stream.ts);
+
+		got = jbuf_get(rx->jb, &packet, &len);
+		if (got == JBUF_MISSING) {
 			packet = NULL;
-			if (verbose > 1)
-				fputc('#', stderr);
-		} else {
-			packet = buf;
-			if (verbose > 1)
-				fputc('.', stderr);
+			len = 0;
 		}
+		if (verbose > 1)
+			fputc(got == JBUF_PACKET ? '.' :
+				got == JBUF_FEC ? '+' : '#', stderr);
 
-		r = play_one_frame(packet, r, rx->decoder, rx->snd, rx->channels);
+		r = play_one_frame((void *)packet, len, got == JBUF_FEC,
+				rx->decoder, rx->snd, rx->channels, &rx->stream);
 		if (r == -1)
 			return (void *)-1;
 
 		/* Follow the RFC, payload 0 has 8kHz reference rate */
-		ts += r * 8000 / rx->rate;
+		rx->stream.ts += r * 8000 / rx->rate;
+
+		if (rx->stats) {
+			if (got != JBUF_PACKET)
+				stats_add(&rx->stats->concealed, 1);
+			publish_rx(rx);
+		}
 	}
 }
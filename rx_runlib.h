@@ -2,17 +2,44 @@
 #define RX_RUNLIB_H
 
 #include <alsa/asoundlib.h>
-#include <opus/opus.h>
+#include <opus/opus_multistream.h>
 #include <ortp/ortp.h>
 
+#include "adapt.h"
+#include "jbuf.h"
+#include "recorder.h"
+#include "ring.h"
+#include "rtp.h"
+#include "slot.h"
+#include "stamp.h"
+#include "stats.h"
+#include "rx_alsalib.h"
+
 struct rx_args {
+	slot_t state; /* when run by rx_looplib */
 	RtpSession *session;
-	OpusDecoder *decoder;
+	struct rtp *rtp; /* if given, used in place of the session */
+	struct ring *queue; /* if given, packets come from rx_net.h */
+	OpusMSDecoder *decoder;
 	snd_pcm_t *snd;
+	snd_pcm_t *out; /* device played to, for latency; if given */
+	struct jbuf *jb;
+	FILE *trace; /* written on receipt, so a diagnostic only */
+	struct record_stream *record; /* if given */
 	unsigned int channels;
 	unsigned int rate;
+	int16_t gain; /* when mixed, see mixer.h */
+	OrtpEvQueue *events; /* RTCP, if given */
+	struct adapt_peer *adapt;
+	struct stats_peer *stats; /* if given */
+	struct stamp_rx stamp; /* see stamp.h */
+	struct rx_stream stream;
 };
 
+int rx_socket(const struct rx_args *rx);
+void receive_rx(struct rx_args *rx, uint32_t ts);
+void drain_rx(struct rx_args *rx, uint32_t ts);
+void publish_rx(struct rx_args *rx);
 void *run_rx(struct rx_args *args);
 
-#endif
\ No newline at end of file
+#endif
@@ -17,14 +17,30 @@
  *
  */
 
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np */
+
+#include <errno.h>
 #include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "sched.h"
 
 #define REALTIME_PRIORITY 80
 
+/* Stack of each thread we start; all of it is locked in memory */
+
+#define STACK_SIZE (512 * 1024)
+
+/* Stack of the calling thread to fault in up front */
+
+#define PREFAULT_STACK (256 * 1024)
+
+#define ISOLATED "/sys/devices/system/cpu/isolated"
+
 int go_realtime(void)
 {
 	int max_pri;
@@ -78,3 +94,218 @@ int go_daemon(const char *pid_file)
 
 	return 0;
 }
+
+void sched_role_init(struct sched_role *role, const char *name)
+{
+	role->name = name;
+	role->priority = REALTIME_PRIORITY;
+	role->nr_cpus = 0;
+}
+
+/*
+ * Parse a list of CPUs in the kernel's format, eg. "0,2-4"
+ */
+
+static int parse_cpus(struct sched_role *role, const char *list)
+{
+	const char *s = list;
+
+	role->nr_cpus = 0;
+
+	while (*s != '\0' && *s != '\n') {
+		char *end;
+		unsigned long first, last;
+
+		first = last = strtoul(s, &end, 10);
+		if (end == s)
+			goto bad;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtoul(s, &end, 10);
+			if (end == s || last < first)
+				goto bad;
+		}
+
+		for (; first <= last; first++) {
+			if (first >= CPU_SETSIZE || role->nr_cpus == SCHED_MAX_CPUS)
+				goto bad;
+			role->cpu[role->nr_cpus++] = first;
+		}
+
+		s = end;
+		if (*s == ',')
+			s++;
+	}
+
+	if (role->nr_cpus == 0)
+		goto bad;
+
+	return 0;
+
+bad:
+	fprintf(stderr, "Bad CPU list '%s'\n", list);
+	return -1;
+}
+
+/*
+ * The CPUs kept from the scheduler with isolcpus=
+ */
+
+static int parse_isolated(struct sched_role *role)
+{
+	FILE *f;
+	char list[1024];
+
+	f = fopen(ISOLATED, "r");
+	if (f == NULL) {
+		perror(ISOLATED);
+		return -1;
+	}
+
+	if (fgets(list, sizeof list, f) == NULL || list[0] == '\n') {
+		fprintf(stderr, "No CPUs are isolated\n");
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	return parse_cpus(role, list);
+}
+
+/*
+ * Set up one of the given roles from "<role>[=<cpus>][@<priority>]",
+ * where <cpus> may be "isolated"
+ */
+
+int sched_role_parse(struct sched_role *roles, unsigned int nr_roles,
+		const char *arg)
+{
+	char *spec, *cpus, *priority;
+	struct sched_role *role = NULL;
+	unsigned int n;
+	int r = -1;
+
+	spec = strdup(arg);
+	if (spec == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	priority = strchr(spec, '@');
+	if (priority)
+		*priority++ = '\0';
+	cpus = strchr(spec, '=');
+	if (cpus)
+		*cpus++ = '\0';
+
+	for (n = 0; n < nr_roles; n++) {
+		if (!strcmp(roles[n].name, spec))
+			role = &roles[n];
+	}
+	if (role == NULL) {
+		fprintf(stderr, "Unknown thread role '%s'\n", spec);
+		goto out;
+	}
+
+	if (cpus) {
+		if (!strcmp(cpus, "isolated")) {
+			if (parse_isolated(role) == -1)
+				goto out;
+		} else if (parse_cpus(role, cpus) == -1) {
+			goto out;
+		}
+	}
+
+	if (priority) {
+		role->priority = atoi(priority);
+		if (role->priority < 0 ||
+				role->priority > sched_get_priority_max(SCHED_FIFO))
+		{
+			fprintf(stderr, "Invalid priority %d (maximum %d)\n",
+					role->priority,
+					sched_get_priority_max(SCHED_FIFO));
+			goto out;
+		}
+	}
+
+	r = 0;
+out:
+	free(spec);
+	return r;
+}
+
+/*
+ * Start the n'th thread of a role. Without the privilege to run
+ * realtime, the thread runs as it would have before, with a warning
+ */
+
+int sched_thread(pthread_t *thread, const struct sched_role *role,
+		unsigned int n, void *(*fn)(void*), void *arg)
+{
+	pthread_attr_t attr;
+	int r;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_SIZE);
+
+	if (role->priority) {
+		struct sched_param sp = {
+			.sched_priority = role->priority
+		};
+
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &sp);
+	}
+
+	if (role->nr_cpus) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(role->cpu[n % role->nr_cpus], &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof cpus, &cpus);
+	}
+
+	r = pthread_create(thread, &attr, fn, arg);
+	if (r == EPERM && role->priority) {
+		fprintf(stderr, "Not permitted to run %s thread realtime\n",
+				role->name);
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		r = pthread_create(thread, &attr, fn, arg);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	if (r != 0) {
+		errno = r;
+		perror("pthread_create");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Keep every page we have, and will have, in memory, so that the
+ * audio path never waits on a page fault; including the stack of
+ * the calling thread, which only grows as it is touched. Must
+ * follow go_daemon(), as locks are not inherited across fork()
+ */
+
+int lock_memory(void)
+{
+	volatile char stack[PREFAULT_STACK];
+	size_t n;
+	long page;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		perror("mlockall");
+		return -1;
+	}
+
+	page = sysconf(_SC_PAGESIZE);
+	for (n = 0; n < sizeof stack; n += page)
+		stack[n] = 0;
+
+	return 0;
+}
@@ -20,7 +20,33 @@
 #ifndef MISC_H
 #define MISC_H
 
+#include <pthread.h>
+
+/*
+ * Scheduling of a role played by one or more threads: SCHED_FIFO at
+ * 'priority' (or not realtime, if 0), and pinned to the given CPUs
+ * (or any, if none). The threads of a role are dealt one CPU each,
+ * in turn.
+ */
+
+#define SCHED_MAX_CPUS 256
+
+struct sched_role {
+	const char *name;
+	int priority;
+	unsigned int nr_cpus;
+	unsigned short cpu[SCHED_MAX_CPUS];
+};
+
 int go_realtime(void);
 int go_daemon(const char *pid_file);
 
+void sched_role_init(struct sched_role *role, const char *name);
+int sched_role_parse(struct sched_role *roles, unsigned int nr_roles,
+		const char *arg);
+int sched_thread(pthread_t *thread, const struct sched_role *role,
+		unsigned int n, void *(*fn)(void*), void *arg);
+
+int lock_memory(void);
+
 #endif
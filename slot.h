@@ -0,0 +1,71 @@
+#ifndef SLOT_H
+#define SLOT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Peers which come and go while the audio threads run
+ *
+ * A slot is set up by the control thread while FREE, then handed to
+ * the audio thread which owns it as STARTING; that thread resets its
+ * own state for the slot and makes it ACTIVE, unless it has been
+ * marked REMOVING in the meantime. To take the slot back
+ * the control thread marks it REMOVING, and waits for the owner to
+ * stop using it and mark it REMOVED.
+ *
+ * The owner looks at the slot once per period, so handing over
+ * never blocks or allocates on the audio path.
+ */
+
+enum {
+	SLOT_FREE = 0,
+	SLOT_STARTING,
+	SLOT_ACTIVE,
+	SLOT_REMOVING,
+	SLOT_REMOVED
+};
+
+typedef atomic_int slot_t;
+
+static inline int slot_get(slot_t *s)
+{
+	return atomic_load_explicit(s, memory_order_acquire);
+}
+
+static inline void slot_set(slot_t *s, int state)
+{
+	atomic_store_explicit(s, state, memory_order_release);
+}
+
+/*
+ * Move the slot on only if it is still in state 'from', for where
+ * the other thread may have moved it meanwhile
+ */
+
+static inline bool slot_cas(slot_t *s, int from, int to)
+{
+	return atomic_compare_exchange_strong_explicit(s, &from, to,
+			memory_order_acq_rel, memory_order_acquire);
+}
+
+/*
+ * For the control thread; wait up to 'ms' for the owner to move
+ * the slot to the given state
+ */
+
+static inline bool slot_wait(slot_t *s, int state, unsigned int ms)
+{
+	const struct timespec tick = { .tv_nsec = 1000000 };
+
+	while (slot_get(s) != state) {
+		if (ms-- == 0)
+			return false;
+		nanosleep(&tick, NULL);
+	}
+
+	return true;
+}
+
+#endif
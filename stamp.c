@@ -0,0 +1,152 @@
+#include <string.h>
+
+#include "stamp.h"
+
+#define ID_SENT 1
+#define ID_ECHO 2
+#define ELEMENT 8 /* bytes of data in each */
+
+/* The clock offset is taken from the quickest round trip of this
+ * many, as NTP does, so that it is not thrown by queueing */
+
+#define OFFSET_WINDOW 256
+
+static inline uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * Write the extension, header and all, at 'p'; the echo is left out
+ * (as padding) until the host sent to has been heard
+ */
+
+void stamp_build(unsigned char *p, uint32_t sent_us, uint16_t capture_us,
+		uint16_t encode_us, const struct stamp_rx *echo)
+{
+	uint64_t e = echo ? atomic_load_explicit(&echo->echo,
+			memory_order_relaxed) : 0;
+
+	memset(p, 0, STAMP_BYTES);
+
+	p[0] = STAMP_PROFILE >> 8;
+	p[1] = STAMP_PROFILE & 0xff;
+	p[3] = (STAMP_BYTES - 4) / 4;
+
+	p[4] = ID_SENT << 4 | (ELEMENT - 1);
+	put32(p + 5, sent_us);
+	p[9] = capture_us >> 8;
+	p[10] = capture_us;
+	p[11] = encode_us >> 8;
+	p[12] = encode_us;
+
+	if (e != 0) {
+		p[13] = ID_ECHO << 4 | (ELEMENT - 1);
+		put32(p + 14, e >> 32);
+		put32(p + 18, sent_us - (uint32_t)e);
+	}
+}
+
+/*
+ * Find the elements in an extension (less its header); returns -1
+ * if there is no stamp
+ */
+
+int stamp_parse(uint16_t profile, const unsigned char *ext, size_t len,
+		struct stamp *s)
+{
+	size_t n = 0;
+	bool sent = false;
+
+	if (profile != STAMP_PROFILE)
+		return -1;
+
+	s->echoed = false;
+
+	while (n < len) {
+		unsigned int id = ext[n] >> 4, size = (ext[n] & 0x0f) + 1;
+
+		if (ext[n] == 0) { /* padding */
+			n++;
+			continue;
+		}
+		if (id == 15 || n + 1 + size > len)
+			break;
+
+		if (id == ID_SENT && size == ELEMENT) {
+			s->sent_us = get32(ext + n + 1);
+			s->capture_us = ext[n + 5] << 8 | ext[n + 6];
+			s->encode_us = ext[n + 7] << 8 | ext[n + 8];
+			sent = true;
+		} else if (id == ID_ECHO && size == ELEMENT) {
+			s->echo_us = get32(ext + n + 1);
+			s->hold_us = get32(ext + n + 5);
+			s->echoed = true;
+		}
+
+		n += 1 + size;
+	}
+
+	return sent ? 0 : -1;
+}
+
+/*
+ * Take the stamp of a packet which arrived at 'arrival' (ns, see
+ * rtp.h), and publish the sender's side of the path
+ */
+
+void stamp_received(struct stamp_rx *r, const struct stamp *s,
+		unsigned long arrival, struct stats_peer *st)
+{
+	uint32_t now_us = arrival / 1000;
+	int32_t d;
+
+	atomic_store_explicit(&r->echo, (uint64_t)s->sent_us << 32 | now_us,
+			memory_order_relaxed);
+
+	if (s->echoed) {
+		uint32_t rtt = now_us - s->echo_us - s->hold_us;
+
+		/* A round trip is only negative (huge) if something on
+		 * the way is wrong; skip it */
+
+		if ((int32_t)rtt >= 0 &&
+			(!r->synced || rtt <= r->min_rtt_us ||
+				++r->since_min >= OFFSET_WINDOW))
+		{
+			r->min_rtt_us = rtt;
+			r->since_min = 0;
+			r->offset_us = (int32_t)(now_us - s->sent_us) - rtt / 2;
+			r->synced = true;
+		}
+
+		if (st)
+			stats_set(&st->e2e_rtt_us, rtt);
+	}
+
+	if (!r->synced)
+		return;
+
+	d = (int32_t)(now_us - s->sent_us) - r->offset_us;
+	if (d < 0)
+		d = 0;
+	if (r->network_us == 0)
+		r->network_us = d;
+	else
+		r->network_us += (d - (int32_t)r->network_us) / 16;
+
+	if (st) {
+		stats_set(&st->e2e_capture_us, s->capture_us);
+		stats_set(&st->e2e_encode_us, s->encode_us);
+		stats_set(&st->e2e_network_us, r->network_us);
+		stats_set(&st->e2e_offset_us, (unsigned long)(long)r->offset_us);
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef STAMP_H
+#define STAMP_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+/*
+ * Mouth-to-ear latency
+ *
+ * Each packet is stamped, in an RTP header extension (RFC 8285, the
+ * one-byte form), with two elements:
+ *
+ *   1: when it was sent, by the sender's clock, and how long its
+ *      audio spent being captured and encoded
+ *
+ *   2: an echo of the send time of the last packet heard from the
+ *      host it is sent to, and how long ago that was heard
+ *
+ * From the echo, a receiver measures the round trip to the sender,
+ * and from the round trip the offset of the sender's clock from its
+ * own (taking the path to be the same length both ways), so the time
+ * every packet spent on the network. Adding the time it waits in the
+ * jitter buffer and the delay of the playback device gives the whole
+ * path from the sender's microphone to our ear.
+ *
+ * Times on the wire are microseconds, and wrap.
+ */
+
+#define STAMP_PROFILE 0xbede
+#define STAMP_BYTES 24 /* extension, as sent, including its header */
+
+struct stamp {
+	uint32_t sent_us;
+	uint16_t capture_us, encode_us;
+
+	bool echoed;
+	uint32_t echo_us, hold_us;
+};
+
+/*
+ * A receiver's view of the path from one sender; written by the
+ * thread receiving, except 'echo' which is read by the sender
+ */
+
+struct stamp_rx {
+	bool enabled;
+
+	/* The peer's send time and when we heard it, packed as
+	 * sent_us << 32 | arrival_us */
+
+	_Atomic uint64_t echo;
+
+	bool synced;
+	int32_t offset_us; /* of our clock ahead of the sender's */
+	uint32_t min_rtt_us;
+	unsigned int since_min;
+	uint32_t network_us; /* smoothed */
+};
+
+static inline uint32_t stamp_now(void)
+{
+	return stats_now() / 1000;
+}
+
+void stamp_build(unsigned char *p, uint32_t sent_us, uint16_t capture_us,
+		uint16_t encode_us, const struct stamp_rx *echo);
+int stamp_parse(uint16_t profile, const unsigned char *ext, size_t len,
+		struct stamp *s);
+
+void stamp_received(struct stamp_rx *r, const struct stamp *s,
+		unsigned long arrival, struct stats_peer *st);
+
+#endif
@@ -0,0 +1,213 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+static size_t segment_size(unsigned int nr_peers)
+{
+	return sizeof(struct stats) + nr_peers * sizeof(struct stats_peer);
+}
+
+/*
+ * Create the segment, shared under the given name (eg. "/trx") or,
+ * if there is none, private to the process
+ */
+
+struct stats* stats_new(const char *name, unsigned int nr_peers)
+{
+	int fd = -1, flags = MAP_SHARED | MAP_ANONYMOUS;
+	size_t size = segment_size(nr_peers);
+	struct stats *s;
+
+	if (name) {
+		fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			perror("shm_open");
+			return NULL;
+		}
+		if (ftruncate(fd, size) == -1) {
+			perror("ftruncate");
+			close(fd);
+			return NULL;
+		}
+		flags = MAP_SHARED;
+	}
+
+	s = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (fd != -1)
+		close(fd);
+	if (s == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	/* Zero from the kernel; readers check the magic last */
+
+	s->version = STATS_VERSION;
+	s->nr_peers = nr_peers;
+	s->size = size;
+	atomic_thread_fence(memory_order_release);
+	s->magic = STATS_MAGIC;
+
+	return s;
+}
+
+void stats_free(struct stats *s, const char *name)
+{
+	munmap(s, s->size);
+	if (name)
+		shm_unlink(name);
+}
+
+/*
+ * Map another process's segment, read-only
+ */
+
+struct stats* stats_open(const char *name)
+{
+	int fd;
+	struct stat st;
+	struct stats *s;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		perror("shm_open");
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		close(fd);
+		return NULL;
+	}
+	if ((size_t)st.st_size < sizeof(struct stats)) {
+		fprintf(stderr, "%s: Not a statistics segment\n", name);
+		close(fd);
+		return NULL;
+	}
+
+	s = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	if (s->magic != STATS_MAGIC || s->version != STATS_VERSION ||
+		segment_size(s->nr_peers) > (size_t)st.st_size)
+	{
+		fprintf(stderr, "%s: Not a statistics segment, or wrong version\n",
+				name);
+		munmap(s, st.st_size);
+		return NULL;
+	}
+
+	return s;
+}
+
+static void dump_hist(FILE *f, const char *key, const struct stats_hist *h,
+		const char *sep)
+{
+	unsigned int n, last = 0;
+
+	/* Leave off the empty buckets at the top */
+
+	for (n = 0; n < STATS_BUCKETS; n++) {
+		if (stats_get(&h->bucket[n]))
+			last = n + 1;
+	}
+
+	fprintf(f, "\"%s\": [", key);
+	for (n = 0; n < last; n++)
+		fprintf(f, "%s%lu", n ? ", " : "", stats_get(&h->bucket[n]));
+	fprintf(f, "]%s", sep);
+}
+
+/*
+ * Print the segment as JSON; one object per peer, and one for the
+ * sender
+ */
+
+int stats_dump(const struct stats *s, FILE *f)
+{
+	unsigned int i;
+	const struct stats_tx *tx = &s->tx;
+
+	fprintf(f, "{\n");
+
+	for (i = 0; i < s->nr_peers; i++) {
+		const struct stats_peer *p = &s->peer[i];
+
+		if (!stats_get(&p->active))
+			continue;
+		fprintf(f, "  \"%u@%u#%s:%u\": {\n", p->ssrc, p->rx_port,
+				p->tx_addr, p->tx_port);
+		fprintf(f, "    \"round-trip\": %f,\n",
+				stats_get(&p->round_trip_us) / 1000.0);
+		fprintf(f, "    \"cum-loss\": %lu,\n", stats_get(&p->cum_loss));
+		fprintf(f, "    \"recv-bandwidth\": %lu,\n",
+				stats_get(&p->recv_bandwidth));
+		fprintf(f, "    \"sent\": %lu,\n", stats_get(&p->sent));
+		fprintf(f, "    \"send-failed\": %lu,\n",
+				stats_get(&p->send_failed));
+		fprintf(f, "    \"jitter\": [%lu, %lu, %lu],\n",
+				stats_get(&p->jitter), stats_get(&p->max_jitter),
+				stats_get(&p->target_ms));
+		fprintf(f, "    \"jitter-buffer\": {\"depth\": %lu, "
+				"\"received\": %lu, \"played\": %lu, "
+				"\"lost\": %lu, \"fec\": %lu, \"late\": %lu, "
+				"\"early\": %lu, \"duplicate\": %lu, "
+				"\"underrun\": %lu, \"dropped\": %lu},\n",
+				stats_get(&p->depth_ms), stats_get(&p->received),
+				stats_get(&p->played), stats_get(&p->lost),
+				stats_get(&p->fec), stats_get(&p->late),
+				stats_get(&p->early), stats_get(&p->duplicate),
+				stats_get(&p->underrun), stats_get(&p->dropped));
+		fprintf(f, "    \"periods\": %lu,\n", stats_get(&p->periods));
+		fprintf(f, "    \"concealed\": %lu,\n", stats_get(&p->concealed));
+		fprintf(f, "    \"decode-errors\": %lu,\n",
+				stats_get(&p->decode_errors));
+		fprintf(f, "    \"xruns\": %lu,\n", stats_get(&p->xruns));
+		fprintf(f, "    \"drift-ppm\": %ld,\n",
+				(long)stats_get(&p->drift_ppm));
+		fprintf(f, "    \"queue-full\": %lu,\n", stats_get(&p->queue_full));
+		fprintf(f, "    \"latency-us\": {\"capture\": %lu, "
+				"\"encode\": %lu, \"network\": %lu, "
+				"\"jitter-buffer\": %lu, \"playback\": %lu, "
+				"\"total\": %lu, \"round-trip\": %lu, "
+				"\"clock-offset\": %ld},\n",
+				stats_get(&p->e2e_capture_us),
+				stats_get(&p->e2e_encode_us),
+				stats_get(&p->e2e_network_us),
+				stats_get(&p->e2e_jitter_us),
+				stats_get(&p->e2e_playback_us),
+				stats_get(&p->e2e_total_us),
+				stats_get(&p->e2e_rtt_us),
+				(long)stats_get(&p->e2e_offset_us));
+		fprintf(f, "    ");
+		dump_hist(f, "net-ns", &p->net_ns, ",\n    ");
+		dump_hist(f, "queue-ns", &p->queue_ns, ",\n    ");
+		dump_hist(f, "decode-ns", &p->decode_ns, ",\n    ");
+		dump_hist(f, "depth-ms", &p->depth_ms_hist, "\n");
+		fprintf(f, "  },\n");
+	}
+
+	fprintf(f, "  \"tx\": {\n");
+	fprintf(f, "    \"frames\": %lu,\n", stats_get(&tx->frames));
+	fprintf(f, "    \"xruns\": %lu,\n", stats_get(&tx->xruns));
+	fprintf(f, "    \"kbps\": %lu,\n", stats_get(&tx->kbps));
+	fprintf(f, "    \"playback-xruns\": %lu,\n",
+			stats_get(&s->playback_xruns));
+	fprintf(f, "    ");
+	dump_hist(f, "encode-ns", &tx->encode_ns, ",\n    ");
+	dump_hist(f, "send-ns", &tx->send_ns, "\n");
+	fprintf(f, "  }\n");
+
+	fprintf(f, "}\n");
+
+	return fflush(f);
+}
@@ -0,0 +1,125 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Statistics segment
+ *
+ * Counters, gauges and histograms for every peer, in memory which
+ * can be shared with another process (see trxstat). Each value has a
+ * single writer, the thread which owns it, which updates it with a
+ * plain load and store; readers may look at any time without taking
+ * a lock or making a syscall on the audio path.
+ */
+
+#define STATS_MAGIC 0x74727873 /* "trxs" */
+#define STATS_VERSION 6
+
+/* Histogram buckets are powers of two: bucket 0 counts the value 0,
+ * bucket n counts values from 2^(n-1) to 2^n - 1 */
+
+#define STATS_BUCKETS 32
+
+typedef atomic_ulong stats_counter;
+
+struct stats_hist {
+	stats_counter bucket[STATS_BUCKETS];
+};
+
+struct stats_peer {
+	uint32_t ssrc;
+	uint16_t rx_port, tx_port;
+	char tx_addr[64];
+	stats_counter active; /* hosts may come and go, see slot.h */
+
+	/* Jitter buffer, see jbuf.h */
+
+	stats_counter received, played, lost, fec, late, early,
+		duplicate, underrun, dropped,
+		depth_ms, target_ms;
+
+	/* oRTP's view of the session, refreshed about once a second */
+
+	stats_counter round_trip_us, cum_loss, recv_bandwidth,
+		jitter, max_jitter;
+
+	stats_counter periods, concealed, decode_errors, xruns;
+	stats_counter drift_ppm; /* signed, see drift.h */
+	stats_counter sent, send_failed;
+
+	/* Packets between the network and playback stages, see rx_net.h */
+
+	stats_counter queue_full;
+	struct stats_hist net_ns, queue_ns;
+
+	/* Mouth-to-ear latency, see stamp.h; offset is signed */
+
+	stats_counter e2e_capture_us, e2e_encode_us, e2e_network_us,
+		e2e_jitter_us, e2e_playback_us, e2e_total_us,
+		e2e_rtt_us, e2e_offset_us;
+
+	struct stats_hist decode_ns, depth_ms_hist;
+};
+
+struct stats_tx {
+	stats_counter frames, xruns, kbps;
+	struct stats_hist encode_ns, send_ns;
+};
+
+struct stats {
+	uint32_t magic, version, nr_peers, size;
+	stats_counter playback_xruns; /* of the mixed device */
+	struct stats_tx tx;
+	struct stats_peer peer[];
+};
+
+struct stats* stats_new(const char *name, unsigned int nr_peers);
+void stats_free(struct stats *s, const char *name);
+
+struct stats* stats_open(const char *name);
+int stats_dump(const struct stats *s, FILE *f);
+
+static inline unsigned long stats_get(const stats_counter *c)
+{
+	return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static inline void stats_set(stats_counter *c, unsigned long v)
+{
+	atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
+/* Only for use by the counter's own thread */
+
+static inline void stats_add(stats_counter *c, unsigned long n)
+{
+	stats_set(c, stats_get(c) + n);
+}
+
+static inline void stats_hist_add(struct stats_hist *h, unsigned long v)
+{
+	unsigned int n;
+
+	n = v ? sizeof(v) * 8 - __builtin_clzl(v) : 0;
+	if (n >= STATS_BUCKETS)
+		n = STATS_BUCKETS - 1;
+
+	stats_add(&h->bucket[n], 1);
+}
+
+/* Monotonic time for measuring durations; read through the vDSO,
+ * so not a syscall */
+
+static inline unsigned long stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#endif
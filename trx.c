@@ -17,12 +17,15 @@
  *
  */
 
+#include <limits.h>
 #include <stdbool.h>
 #include <netdb.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <alsa/asoundlib.h>
-#include <opus/opus.h>
+#include <opus/opus_multistream.h>
 #include <ortp/ortp.h>
 #include <pthread.h>
 #include <sys/socket.h>
@@ -30,10 +33,23 @@
 //#include <regex.h> // or #include <pcre2.h>?
 
 #include "defaults.h"
+#include "adapt.h"
+#include "backend.h"
+#include "bridge.h"
+#include "codec.h"
+#include "control.h"
 #include "device.h"
+#include "fanout.h"
+#include "format.h"
 #include "notice.h"
+#include "recorder.h"
+#include "relay.h"
+#include "rtp.h"
 #include "sched.h"
+#include "stats.h"
+#include "mixer.h"
 #include "rx_alsalib.h"
+#include "rx_looplib.h"
 #include "rx_runlib.h"
 #include "tx_alsalib.h"
 #include "tx_runlib.h"
@@ -47,12 +63,16 @@ static void usage(FILE *fd)
 							"Real-time audio transmitter over IP\n");
 
 	fprintf(fd, "\nAudio device (ALSA) parameters:\n");
-	fprintf(fd, "  -C <dev>    Capture device name (default '%s')\n",
+	fprintf(fd, "  -C <dev>    Capture device name, or file:<path> or null (default '%s')\n",
 					DEFAULT_DEVICE);
-	fprintf(fd, "  -P <dev>    Playback device name (default '%s')\n",
+	fprintf(fd, "  -P <dev>    Playback device name, or file:<path> or null (default '%s')\n",
 					DEFAULT_DEVICE);
 	fprintf(fd, "  -m <ms>     Buffer time (default %d milliseconds)\n",
 					DEFAULT_BUFFER);
+	fprintf(fd, "  -M          Access the device buffer directly (memory-mapped)\n");
+	fprintf(fd, "  -F <fmt>    Sample format: s16, s24, s32, float or auto (default %s)\n",
+					DEFAULT_FORMAT);
+	fprintf(fd, "  -I          Open the playback device once per host, instead of mixing\n");
 
 	fprintf(fd, "\nNetwork parameters:\n");
 	fprintf(fd, "  -n <n>      Number of host properties passed in\n");
@@ -64,28 +84,68 @@ static void usage(FILE *fd)
 					DEFAULT_PORT);
 	fprintf(fd, "  -j <ms>     Jitter buffer (default %d milliseconds)\n",
 					DEFAULT_JITTER);
+	fprintf(fd, "  -d <ppm>    Correct for clock drift of up to <ppm> (default %d, 0 for none)\n",
+					DEFAULT_DRIFT);
 	fprintf(fd, "  -S <ssrc>   SSRC (default 0x%x)\n",
 					DEFAULT_SSRC);
-	fprintf(fd, "  -x <data>   Extended Connections (comma seperated ssrc@localport!remoteip:remoteport)\n");
+	fprintf(fd, "  -T <prefix> Record packet arrivals to <prefix>.<port>, see jbsim; a\n"
+					"              diagnostic, written on the audio path, which may upset timing\n");
+	fprintf(fd, "  -W <prefix> Record each host, as received, to <prefix>.<port>.opus\n");
+	fprintf(fd, "  -x <data>   Extended Connections (comma seperated ssrc@localport!remoteip:remoteport[/gain[/jitter]])\n");
+	fprintf(fd, "  -K <path>   Control socket, to add and remove hosts while running\n");
+	fprintf(fd, "  -N <n>      Room for hosts added with -K (default %d)\n",
+					DEFAULT_SLOTS);
+	fprintf(fd, "  -X          Relay: forward each host's packets to all the others, with no audio\n");
+	fprintf(fd, "  -B          Bridge: send each host a mix of all the others, with no audio\n");
+	fprintf(fd, "  -U          Receive with the built-in RTP, in place of oRTP\n");
+	fprintf(fd, "  -E          Stamp packets to measure latency end to end (hosts need -E too)\n");
+	fprintf(fd, "  -O          Send to all hosts from one unbound socket, in one system call;\n"
+		"              by default each host is sent to from its receive port (symmetric\n"
+		"              RTP), with a system call per host\n");
 	fprintf(fd, "\nExtended connections (-x) cannot be combined with explicit settings (-h, -p -s -S)\n");
+	fprintf(fd, "The optional gain of each connection is in dB, applied when mixing, and\n"
+							"the optional jitter buffer is in milliseconds (default -j)\n");
+	fprintf(fd, "The control socket takes 'add <connection>', 'remove <localport>' and 'list';\n"
+							"it cannot be used with -I\n");
 
 	fprintf(fd, "\nEncoding parameters:\n");
 	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
 					DEFAULT_RATE);
 	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
 					DEFAULT_CHANNELS);
+	fprintf(fd, "  -L <layout> Channels over Opus streams: pairs, mono or\n"
+							"              <streams>:<coupled>:<mapping>,... (default pairs)\n");
 	fprintf(fd, "  -f <n>      Frame size (default %d samples, see below)\n",
 					DEFAULT_FRAME);
 	fprintf(fd, "  -b <kbps>   Bitrate (approx., default %d)\n",
 					DEFAULT_BITRATE);
+	fprintf(fd, "  -a <kbps>   Lower the bitrate, down to <kbps>, when hosts report loss\n");
+	fprintf(fd, "  -l <%%>      Expected packet loss, adds in-band FEC if set (default %d)\n",
+					DEFAULT_LOSS);
 
 	fprintf(fd, "\nProgram parameters:\n");
+	fprintf(fd, "  -w <n>      Receive (or bridge) threads (default one per CPU, up to one per host)\n");
+	fprintf(fd, "  -A <role>[=<cpus>][@<prio>]\n"
+							"              Pin the tx, rx, mix or relay threads to CPUs (eg. 2,4-5 or 'isolated'),\n"
+							"              at a realtime priority (default 80, 0 for none)\n");
 	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
 					DEFAULT_VERBOSE);
 	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
+	fprintf(fd, "  -R <name>   Publish statistics in shared memory, see trxstat\n");
 
 	fprintf(fd, "\nAllowed frame sizes (-f) are defined by the Opus codec. For example,\n"
 							"at 48000Hz the permitted values are 120, 240, 480 or 960.\n");
+	fprintf(fd, "\nIn-band FEC (-l) needs frames of 10ms or more (480 at 48000Hz) and a\n"
+							"modest bitrate; the receiver recovers a lost frame from the one after it.\n");
+	fprintf(fd, "\nAs a relay (-X), host n (from 0, in the order given with -x) is heard on its\n"
+							"localport, and host m's stream is sent to it at remoteport + 2m (the port after\n"
+							"each is for RTCP). Hosts of a relay list each other as connections to the\n"
+							"relay's port for them, which they then send to only once.\n");
+	fprintf(fd, "\nIn place of a device, audio can be read from a WAV or raw file (in a loop),\n"
+							"or be silence (null), and the mix written to a raw file or thrown away (null),\n"
+							"at the pace of a device; not with -I.\n");
+	fprintf(fd, "\nAs a bridge (-B), hosts connect as they would to any other, and must use its\n"
+							"frame size (-f); the work is shared by -w threads of the mix role (-A).\n");
 }
 
 struct connection_info
@@ -94,9 +154,50 @@ struct connection_info
 	unsigned int rx_port;
 	char *tx_addr;
 	unsigned int tx_port;
+	int16_t gain;
+	unsigned int jitter;
 	RtpSession *session;
 };
 
+/*
+ * Parse one connection, "<ssrc>@<localport>#<remoteip>:<remoteport>"
+ * with optional "/<gain>[/<jitter>]"; the string is modified
+ */
+
+static int parse_connection(char *spec, struct connection_info *c)
+{
+	char *rest = NULL, *token;
+
+	token = strtok_r(spec, "@", &rest);
+	if (token == NULL)
+		return -1;
+	c->ssrc = atoi(token);
+
+	token = strtok_r(NULL, "#", &rest);
+	if (token == NULL)
+		return -1;
+	c->rx_port = atoi(token);
+
+	token = strtok_r(NULL, ":", &rest);
+	if (token == NULL || rest == NULL || *rest == '\0')
+		return -1;
+	c->tx_addr = strdup(token);
+	c->tx_port = atoi(rest);
+
+	c->gain = MIX_UNITY;
+	c->jitter = 0;
+	token = strchr(rest, '/');
+	if (token)
+	{
+		c->gain = mix_gain(atof(token + 1));
+		token = strchr(token + 1, '/');
+		if (token)
+			c->jitter = atoi(token + 1);
+	}
+
+	return 0;
+}
+
 struct connection_info *parse_extended_connections(const char *arg, int *nr_hosts)
 {
 	struct connection_info *connections;
@@ -115,26 +216,17 @@ struct connection_info *parse_extended_connections(const char *arg, int *nr_host
 	char *host_connection = strtok_r(extended_connections, ",", &rest_host_connection);
 	for (i = 0; i < *nr_hosts; i++)
 	{
-		char *rest_host_token_split = NULL;
 		printf("host: '%s'\n", host_connection);
-		// this code expects the following format "<ssrc>@<localport>#<remoteip>:<remoteport>"
-		char *host_token_split = strtok_r(host_connection, "@", &rest_host_token_split);
-		printf("%s, %s\n", host_token_split, rest_host_token_split);
-		connections[i].ssrc = atoi(host_token_split);
-
-		host_token_split = strtok_r(NULL, "#", &rest_host_token_split);
-		printf("%s, %s\n", host_token_split, rest_host_token_split);
-		connections[i].rx_port = atoi(host_token_split);
-
-		host_token_split = strtok_r(NULL, ":", &rest_host_token_split);
-		printf("%s, %s\n", host_token_split, rest_host_token_split);
-		connections[i].tx_addr = strdup(host_token_split);
-
-		connections[i].tx_port = atoi(rest_host_token_split);
+		if (host_connection == NULL || parse_connection(host_connection, &connections[i]) == -1)
+		{
+			fprintf(stderr, "Bad connection '%s'\n", host_connection ? host_connection : "");
+			exit(EXIT_FAILURE);
+		}
 
-		printf("decoded host connection : ssrc:%u, rx_port:%u, tx_addr:%s, tx_port:%u\n",
+		printf("decoded host connection : ssrc:%u, rx_port:%u, tx_addr:%s, tx_port:%u, gain:%d, jitter:%u\n",
 					 connections[i].ssrc, connections[i].rx_port,
-					 connections[i].tx_addr, connections[i].tx_port);
+					 connections[i].tx_addr, connections[i].tx_port,
+					 connections[i].gain, connections[i].jitter);
 		host_connection = strtok_r(NULL, ",", &rest_host_connection);
 	}
 	fflush(stdout);
@@ -143,75 +235,554 @@ struct connection_info *parse_extended_connections(const char *arg, int *nr_host
 	return connections;
 }
 
+/* Threads in the audio path, see sched.h */
+
+enum
+{
+	ROLE_TX, /* capture and encode */
+	ROLE_RX, /* receive and decode, each to its own device */
+	ROLE_MIX, /* receive, decode and mix */
+	ROLE_RELAY, /* forward, see relay.h */
+	NR_ROLES
+};
+
 int nr_hosts = 1;
 struct connection_info *connections = NULL;
-static void report_rtcp_info(int signal)
+struct rx_args *rx = NULL;
+struct stats *stats = NULL;
+
+/*
+ * Print the statistics on SIGUSR1. The signal is blocked everywhere
+ * else, and taken here with sigwait() so that printing is not done
+ * from a signal handler, or on an audio thread
+ */
+
+static void *report_stats(void *arg)
+{
+	const sigset_t *set = arg;
+
+	for (;;)
+	{
+		int sig;
+
+		if (sigwait(set, &sig) != 0)
+			return NULL;
+		stats_dump(stats, stdout);
+	}
+}
+
+/*
+ * Hosts occupy slots, which are set up in full at startup; a host
+ * added at runtime only needs its session (see slot.h)
+ */
+
+struct hosts
+{
+	unsigned int nr_slots;
+	unsigned int jitter;
+	const char *trace;
+	const char *record; /* prefix, if recording */
+	bool native; /* receive with rtp.h, in place of oRTP */
+	bool one_socket; /* send from the fanout's own, not each host's */
+	struct recorder *recorder;
+	struct fanout *fanout;
+	struct adapt *adapt;
+	struct rx_loop *loop; /* if hosts come and go */
+};
+
+static int start_host(struct hosts *h, unsigned int i, bool running)
+{
+	struct connection_info *c = &connections[i];
+	struct stats_peer *st = &stats->peer[i];
+
+	if (c->jitter == 0)
+		c->jitter = h->jitter;
+	jbuf_init(rx[i].jb, c->jitter, DEFAULT_JITTER_MAX(c->jitter), DEFAULT_JITTER_DECAY);
+	opus_multistream_decoder_ctl(rx[i].decoder, OPUS_RESET_STATE);
+
+	if (h->trace)
+	{
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof path, "%s.%u", h->trace, c->rx_port);
+		rx[i].trace = fopen(path, "w");
+		if (rx[i].trace == NULL)
+		{
+			perror("fopen");
+			return -1;
+		}
+	}
+
+	if (h->record)
+	{
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof path, "%s.%u.opus", h->record, c->rx_port);
+		rx[i].record = record_open(h->recorder, path);
+		if (rx[i].record == NULL)
+			goto fail;
+	}
+
+	if (h->native)
+	{
+		rx[i].rtp = rtp_new("0.0.0.0", c->rx_port);
+		if (rx[i].rtp == NULL)
+			goto fail;
+		if (rtp_reports(rx[i].rtp, c->tx_addr, c->tx_port, c->ssrc) == -1)
+			goto fail;
+	}
+	else
+	{
+		c->session = create_rtp_send_recv(c->tx_addr, c->tx_port,
+																			"0.0.0.0", c->rx_port, c->ssrc);
+		if (c->session == NULL)
+			goto fail;
+		rx[i].session = c->session;
+	}
+	rx[i].gain = c->gain;
+
+	memset(st, 0, sizeof *st);
+	st->ssrc = c->ssrc;
+	st->rx_port = c->rx_port;
+	st->tx_port = c->tx_port;
+	snprintf(st->tx_addr, sizeof st->tx_addr, "%s", c->tx_addr);
+	rx[i].stats = st;
+
+	if (h->adapt)
+	{
+		if (rx[i].session)
+		{
+			rx[i].events = ortp_ev_queue_new();
+			rtp_session_register_event_queue(rx[i].session, rx[i].events);
+		}
+		rx[i].adapt = &h->adapt->peer[i];
+	}
+
+	if (h->fanout->stamped)
+	{
+		memset(&rx[i].stamp, 0, sizeof rx[i].stamp);
+		rx[i].stamp.enabled = true;
+		h->fanout->peer[i].echo = &rx[i].stamp;
+	}
+
+	if (fanout_add(h->fanout, i, c->tx_addr, c->tx_port, c->ssrc,
+			h->one_socket ? -1 : rx_socket(&rx[i])) == -1)
+	{
+		goto fail;
+	}
+
+	/* Once running, the worker must take over the slot; otherwise
+	 * it is found active when the worker starts. The slot is handed
+	 * over before the socket is watched, so that the worker can take
+	 * it on the first packet (see rx_looplib.c) */
+
+	if (running)
+	{
+		slot_set(&rx[i].state, SLOT_STARTING);
+		if (rx_loop_watch(h->loop, i) == -1)
+		{
+			slot_set(&rx[i].state, SLOT_REMOVING);
+			if (!slot_wait(&rx[i].state, SLOT_REMOVED, 1000) ||
+					fanout_remove(h->fanout, i) == -1)
+			{
+				return -1; /* still in use; remove it again later */
+			}
+			slot_set(&rx[i].state, SLOT_FREE);
+			goto fail;
+		}
+	}
+	else
+	{
+		slot_set(&rx[i].state, SLOT_ACTIVE);
+	}
+	stats_set(&st->active, 1);
+
+	return 0;
+
+fail:
+	if (rx[i].events)
+	{
+		rtp_session_unregister_event_queue(rx[i].session, rx[i].events);
+		ortp_ev_queue_destroy(rx[i].events);
+		rx[i].events = NULL;
+	}
+	if (c->session)
+	{
+		rtp_session_destroy(c->session);
+		c->session = rx[i].session = NULL;
+	}
+	if (rx[i].rtp)
+	{
+		rtp_free(rx[i].rtp);
+		rx[i].rtp = NULL;
+	}
+	if (rx[i].trace)
+	{
+		fclose(rx[i].trace);
+		rx[i].trace = NULL;
+	}
+	if (rx[i].record)
+	{
+		record_close(rx[i].record);
+		rx[i].record = NULL;
+	}
+	return -1;
+}
+
+/*
+ * Take a host back from the worker and the sender, and close it; if
+ * either does not let go in time, the host is left half removed, to
+ * be removed again
+ */
+
+static int stop_host(struct hosts *h, unsigned int i)
+{
+	/* The socket is unwatched first, so that the worker is never
+	 * woken by a host it has given up */
+
+	switch (slot_get(&rx[i].state))
+	{
+	case SLOT_STARTING:
+	case SLOT_ACTIVE:
+		rx_loop_unwatch(h->loop, i);
+		slot_set(&rx[i].state, SLOT_REMOVING);
+		break;
+	}
+
+	if (!slot_wait(&rx[i].state, SLOT_REMOVED, 1000))
+		return -1;
+	if (fanout_remove(h->fanout, i) == -1)
+		return -1;
+	stats_set(&stats->peer[i].active, 0);
+
+	if (rx[i].events)
+	{
+		rtp_session_unregister_event_queue(rx[i].session, rx[i].events);
+		ortp_ev_queue_destroy(rx[i].events);
+		rx[i].events = NULL;
+	}
+	if (rx[i].session)
+		rtp_session_destroy(rx[i].session);
+	if (rx[i].rtp)
+		rtp_free(rx[i].rtp);
+	connections[i].session = rx[i].session = NULL;
+	rx[i].rtp = NULL;
+
+	if (rx[i].trace)
+	{
+		fclose(rx[i].trace);
+		rx[i].trace = NULL;
+	}
+	if (rx[i].record)
+	{
+		record_close(rx[i].record);
+		rx[i].record = NULL;
+	}
+
+	free(connections[i].tx_addr);
+	connections[i].tx_addr = NULL;
+
+	slot_set(&rx[i].state, SLOT_FREE);
+
+	return 0;
+}
+
+static int find_host(struct hosts *h, unsigned int rx_port)
+{
+	unsigned int i;
+
+	for (i = 0; i < h->nr_slots; i++)
+	{
+		if (slot_get(&rx[i].state) != SLOT_FREE && connections[i].rx_port == rx_port)
+			return i;
+	}
+
+	return -1;
+}
+
+static int cmd_add(void *arg, char *args, char *reply, size_t len)
+{
+	struct hosts *h = arg;
+	struct connection_info c = {0};
+	unsigned int i;
+
+	if (parse_connection(args, &c) == -1)
+	{
+		snprintf(reply, len, "expected ssrc@localport#remoteip:remoteport[/gain[/jitter]]");
+		free(c.tx_addr);
+		return -1;
+	}
+
+	if (find_host(h, c.rx_port) != -1)
+	{
+		snprintf(reply, len, "port %u is in use", c.rx_port);
+		free(c.tx_addr);
+		return -1;
+	}
+
+	for (i = 0; i < h->nr_slots; i++)
+	{
+		if (slot_get(&rx[i].state) == SLOT_FREE)
+			break;
+	}
+	if (i == h->nr_slots)
+	{
+		snprintf(reply, len, "no room for more hosts, see -N");
+		free(c.tx_addr);
+		return -1;
+	}
+
+	connections[i] = c;
+	if (start_host(h, i, true) == -1)
+	{
+		snprintf(reply, len, "could not set up the host, see log");
+		free(connections[i].tx_addr);
+		connections[i].tx_addr = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int cmd_remove(void *arg, char *args, char *reply, size_t len)
 {
+	struct hosts *h = arg;
 	int i;
-	fprintf(stdout, "{\n");
+
+	i = find_host(h, atoi(args));
+	if (i == -1)
+	{
+		snprintf(reply, len, "no host on that port");
+		return -1;
+	}
+
+	if (stop_host(h, i) == -1)
+	{
+		snprintf(reply, len, "receiver did not let go of the host");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int cmd_list(void *arg, char *args, char *reply, size_t len)
+{
+	struct hosts *h = arg;
+	unsigned int i;
+	size_t z = 0;
+
+	for (i = 0; i < h->nr_slots && z < len; i++)
+	{
+		const struct connection_info *c = &connections[i];
+
+		if (slot_get(&rx[i].state) != SLOT_ACTIVE)
+			continue;
+		z += snprintf(reply + z, len - z, "%u@%u#%s:%u\n",
+									c->ssrc, c->rx_port, c->tx_addr, c->tx_port);
+	}
+
+	return 0;
+}
+
+static const struct control_command commands[] = {
+		{"add", cmd_add},
+		{"remove", cmd_remove},
+		{"list", cmd_list},
+		{NULL, NULL}};
+
+/*
+ * As a bridge, send each host a mix of all the others (see bridge.h),
+ * the first of the workers keeping time
+ */
+
+static int run_bridge_mode(struct hosts *h, struct bridge *bridge,
+													 unsigned int nr_workers, const struct sched_role *role,
+													 const char *pid, sigset_t *report_signals)
+{
+	pthread_t thread, report_thread;
+	void *r;
+
+	if (pid)
+		go_daemon(pid);
+
+	if (h->recorder && recorder_start(h->recorder) == -1)
+		return -1;
+	pthread_create(&report_thread, NULL, report_stats, report_signals);
+
+	lock_memory();
+
+	if (bridge_start(bridge, role, nr_workers - 1) == -1)
+		return -1;
+	if (sched_thread(&thread, role, 0, (void *(*)(void *))run_bridge, bridge) == -1)
+		return -1;
+	pthread_join(thread, &r);
+
+	return r == NULL ? 0 : -1;
+}
+
+/*
+ * As a relay, pass on what each host sends to all the others (see
+ * relay.h); there is no audio of our own
+ */
+
+static int run_relay_mode(const struct sched_role *role, const char *pid,
+													sigset_t *report_signals)
+{
+	struct relay *relay;
+	pthread_t thread, report_thread;
+	void *r;
+	int i;
+
+	relay = relay_new(nr_hosts);
+	if (relay == NULL)
+		return -1;
+
 	for (i = 0; i < nr_hosts; i++)
 	{
-		RtpSession *session = connections[i].session;
-		const struct jitter_stats *jitter = rtp_session_get_jitter_stats(session);
-		fprintf(stdout, "  \"%u@%u#%s:%u\": {\n", connections[i].ssrc, connections[i].rx_port,
-						connections[i].tx_addr, connections[i].tx_port);
-		fprintf(stdout, "    \"round-trip\": %f,\n", rtp_session_get_round_trip_propagation(session) * 1000);
-		fprintf(stdout, "    \"cum-loss\": %d,\n", rtp_session_get_cum_loss(session));
-		fprintf(stdout, "    \"recv-bandwidth\": %.0f,\n", rtp_session_get_recv_bandwidth(session));
-		fprintf(stdout, "    \"send-bandwidth\": %.0f,\n", rtp_session_compute_send_bandwidth(session));
-		fprintf(stdout, "    \"jitter\": [%d, %d, %f]\n", jitter->jitter, jitter->max_jitter, jitter->jitter_buffer_size_ms);
-		fprintf(stdout, "  }\n");
-	}
-	fprintf(stdout, "}\n");
-	fflush(stdout);
+		const struct connection_info *c = &connections[i];
+
+		if (relay_add(relay, i, c->rx_port, c->ssrc, c->tx_addr, c->tx_port,
+									&stats->peer[i]) == -1)
+			return -1;
+	}
+
+	if (pid)
+		go_daemon(pid);
+
+	pthread_create(&report_thread, NULL, report_stats, report_signals);
+
+	lock_memory();
+
+	if (sched_thread(&thread, role, 0, (void *(*)(void *))run_relay, relay) == -1)
+		return -1;
+	pthread_join(thread, &r);
+
+	relay_free(relay);
+
+	return r == NULL ? 0 : -1;
+}
+
+/*
+ * Once the audio threads are done, close every host, and finish the
+ * recordings (see recorder.h)
+ */
+
+static void close_hosts(struct hosts *h)
+{
+	unsigned int i;
+
+	for (i = 0; i < h->nr_slots; i++)
+	{
+		if (rx[i].snd && snd_pcm_close(rx[i].snd) < 0)
+			abort();
+
+		if (rx[i].events)
+		{
+			rtp_session_unregister_event_queue(rx[i].session, rx[i].events);
+			ortp_ev_queue_destroy(rx[i].events);
+		}
+		if (rx[i].session)
+			rtp_session_destroy(rx[i].session);
+		if (rx[i].rtp)
+			rtp_free(rx[i].rtp);
+
+		opus_multistream_decoder_destroy(rx[i].decoder);
+		rx_stream_clear(&rx[i].stream);
+		jbuf_free(rx[i].jb);
+
+		if (rx[i].trace)
+			fclose(rx[i].trace);
+
+		free(connections[i].tx_addr);
+	}
+
+	if (h->recorder)
+		recorder_free(h->recorder);
+
+	free(connections);
 }
 
 int main(int argc, char *argv[])
 {
-	int i, r, error;
+	int i, r;
 	struct tx_args tx;
-	struct rx_args *rx;
-	pthread_t tx_thread, *rx_threads;
+	struct codec_layout layout;
+	struct sched_role roles[NR_ROLES];
+	struct rx_loop *loops;
+	struct hosts hosts;
+	struct control control;
+	snd_pcm_t *mix_snd = NULL;
+	struct backend *capture_backend = NULL, *mix_backend = NULL;
+	pthread_t tx_thread, report_thread, control_thread, *rx_threads;
+	sigset_t report_signals;
+	unsigned int nr_workers, max_workers = 0;
 
 	/* command-line options */
 	const char *capture_device = DEFAULT_DEVICE,
 						 *playback_device = DEFAULT_DEVICE,
+						 *trace = NULL,
+						 *record = NULL,
+						 *stats_name = NULL,
+						 *control_path = NULL,
+						 *layout_name = NULL,
 						 *pid = NULL;
-	unsigned int buffer = DEFAULT_BUFFER,
+	snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	snd_pcm_format_t capture_format, playback_format;
+	unsigned int adapt_kbps = 0,
+							 buffer = DEFAULT_BUFFER,
 							 channels = DEFAULT_CHANNELS,
+							 drift = DEFAULT_DRIFT,
 							 frame = DEFAULT_FRAME,
 							 jitter = DEFAULT_JITTER,
 							 kbps = DEFAULT_BITRATE,
-							 rate = DEFAULT_RATE;
+							 loss = DEFAULT_LOSS,
+							 rate = DEFAULT_RATE,
+							 nr_slots = DEFAULT_SLOTS;
 	struct connection_info explicit_connection =
 			{
 					.ssrc = DEFAULT_SSRC,
 					.rx_port = DEFAULT_PORT,
 					.tx_addr = DEFAULT_ADDR,
 					.tx_port = DEFAULT_PORT,
+					.gain = MIX_UNITY,
 			};
 	bool using_extended_connections = false;
 	bool using_explicit_connection = false;
+	bool independent_playback = false;
+	bool relay = false;
+	bool bridge_mode = false;
+	bool native = false;
+	bool one_socket = false;
+	bool stamped = false;
 
-	struct sigaction action = {
-			.sa_handler = &report_rtcp_info};
+	format_parse(DEFAULT_FORMAT, &capture_format);
+	sched_role_init(&roles[ROLE_TX], "tx");
+	sched_role_init(&roles[ROLE_RX], "rx");
+	sched_role_init(&roles[ROLE_MIX], "mix");
+	sched_role_init(&roles[ROLE_RELAY], "relay");
 
 	for (;;)
 	{
 		int c;
 
-		c = getopt(argc, argv, "b:c:f:h:j:m:p:r:s:v:x:C:D:P:S:");
+		c = getopt(argc, argv, "a:b:c:d:f:h:j:l:m:p:r:s:v:w:x:A:BC:D:EF:IK:L:MN:OP:R:S:T:UW:X");
 		if (c == -1)
 			break;
 
 		switch (c)
 		{
+		case 'a':
+			adapt_kbps = atoi(optarg);
+			break;
 		case 'b':
 			kbps = atoi(optarg);
 			break;
 		case 'c':
 			channels = atoi(optarg);
 			break;
+		case 'd':
+			drift = atoi(optarg);
+			break;
 		case 'f':
 			frame = atol(optarg);
 			break;
@@ -222,9 +793,27 @@ int main(int argc, char *argv[])
 		case 'j':
 			jitter = atoi(optarg);
 			break;
+		case 'l':
+			loss = atoi(optarg);
+			break;
 		case 'm':
 			buffer = atoi(optarg);
 			break;
+		case 'L':
+			layout_name = optarg;
+			break;
+		case 'K':
+			control_path = optarg;
+			break;
+		case 'M':
+			access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+			break;
+		case 'N':
+			nr_slots = atoi(optarg);
+			break;
+		case 'O':
+			one_socket = true;
+			break;
 		case 'p':
 			explicit_connection.rx_port = atoi(optarg);
 			using_explicit_connection = true;
@@ -239,23 +828,64 @@ int main(int argc, char *argv[])
 		case 'v':
 			verbose = atoi(optarg);
 			break;
+		case 'w':
+			max_workers = atoi(optarg);
+			break;
 		case 'x':
 			connections = parse_extended_connections(optarg, &nr_hosts);
 			using_extended_connections = true;
 			break;
+		case 'A':
+			if (sched_role_parse(roles, NR_ROLES, optarg) == -1)
+			{
+				usage(stderr);
+				return -1;
+			}
+			break;
 		case 'C':
 			capture_device = optarg;
 			break;
 		case 'D':
 			pid = optarg;
 			break;
+		case 'F':
+			if (format_parse(optarg, &capture_format) == -1)
+			{
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'E':
+			stamped = true;
+			break;
+		case 'I':
+			independent_playback = true;
+			break;
+		case 'B':
+			bridge_mode = true;
+			break;
+		case 'X':
+			relay = true;
+			break;
 		case 'P':
 			playback_device = optarg;
 			break;
+		case 'R':
+			stats_name = optarg;
+			break;
 		case 'S':
 			explicit_connection.ssrc = atoi(optarg);
 			using_explicit_connection = true;
 			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'U':
+			native = true;
+			break;
+		case 'W':
+			record = optarg;
+			break;
 		default:
 			usage(stderr);
 			return -1;
@@ -268,27 +898,145 @@ int main(int argc, char *argv[])
 		usage(stderr);
 		return -1;
 	}
+	if (control_path && independent_playback)
+	{
+		// hosts can only come and go from the mix
+		usage(stderr);
+		return -1;
+	}
+	if ((relay || bridge_mode) && control_path)
+	{
+		// a relay's or bridge's hosts are fixed at startup
+		usage(stderr);
+		return -1;
+	}
+	if (relay && bridge_mode)
+	{
+		usage(stderr);
+		return -1;
+	}
+	if (independent_playback && backend_is(playback_device))
+	{
+		// a backend is a single sink, and takes the mix
+		usage(stderr);
+		return -1;
+	}
+	if (relay && stamped)
+	{
+		// a relay passes packets on, and has no latency of its own to stamp
+		usage(stderr);
+		return -1;
+	}
 	if (!using_extended_connections)
 	{
 		nr_hosts = 1;
+		explicit_connection.tx_addr = strdup(explicit_connection.tx_addr);
 		connections = &explicit_connection;
 	}
 
-	rx = calloc(nr_hosts, sizeof(struct rx_args));
-	rx_threads = calloc(nr_hosts, sizeof(pthread_t));
-	tx.nr_sessions = nr_hosts;
-	tx.sessions = calloc(nr_hosts, sizeof(RtpSession *));
+	/* Every host has a slot, with spares for hosts added later; all
+	 * are set up in full now, so no allocation is needed once running */
 
-	tx.encoder = opus_encoder_create(rate, channels, OPUS_APPLICATION_AUDIO,
-																	 &error);
-	if (tx.encoder == NULL)
+	if (!control_path || nr_slots < (unsigned int)nr_hosts)
+		nr_slots = nr_hosts;
 	{
-		fprintf(stderr, "opus_encoder_create: %s\n",
-						opus_strerror(error));
+		struct connection_info *given = connections;
+
+		connections = calloc(nr_slots, sizeof(struct connection_info));
+		memcpy(connections, given, nr_hosts * sizeof(struct connection_info));
+		if (using_extended_connections)
+			free(given);
+	}
+
+	/* Capture and playback may settle on different formats, but all
+	 * playback devices use the first one's */
+
+	playback_format = capture_format;
+
+	/* Mixing happens on a single thread, into a single device */
+
+	if (independent_playback)
+		nr_workers = rx_loop_workers(nr_hosts, max_workers);
+	else
+		nr_workers = 1;
+
+	hosts.nr_slots = nr_slots;
+	hosts.jitter = jitter;
+	hosts.trace = trace;
+	hosts.record = record;
+	hosts.native = native;
+	hosts.one_socket = one_socket;
+	hosts.recorder = NULL;
+
+	srandom(time(NULL) ^ getpid()); /* sequence numbers */
+
+	/* Before any thread is started, oRTP's included */
+
+	sigemptyset(&report_signals);
+	sigaddset(&report_signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &report_signals, NULL);
+
+	stats = stats_new(stats_name, nr_slots);
+	if (stats == NULL)
+		return -1;
+
+	if (relay)
+	{
+		r = run_relay_mode(&roles[ROLE_RELAY], pid, &report_signals);
+
+		stats_free(stats, stats_name);
+		for (i = 0; i < nr_hosts; i++)
+			free(connections[i].tx_addr);
+		free(connections);
+
+		return r;
+	}
+
+	rx = calloc(nr_slots, sizeof(struct rx_args));
+	loops = calloc(nr_workers, sizeof(struct rx_loop));
+	rx_threads = calloc(nr_workers, sizeof(pthread_t));
+
+	/* Every host is sent the same frame, in one batch; the sessions
+	 * are only used to receive */
+
+	tx.nr_sessions = 0;
+	tx.sessions = NULL;
+	tx.fanout = fanout_new(nr_slots, 120);
+	if (tx.fanout == NULL)
+		return -1;
+	tx.fanout->stamped = stamped;
+
+	if (codec_layout(&layout, channels, layout_name) == -1)
+		return -1;
+	tx.encoder = codec_encoder(&layout, rate);
+	if (tx.encoder == NULL)
 		return -1;
+	if (set_opus_fec(tx.encoder, loss) == -1)
+		return -1;
+
+	if (record)
+	{
+		hosts.recorder = recorder_new(nr_slots, &layout, rate);
+		if (hosts.recorder == NULL)
+			return -1;
+	}
+
+	/* The bitrate starts at -b and moves between there and -a, with
+	 * FEC rising above -l to match the loss */
+
+	tx.adapt = NULL;
+	if (adapt_kbps)
+	{
+		tx.adapt = adapt_new(nr_slots, adapt_kbps, kbps, loss);
+		if (tx.adapt == NULL)
+			return -1;
+		if (adapt_start(tx.adapt, tx.encoder) == -1)
+			return -1;
 	}
 
 	tx.bytes_per_frame = kbps * 1024 * frame / rate / 8;
+	tx.channels = channels;
+	tx.frame = frame;
 	/* Follow the RFC, payload 0 has 8kHz reference rate */
 
 	tx.ts_per_frame = frame * 8000 / rate;
@@ -297,89 +1045,220 @@ int main(int argc, char *argv[])
 	ortp_scheduler_init();
 	ortp_set_log_level_mask(NULL, ORTP_WARNING | ORTP_ERROR);
 
-	sigaction(SIGUSR1, &action, NULL);
+	for (i = 0; i < (int)nr_slots; i++)
+	{
+		rx[i].decoder = codec_decoder(&layout, rate);
+		if (rx[i].decoder == NULL)
+			return -1;
+
+		rx[i].jb = jbuf_new(jitter, DEFAULT_JITTER_MAX(jitter), DEFAULT_JITTER_DECAY);
+		if (rx[i].jb == NULL)
+			return -1;
+	}
 
-	r = snd_pcm_open(&tx.snd, capture_device, SND_PCM_STREAM_CAPTURE, 0);
-	if (r < 0)
+	if (bridge_mode)
 	{
-		aerror("snd_pcm_open", r);
-		return -1;
+		struct bridge *bridge;
+
+		hosts.fanout = tx.fanout;
+		hosts.adapt = NULL;
+		hosts.loop = NULL;
+
+		for (i = 0; i < nr_hosts; i++)
+		{
+			if (start_host(&hosts, i, false) == -1)
+				return -1;
+		}
+
+		bridge = bridge_new(nr_hosts, rx, &layout, rate, frame, kbps, loss,
+												tx.fanout, stats);
+		if (bridge == NULL)
+			return -1;
+
+		r = run_bridge_mode(&hosts, bridge, rx_loop_workers(nr_hosts, max_workers),
+												&roles[ROLE_MIX], pid, &report_signals);
+
+		bridge_free(bridge);
+
+		ortp_exit();
+		opus_multistream_encoder_destroy(tx.encoder);
+		fanout_free(tx.fanout);
+		if (tx.adapt)
+			adapt_free(tx.adapt);
+
+		close_hosts(&hosts);
+		stats_free(stats, stats_name);
+
+		return r;
 	}
-	if (set_alsa_hw(tx.snd, rate, channels, buffer * 1000) == -1)
-		return -1;
-	if (set_alsa_sw(tx.snd) == -1)
-		return -1;
 
-	for (i = 0; i < nr_hosts; i++)
+	if (backend_is(capture_device))
 	{
-		rx[i].decoder = opus_decoder_create(rate, channels, &error);
-		if (rx[i].decoder == NULL)
+		tx.snd = NULL;
+		capture_backend = backend_open(capture_device, true, rate, channels,
+																	 &capture_format);
+		if (capture_backend == NULL)
+			return -1;
+	}
+	else
+	{
+		r = snd_pcm_open(&tx.snd, capture_device, SND_PCM_STREAM_CAPTURE, 0);
+		if (r < 0)
 		{
-			fprintf(stderr, "opus_decoder_create: %s\n", opus_strerror(error));
+			aerror("snd_pcm_open", r);
 			return -1;
 		}
+		if (set_alsa_hw(tx.snd, rate, channels, buffer * 1000, access,
+										&capture_format) == -1)
+			return -1;
+		if (set_alsa_sw(tx.snd) == -1)
+			return -1;
+	}
+
+	if (tx_stream_init(&tx.stream, channels, frame, tx.bytes_per_frame,
+										 capture_format) == -1)
+		return -1;
+	tx.stream.mmap = (access == SND_PCM_ACCESS_MMAP_INTERLEAVED) && !capture_backend;
+	tx.stream.backend = capture_backend;
+	tx.stream.stats = stats;
+	tx.stream.stamped = stamped;
+	tx.stream.rate = rate;
+	stats_set(&stats->tx.kbps, kbps);
+
+	hosts.fanout = tx.fanout;
+	hosts.adapt = tx.adapt;
+	hosts.loop = &loops[0];
+
+	for (i = 0; i < nr_hosts; i++)
+	{
+		if (start_host(&hosts, i, false) == -1)
+			return -1;
 
-		connections[i].session = create_rtp_send_recv(connections[i].tx_addr, connections[i].tx_port,
-																									"0.0.0.0", connections[i].rx_port,
-																									jitter, connections[i].ssrc);
-		assert(connections[i].session != NULL);
-		rx[i].session = tx.sessions[i] = connections[i].session;
+		if (!independent_playback)
+			continue;
 
-		r = snd_pcm_open(&rx[i].snd, playback_device, SND_PCM_STREAM_PLAYBACK, 0);
+		r = snd_pcm_open(&rx[i].snd, playback_device, SND_PCM_STREAM_PLAYBACK,
+										 SND_PCM_NONBLOCK);
 		if (r < 0)
 		{
 			aerror("snd_pcm_open", r);
 			return -1;
 		}
-		if (set_alsa_hw(rx[i].snd, rate, channels, buffer * 1000) == -1)
+		if (set_alsa_hw(rx[i].snd, rate, channels, buffer * 1000, access,
+										&playback_format) == -1)
 			return -1;
 		if (set_alsa_sw(rx[i].snd) == -1)
 			return -1;
 	}
 
-	if (pid)
-		go_daemon(pid);
+	if (!independent_playback && backend_is(playback_device))
+	{
+		mix_backend = backend_open(playback_device, false, rate, channels,
+															 &playback_format);
+		if (mix_backend == NULL)
+			return -1;
+		mix_backend->buffer = (snd_pcm_uframes_t)rate * buffer / 1000;
+	}
+	else if (!independent_playback)
+	{
+		r = snd_pcm_open(&mix_snd, playback_device, SND_PCM_STREAM_PLAYBACK,
+										 SND_PCM_NONBLOCK);
+		if (r < 0)
+		{
+			aerror("snd_pcm_open", r);
+			return -1;
+		}
+		if (set_alsa_hw(mix_snd, rate, channels, buffer * 1000, access,
+										&playback_format) == -1)
+			return -1;
+		if (set_alsa_sw(mix_snd) == -1)
+			return -1;
+	}
 
-	go_realtime();
+	/* Hosts are dealt out to a fixed number of receive workers, so
+	 * the thread count does not grow with the number of hosts */
 
-	tx.channels = channels;
-	tx.frame = frame;
-	pthread_create(&tx_thread, NULL, (void *(*)(void *))run_tx, &tx);
-	for (i = 0; i < nr_hosts; i++)
+	for (i = 0; i < nr_workers; i++)
+	{
+		if (rx_loop_init(&loops[i]) == -1)
+			return -1;
+		loops[i].peers = calloc(nr_slots, sizeof(struct rx_args *));
+		loops[i].snd = mix_snd;
+		loops[i].backend = mix_backend;
+		loops[i].format = playback_format;
+		loops[i].channels = channels;
+		loops[i].frame = frame;
+		loops[i].mmap = (access == SND_PCM_ACCESS_MMAP_INTERLEAVED);
+		loops[i].xruns = &stats->playback_xruns;
+		loops[i].drift = drift;
+	}
+	for (i = 0; i < (int)nr_slots; i++)
 	{
+		struct rx_loop *loop = &loops[i % nr_workers];
+
 		rx[i].channels = channels;
 		rx[i].rate = rate;
-		pthread_create(&rx_threads[i], NULL, (void *(*)(void *))run_rx, &rx[i]);
+		rx[i].out = independent_playback ? rx[i].snd : mix_snd;
+		loop->peers[loop->nr_peers++] = &rx[i];
+	}
+
+	if (pid)
+		go_daemon(pid);
+
+	/* Threads outside the audio path take the ordinary scheduling
+	 * of this one */
+
+	if (hosts.recorder && recorder_start(hosts.recorder) == -1)
+		return -1;
+
+	pthread_create(&report_thread, NULL, report_stats, &report_signals);
+	if (control_path)
+	{
+		if (control_open(&control, control_path, commands, &hosts) == -1)
+			return -1;
+		pthread_create(&control_thread, NULL, (void *(*)(void *))run_control, &control);
+	}
+
+	lock_memory();
+
+	if (sched_thread(&tx_thread, &roles[ROLE_TX], 0,
+									 (void *(*)(void *))run_tx, &tx) == -1)
+		return -1;
+	for (i = 0; i < nr_workers; i++)
+	{
+		if (sched_thread(&rx_threads[i], &roles[independent_playback ? ROLE_RX : ROLE_MIX], i,
+										 (void *(*)(void *))run_rx_loop, &loops[i]) == -1)
+			return -1;
 	}
 
 	pthread_join(tx_thread, NULL);
-	for (i = 0; i < nr_hosts; i++)
+	for (i = 0; i < nr_workers; i++)
 	{
 		pthread_join(rx_threads[i], NULL);
+		free(loops[i].peers);
 	}
 
 	ortp_exit();
 	ortp_global_stats_display();
 
-	if (snd_pcm_close(tx.snd) < 0)
+	if (tx.snd && snd_pcm_close(tx.snd) < 0)
 		abort();
+	if (capture_backend)
+		backend_close(capture_backend);
 
-	opus_encoder_destroy(tx.encoder);
-
-	for (i = 0; i < nr_hosts; i++)
-	{
-		if (snd_pcm_close(rx[i].snd) < 0)
-			abort();
-
-		rtp_session_destroy(rx[i].session);
-
-		opus_decoder_destroy(rx[i].decoder);
+	opus_multistream_encoder_destroy(tx.encoder);
+	tx_stream_clear(&tx.stream);
+	fanout_free(tx.fanout);
+	if (tx.adapt)
+		adapt_free(tx.adapt);
 
-		free(connections[i].tx_addr);
-	}
+	if (mix_snd && snd_pcm_close(mix_snd) < 0)
+		abort();
+	if (mix_backend)
+		backend_close(mix_backend);
 
-	if (using_extended_connections)
-		free(connections);
+	close_hosts(&hosts);
+	stats_free(stats, stats_name);
 
 	return r;
 }
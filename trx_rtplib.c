@@ -2,18 +2,14 @@
 
 #include "trx_rtplib.h"
 
-extern unsigned int verbose;
-
-static void timestamp_jump(RtpSession *session, void *a, void *b, void *c)
-{
-	if (verbose > 1)
-		fputc('|', stderr);
-	rtp_session_resync(session);
-}
+/*
+ * Return NULL if the session could not be set up, eg. the port is
+ * in use
+ */
 
 RtpSession* create_rtp_send_recv(const char *tx_addr_desc, const int tx_port,
 		const char *rx_addr_desc, const int rx_port,
-		unsigned int jitter, uint32_t ssrc)
+		uint32_t ssrc)
 {
 	RtpSession *session;
 
@@ -27,27 +23,28 @@ RtpSession* create_rtp_send_recv(const char *tx_addr_desc, const int tx_port,
 
 	rtp_profile_set_payload(&av_profile, 120, &payload_type_opus);
 	if (rtp_session_set_payload_type(session, 120) != 0)
-		abort();
+		goto fail;
 
 	/* tx */
 	if (rtp_session_set_remote_addr(session, tx_addr_desc, tx_port) != 0)
-		abort();
+		goto fail;
 	if (rtp_session_set_multicast_ttl(session, 16) != 0)
-		abort();
+		goto fail;
 	if (rtp_session_set_dscp(session, 40) != 0)
-		abort();
+		goto fail;
 
 	/* rx */
 	if (rtp_session_set_local_addr(session, rx_addr_desc, rx_port, rx_port + 1) != 0)
-		abort();
-	rtp_session_enable_adaptive_jitter_compensation(session, TRUE);
-	rtp_session_set_jitter_compensation(session, jitter); /* ms */
-	rtp_session_set_time_jump_limit(session, jitter * 16); /* ms */
-	if (rtp_session_signal_connect(session, "timestamp_jump",
-					timestamp_jump, 0) != 0)
-	{
-		abort();
-	}
+		goto fail;
+
+	/* Packets are handed over as they arrive, to our own jitter
+	 * buffer (jbuf.c) */
+
+	rtp_session_enable_jitter_buffer(session, FALSE);
 
 	return session;
+
+fail:
+	rtp_session_destroy(session);
+	return NULL;
 }
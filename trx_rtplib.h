@@ -6,6 +6,6 @@
 RtpSession* create_rtp_send_recv(
 		const char *tx_addr_desc, const int tx_port,
 		const char *rx_addr_desc, const int rx_port,
-		unsigned int jitter, uint32_t ssrc);
+		uint32_t ssrc);
 
 #endif
@@ -0,0 +1,866 @@
+/*
+ * Benchmark of the whole path: tx to rx, trx through a relay, and
+ * meshes of trx, over loopback with audio from a file and played to
+ * nowhere (see backend.h), measured through the statistics each
+ * publishes with -R (see stats.h)
+ *
+ * Each run prints one line of JSON. Percentiles are the top of the
+ * power-of-two bucket they fall in, as histograms are kept.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "defaults.h"
+#include "stats.h"
+
+#define MAX_VALUES 8
+#define MAX_PEERS 64
+#define MAX_ARGS 32
+#define RELAY_HOSTS 3 /* enough for streams to sit side by side */
+
+#define WARMUP_S 2 /* jitter buffers settle before measuring */
+#define SIGNAL_S 10 /* length of the test signal, played in a loop */
+
+/* A mesh keeps up while no more than this much audio is concealed,
+ * and no device overruns */
+
+#define SUSTAINED_CONCEALED 0.01
+
+struct config {
+	unsigned int frame, buffer, jitter;
+};
+
+struct proc {
+	pid_t pid;
+	char name[64]; /* of the statistics */
+	const struct stats *s;
+	void *before; /* copy of the statistics at the start */
+	unsigned long cpu; /* ticks, at the start */
+	char output[64]; /* file to take its standard output, if set */
+};
+
+struct hist {
+	unsigned long bucket[STATS_BUCKETS];
+};
+
+static const char *bin = ".", *signal_path, *impair;
+static unsigned int seconds = 5, base_port = 5100;
+static bool quiet = true;
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: trxbench [<parameters>]\n"
+		"Run tx, rx and trx over loopback, and print measurements as JSON\n");
+
+	fprintf(fd, "\nParameters:\n");
+	fprintf(fd, "  -f <n,...>  Frame sizes (default %d,480 samples)\n",
+		DEFAULT_FRAME);
+	fprintf(fd, "  -m <ms,...> Buffer times (default %d milliseconds)\n",
+		DEFAULT_BUFFER);
+	fprintf(fd, "  -j <ms,...> Jitter buffers (default %d milliseconds)\n",
+		DEFAULT_JITTER);
+	fprintf(fd, "  -n <n>      Largest mesh of trx to try (default 16, up to %d)\n",
+		MAX_PEERS);
+	fprintf(fd, "  -t <s>      Time to measure each run (default 5 seconds)\n");
+	fprintf(fd, "  -C <file>   Audio to send, in place of a test signal\n");
+	fprintf(fd, "  -N <params> Send tx to rx through netsim, with these parameters\n"
+		"              (such as \"-l 2 -j 5\")\n");
+	fprintf(fd, "  -p <port>   First UDP port to use (default 5100)\n");
+	fprintf(fd, "  -B <dir>    Where to find tx, rx and trx (default .)\n");
+	fprintf(fd, "  -v          Show the programs' own output\n");
+}
+
+static int parse_list(const char *s, unsigned int *v)
+{
+	unsigned int n = 0;
+	char *end;
+
+	for (;;) {
+		if (n == MAX_VALUES)
+			return -1;
+		v[n++] = strtoul(s, &end, 10);
+		if (end == s)
+			return -1;
+		if (*end == '\0')
+			return n;
+		if (*end != ',')
+			return -1;
+		s = end + 1;
+	}
+}
+
+/*
+ * A few seconds of tones and noise at the default rate and channels,
+ * raw 16-bit; so that the encoder has work to do, as it does not
+ * with silence
+ */
+
+static int write_signal(char *path)
+{
+	unsigned int n, c, samples = DEFAULT_RATE * SIGNAL_S;
+	uint32_t seed = 1;
+	int16_t *pcm;
+	int fd;
+	size_t len;
+
+	len = sizeof *pcm * samples * DEFAULT_CHANNELS;
+	pcm = malloc(len);
+	if (pcm == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (n = 0; n < samples; n++) {
+		double t = (double)n / DEFAULT_RATE, v;
+
+		v = 0.3 * sin(2 * M_PI * 220 * t) + 0.2 * sin(2 * M_PI * 1375 * t)
+			+ 0.1 * sin(2 * M_PI * 5100 * t);
+		for (c = 0; c < DEFAULT_CHANNELS; c++) {
+			seed = seed * 1103515245 + 12345;
+			pcm[n * DEFAULT_CHANNELS + c] = 32767 *
+				(v + 0.1 * ((double)(seed >> 16) / 32768 - 1));
+		}
+	}
+
+	fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		free(pcm);
+		return -1;
+	}
+	if (write(fd, pcm, len) != (ssize_t)len) {
+		perror("write");
+		close(fd);
+		free(pcm);
+		return -1;
+	}
+
+	close(fd);
+	free(pcm);
+	return 0;
+}
+
+static int spawn(struct proc *p, const char *program, char *const *argv)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof path, "%s/%s", bin, program);
+
+	p->pid = fork();
+	if (p->pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (p->pid > 0)
+		return 0;
+
+	if (quiet) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd != -1) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+	}
+	if (p->output[0]) {
+		fd = open(p->output, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd == -1) {
+			perror(p->output);
+			_exit(EXIT_FAILURE);
+		}
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+
+	execv(path, argv);
+	perror(path);
+	_exit(EXIT_FAILURE);
+}
+
+/*
+ * CPU time, user and system, in clock ticks
+ */
+
+static unsigned long cpu_ticks(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime = 0, stime = 0;
+	FILE *f;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	if (fgets(buf, sizeof buf, f) == NULL)
+		buf[0] = '\0';
+	fclose(f);
+
+	/* The command name may contain anything, up to the last ')' */
+
+	p = strrchr(buf, ')');
+	if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+				"%*u %*u %lu %lu", &utime, &stime) != 2)
+	{
+		return 0;
+	}
+
+	return utime + stime;
+}
+
+static bool alive(const struct proc *p)
+{
+	return waitpid(p->pid, NULL, WNOHANG) == 0;
+}
+
+/*
+ * Take a copy of the statistics to measure from
+ */
+
+static int attach(struct proc *p)
+{
+	p->s = stats_open(p->name);
+	if (p->s == NULL)
+		return -1;
+
+	p->before = malloc(p->s->size);
+	if (p->before == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memcpy(p->before, p->s, p->s->size);
+	p->cpu = cpu_ticks(p->pid);
+
+	return 0;
+}
+
+static void stop(struct proc *p, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (p[i].pid > 0) {
+			kill(p[i].pid, SIGTERM);
+			waitpid(p[i].pid, NULL, 0);
+		}
+		if (p[i].s)
+			munmap((void *)p[i].s, p[i].s->size);
+		free(p[i].before);
+		if (p[i].name[0])
+			shm_unlink(p[i].name);
+		if (p[i].output[0])
+			unlink(p[i].output);
+		memset(&p[i], 0, sizeof p[i]);
+	}
+}
+
+/*
+ * Counters and histograms as they moved since attach()
+ */
+
+#define DELTA(p, field) \
+	(stats_get(&(p)->s->field) - \
+	 stats_get(&((const struct stats *)(p)->before)->field))
+
+static void hist_add(struct hist *h, const struct stats_hist *now,
+		const struct stats_hist *then)
+{
+	unsigned int n;
+
+	for (n = 0; n < STATS_BUCKETS; n++)
+		h->bucket[n] += stats_get(&now->bucket[n]) - stats_get(&then->bucket[n]);
+}
+
+static unsigned long hist_percentile(const struct hist *h, double pct)
+{
+	unsigned long total = 0, seen = 0;
+	unsigned int n;
+
+	for (n = 0; n < STATS_BUCKETS; n++)
+		total += h->bucket[n];
+	if (total == 0)
+		return 0;
+
+	for (n = 0; n < STATS_BUCKETS; n++) {
+		seen += h->bucket[n];
+		if (seen >= total * pct)
+			break;
+	}
+
+	return n ? (1UL << n) - 1 : 0;
+}
+
+static void print_hist(const char *key, const struct hist *h)
+{
+	printf(", \"%s\": {\"p50\": %lu, \"p99\": %lu}", key,
+		hist_percentile(h, 0.50), hist_percentile(h, 0.99));
+}
+
+static void print_config(const char *run, const struct config *c)
+{
+	printf("{\"run\": \"%s\", \"frame\": %u, \"buffer-ms\": %u, "
+		"\"jitter-ms\": %u, \"seconds\": %u", run, c->frame, c->buffer,
+		c->jitter, seconds);
+}
+
+static void print_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+static double cpu_ns(const struct proc *p)
+{
+	return (double)(cpu_ticks(p->pid) - p->cpu) * 1e9 / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * Put netsim between tx at 'port' and rx at 'to', for RTP and RTCP
+ */
+
+static int spawn_netsim(struct proc *p, unsigned int port, unsigned int to)
+{
+	char params[256], listen[16], forward[16], *argv[MAX_ARGS], *s;
+	unsigned int n = 0;
+
+	snprintf(params, sizeof params, "%s", impair);
+	snprintf(listen, sizeof listen, "%u", port);
+	snprintf(forward, sizeof forward, "%u", to);
+
+	argv[n++] = "netsim";
+	for (s = strtok(params, " "); s; s = strtok(NULL, " ")) {
+		if (n == MAX_ARGS - 6) {
+			fprintf(stderr, "Too many netsim parameters\n");
+			return -1;
+		}
+		argv[n++] = s;
+	}
+	argv[n++] = "-n";
+	argv[n++] = "2";
+	argv[n++] = listen;
+	argv[n++] = "127.0.0.1";
+	argv[n++] = forward;
+	argv[n] = NULL;
+
+	snprintf(p->output, sizeof p->output, "/tmp/trxbench.%d.netsim",
+		getpid());
+	return spawn(p, "netsim", argv);
+}
+
+/*
+ * Stop netsim, and pass on what it says it did to the packets, over
+ * the whole run (warm-up included), as JSON
+ */
+
+static void print_netsim(struct proc *p)
+{
+	char buf[4096];
+	size_t len = 0;
+	FILE *f;
+	int c;
+
+	kill(p->pid, SIGTERM);
+	waitpid(p->pid, NULL, 0);
+	p->pid = 0;
+
+	f = fopen(p->output, "r");
+	if (f) {
+		while ((c = getc(f)) != EOF && len < sizeof buf - 1) {
+			if (c != '\n')
+				buf[len++] = c;
+		}
+		fclose(f);
+	}
+	buf[len] = '\0';
+
+	printf(", \"netsim-result\": %s", len ? buf : "null");
+}
+
+/*
+ * tx to rx: one stream, end to end
+ */
+
+static int run_pair(const struct config *c)
+{
+	struct proc p[3] = { };
+	struct proc *rx = &p[0], *tx = &p[1], *ns = &p[2];
+	struct hist encode = { }, send = { }, decode = { }, net = { },
+		queue = { }, depth = { };
+	const struct stats_peer *st, *was;
+	char frame[16], buffer[16], jitter[16], port[16], tx_port[16],
+		capture[256];
+	unsigned long frames, periods;
+	int r = -1;
+
+	snprintf(frame, sizeof frame, "%u", c->frame);
+	snprintf(buffer, sizeof buffer, "%u", c->buffer);
+	snprintf(jitter, sizeof jitter, "%u", c->jitter);
+	snprintf(port, sizeof port, "%u", base_port);
+	snprintf(tx_port, sizeof tx_port, "%u", impair ? base_port + 2 : base_port);
+	snprintf(capture, sizeof capture, "file:%s", signal_path);
+	snprintf(rx->name, sizeof rx->name, "/trxbench.%d.rx", getpid());
+	snprintf(tx->name, sizeof tx->name, "/trxbench.%d.tx", getpid());
+
+	{
+		char *rx_argv[] = { "rx", "-U", "-d", "null", "-h", "127.0.0.1",
+			"-p", port, "-m", buffer, "-j", jitter, "-R", rx->name, NULL };
+		char *tx_argv[] = { "tx", "-U", "-d", capture, "-h", "127.0.0.1",
+			"-p", tx_port, "-f", frame, "-m", buffer, "-R", tx->name, NULL };
+
+		if (impair && spawn_netsim(ns, base_port + 2, base_port) == -1)
+			goto done;
+		if (spawn(rx, "rx", rx_argv) == -1 || spawn(tx, "tx", tx_argv) == -1)
+			goto done;
+	}
+
+	sleep(WARMUP_S);
+	if (attach(rx) == -1 || attach(tx) == -1)
+		goto done;
+	sleep(seconds);
+
+	if (!alive(rx) || !alive(tx) || (impair && !alive(ns))) {
+		fprintf(stderr, "tx, rx or netsim exited\n");
+		goto done;
+	}
+
+	st = &rx->s->peer[0];
+	was = &((const struct stats *)rx->before)->peer[0];
+	hist_add(&decode, &st->decode_ns, &was->decode_ns);
+	hist_add(&net, &st->net_ns, &was->net_ns);
+	hist_add(&queue, &st->queue_ns, &was->queue_ns);
+	hist_add(&depth, &st->depth_ms_hist, &was->depth_ms_hist);
+	hist_add(&encode, &tx->s->tx.encode_ns,
+		&((const struct stats *)tx->before)->tx.encode_ns);
+	hist_add(&send, &tx->s->tx.send_ns,
+		&((const struct stats *)tx->before)->tx.send_ns);
+
+	frames = DELTA(tx, tx.frames);
+	periods = DELTA(rx, peer[0].periods);
+
+	print_config("pair", c);
+	if (impair) {
+		printf(", \"netsim\": ");
+		print_string(impair);
+		print_netsim(ns);
+	}
+	printf(", \"frames\": %lu, \"periods\": %lu", frames, periods);
+	print_hist("encode-ns", &encode);
+	print_hist("send-ns", &send);
+	print_hist("net-ns", &net);
+	print_hist("queue-ns", &queue);
+	print_hist("decode-ns", &decode);
+	print_hist("depth-ms", &depth);
+	printf(", \"target-ms\": %lu", stats_get(&st->target_ms));
+	printf(", \"lost\": %lu, \"late\": %lu, \"underrun\": %lu, "
+		"\"concealed\": %lu, \"xruns\": %lu",
+		DELTA(rx, peer[0].lost), DELTA(rx, peer[0].late),
+		DELTA(rx, peer[0].underrun), DELTA(rx, peer[0].concealed),
+		DELTA(tx, tx.xruns));
+	printf(", \"cpu-ns-per-frame\": {\"tx\": %.0f, \"rx\": %.0f}}\n",
+		frames ? cpu_ns(tx) / frames : 0.0,
+		periods ? cpu_ns(rx) / periods : 0.0);
+	fflush(stdout);
+
+	r = 0;
+done:
+	stop(p, 3);
+	return r;
+}
+
+/*
+ * Host i hears host j on base + 2 * (i * MAX_PEERS + j); every
+ * session also takes the port after its own, for RTCP
+ */
+
+static unsigned int mesh_port(unsigned int i, unsigned int j)
+{
+	return base_port + 2 * (i * MAX_PEERS + j);
+}
+
+/*
+ * Host i of n, hearing each other host j on mesh_port(i, j). In a
+ * mesh, it sends to them directly; through a relay, it sends once,
+ * to the relay's port for it
+ */
+
+static int spawn_mesh_host(struct proc *p, const struct config *c,
+		unsigned int i, unsigned int n, bool relay)
+{
+	char frame[16], buffer[16], jitter[16], capture[256], *x, *argv[MAX_ARGS];
+	unsigned int j, a = 0;
+	size_t len = 0, size = n * 64;
+	int r;
+
+	x = malloc(size);
+	if (x == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	x[0] = '\0';
+
+	for (j = 0; j < n; j++) {
+		if (j == i)
+			continue;
+		len += snprintf(x + len, size - len, "%s%u@%u#127.0.0.1:%u",
+				len ? "," : "", 1000 + i, mesh_port(i, j),
+				relay ? mesh_port(i, i) : mesh_port(j, i));
+	}
+
+	snprintf(frame, sizeof frame, "%u", c->frame);
+	snprintf(buffer, sizeof buffer, "%u", c->buffer);
+	snprintf(jitter, sizeof jitter, "%u", c->jitter);
+	snprintf(capture, sizeof capture, "file:%s", signal_path);
+	snprintf(p->name, sizeof p->name, "/trxbench.%d.%u", getpid(), i);
+
+	argv[a++] = "trx";
+	argv[a++] = "-U";
+	if (!relay)
+		argv[a++] = "-E"; /* a relay passes on the payload alone */
+	argv[a++] = "-C";
+	argv[a++] = capture;
+	argv[a++] = "-P";
+	argv[a++] = "null";
+	argv[a++] = "-f";
+	argv[a++] = frame;
+	argv[a++] = "-m";
+	argv[a++] = buffer;
+	argv[a++] = "-j";
+	argv[a++] = jitter;
+	argv[a++] = "-R";
+	argv[a++] = p->name;
+	argv[a++] = "-x";
+	argv[a++] = x;
+	argv[a] = NULL;
+
+	r = spawn(p, "trx", argv);
+	free(x);
+	return r;
+}
+
+/*
+ * The relay hears host i on mesh_port(i, i), which the host itself
+ * leaves unused, and sends it host j's stream on mesh_port(i, j)
+ */
+
+static int spawn_relay(struct proc *p, unsigned int n)
+{
+	char x[RELAY_HOSTS * 64];
+	unsigned int i;
+	size_t len = 0;
+
+	for (i = 0; i < n; i++) {
+		len += snprintf(x + len, sizeof x - len, "%s%u@%u#127.0.0.1:%u",
+				len ? "," : "", 2000 + i, mesh_port(i, i),
+				mesh_port(i, 0));
+	}
+	snprintf(p->name, sizeof p->name, "/trxbench.%d.relay", getpid());
+
+	{
+		char *argv[] = { "trx", "-X", "-R", p->name, "-x", x, NULL };
+
+		return spawn(p, "trx", argv);
+	}
+}
+
+/*
+ * trx through a relay: every host hears all the others, as in a
+ * mesh, but sends only the one stream
+ */
+
+static int run_relay(const struct config *c)
+{
+	struct proc p[RELAY_HOSTS + 1] = { };
+	struct proc *relay = &p[RELAY_HOSTS];
+	struct hist decode = { }, depth = { };
+	unsigned long frames = 0, periods = 0, concealed = 0, xruns = 0,
+		received = 0, sent = 0, dropped = 0;
+	double cpu = 0;
+	unsigned int i, k;
+	int r = -1;
+
+	if (spawn_relay(relay, RELAY_HOSTS) == -1)
+		goto done;
+	for (i = 0; i < RELAY_HOSTS; i++) {
+		if (spawn_mesh_host(&p[i], c, i, RELAY_HOSTS, true) == -1)
+			goto done;
+	}
+
+	sleep(WARMUP_S);
+	for (i = 0; i < RELAY_HOSTS + 1; i++) {
+		if (attach(&p[i]) == -1)
+			goto done;
+	}
+	sleep(seconds);
+
+	for (i = 0; i < RELAY_HOSTS + 1; i++) {
+		if (!alive(&p[i])) {
+			fprintf(stderr, "trx exited\n");
+			goto done;
+		}
+	}
+
+	for (i = 0; i < RELAY_HOSTS; i++) {
+		const struct stats *s = p[i].s, *was = p[i].before;
+
+		frames += DELTA(&p[i], tx.frames);
+		xruns += DELTA(&p[i], tx.xruns) + DELTA(&p[i], playback_xruns);
+		cpu += cpu_ns(&p[i]);
+
+		for (k = 0; k < RELAY_HOSTS - 1; k++) {
+			hist_add(&decode, &s->peer[k].decode_ns, &was->peer[k].decode_ns);
+			hist_add(&depth, &s->peer[k].depth_ms_hist,
+				&was->peer[k].depth_ms_hist);
+			periods += DELTA(&p[i], peer[k].periods);
+			concealed += DELTA(&p[i], peer[k].concealed);
+		}
+
+		received += DELTA(relay, peer[i].received);
+		sent += DELTA(relay, peer[i].sent);
+		dropped += DELTA(relay, peer[i].dropped);
+	}
+
+	print_config("relay", c);
+	printf(", \"peers\": %u, \"frames\": %lu, \"periods\": %lu",
+		RELAY_HOSTS, frames, periods);
+	print_hist("decode-ns", &decode);
+	print_hist("depth-ms", &depth);
+	printf(", \"concealed\": %.4f, \"xruns\": %lu",
+		periods ? (double)concealed / periods : 1.0, xruns);
+	printf(", \"relay\": {\"received\": %lu, \"sent\": %lu, "
+		"\"dropped\": %lu}", received, sent, dropped);
+	printf(", \"cpu-ns-per-frame\": {\"hosts\": %.0f, \"relay\": %.0f}}\n",
+		frames ? cpu / frames : 0.0,
+		received ? cpu_ns(relay) / received : 0.0);
+	fflush(stdout);
+
+	r = 0;
+done:
+	stop(p, RELAY_HOSTS + 1);
+	return r;
+}
+
+/*
+ * A mesh of n trx, each sending to and hearing all the others;
+ * returns 1 if it kept up, 0 if not, or -1 if it could not be run
+ */
+
+static int run_mesh(const struct config *c, unsigned int n)
+{
+	struct proc p[MAX_PEERS] = { };
+	struct hist encode = { }, decode = { }, depth = { };
+	unsigned long frames = 0, periods = 0, concealed = 0, xruns = 0,
+		total_max = 0;
+	double cpu = 0, network = 0, jitter = 0, total = 0, ratio;
+	unsigned int i, k, peers = 0;
+	bool sustained;
+	int r = -1;
+
+	for (i = 0; i < n; i++) {
+		if (spawn_mesh_host(&p[i], c, i, n, false) == -1)
+			goto done;
+	}
+
+	sleep(WARMUP_S);
+	for (i = 0; i < n; i++) {
+		if (attach(&p[i]) == -1)
+			goto done;
+	}
+	sleep(seconds);
+
+	for (i = 0; i < n; i++) {
+		const struct stats *s = p[i].s, *was = p[i].before;
+
+		if (!alive(&p[i])) {
+			fprintf(stderr, "trx exited\n");
+			goto done;
+		}
+
+		hist_add(&encode, &s->tx.encode_ns, &was->tx.encode_ns);
+		frames += DELTA(&p[i], tx.frames);
+		xruns += DELTA(&p[i], tx.xruns) + DELTA(&p[i], playback_xruns);
+		cpu += cpu_ns(&p[i]);
+
+		for (k = 0; k < n - 1; k++) {
+			const struct stats_peer *st = &s->peer[k];
+			unsigned long t = stats_get(&st->e2e_total_us);
+
+			hist_add(&decode, &st->decode_ns, &was->peer[k].decode_ns);
+			hist_add(&depth, &st->depth_ms_hist, &was->peer[k].depth_ms_hist);
+			periods += DELTA(&p[i], peer[k].periods);
+			concealed += DELTA(&p[i], peer[k].concealed);
+
+			network += stats_get(&st->e2e_network_us);
+			jitter += stats_get(&st->e2e_jitter_us);
+			total += t;
+			if (t > total_max)
+				total_max = t;
+			peers++;
+		}
+	}
+
+	ratio = periods ? (double)concealed / periods : 1.0;
+	sustained = ratio <= SUSTAINED_CONCEALED && xruns == 0;
+
+	print_config("mesh", c);
+	printf(", \"peers\": %u, \"frames\": %lu, \"periods\": %lu", n, frames,
+		periods);
+	print_hist("encode-ns", &encode);
+	print_hist("decode-ns", &decode);
+	print_hist("depth-ms", &depth);
+	printf(", \"latency-us\": {\"network\": %.0f, \"jitter-buffer\": %.0f, "
+		"\"total\": %.0f, \"total-max\": %lu}", network / peers,
+		jitter / peers, total / peers, total_max);
+	printf(", \"concealed\": %.4f, \"xruns\": %lu", ratio, xruns);
+	printf(", \"cpu-ns-per-frame\": %.0f", frames ? cpu / frames : 0.0);
+	printf(", \"sustained\": %s}\n", sustained ? "true" : "false");
+	fflush(stdout);
+
+	r = sustained;
+done:
+	stop(p, n);
+	return r;
+}
+
+/*
+ * The pair and the relay, then meshes doubling in size until one no
+ * longer keeps up; the largest which did is reported on its own
+ */
+
+static int run_config(const struct config *c, unsigned int max_peers)
+{
+	unsigned int n, best = 0;
+	int s, r = 0;
+
+	if (run_pair(c) == -1)
+		r = -1;
+	if (run_relay(c) == -1)
+		r = -1;
+
+	for (n = 2; n <= max_peers; n *= 2) {
+		s = run_mesh(c, n);
+		if (s == -1)
+			r = -1;
+		if (s != 1)
+			break;
+		best = n;
+	}
+
+	print_config("mesh-max", c);
+	printf(", \"peers\": %u}\n", best);
+	fflush(stdout);
+
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int frames[MAX_VALUES] = { DEFAULT_FRAME, 480 },
+		buffers[MAX_VALUES] = { DEFAULT_BUFFER },
+		jitters[MAX_VALUES] = { DEFAULT_JITTER };
+	int nr_frames = 2, nr_buffers = 1, nr_jitters = 1;
+	unsigned int max_peers = 16;
+	char path[] = "/tmp/trxbench.XXXXXX";
+	int f, b, j, r = 0;
+
+	for (;;) {
+		int c;
+
+		c = getopt(argc, argv, "f:j:m:n:p:t:vB:C:N:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'f':
+			nr_frames = parse_list(optarg, frames);
+			break;
+		case 'j':
+			nr_jitters = parse_list(optarg, jitters);
+			break;
+		case 'm':
+			nr_buffers = parse_list(optarg, buffers);
+			break;
+		case 'n':
+			max_peers = atoi(optarg);
+			break;
+		case 'p':
+			base_port = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'v':
+			quiet = false;
+			break;
+		case 'B':
+			bin = optarg;
+			break;
+		case 'C':
+			signal_path = optarg;
+			break;
+		case 'N':
+			impair = optarg;
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (nr_frames == -1 || nr_buffers == -1 || nr_jitters == -1 ||
+		max_peers < 2 || max_peers > MAX_PEERS || optind != argc)
+	{
+		usage(stderr);
+		return -1;
+	}
+	if (base_port + 2 * (max_peers > RELAY_HOSTS ? max_peers : RELAY_HOSTS)
+			* MAX_PEERS > 65536)
+	{
+		fprintf(stderr, "Ports from %u do not fit %u hosts\n", base_port,
+			max_peers);
+		return -1;
+	}
+
+	if (signal_path == NULL) {
+		if (write_signal(path) == -1)
+			return -1;
+		signal_path = path;
+	}
+
+	for (f = 0; f < nr_frames; f++) {
+		for (b = 0; b < nr_buffers; b++) {
+			for (j = 0; j < nr_jitters; j++) {
+				struct config c = {
+					.frame = frames[f],
+					.buffer = buffers[b],
+					.jitter = jitters[j]
+				};
+
+				if (run_config(&c, max_peers) == -1)
+					r = -1;
+			}
+		}
+	}
+
+	if (signal_path == path)
+		unlink(path);
+
+	return r;
+}
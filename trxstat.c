@@ -0,0 +1,61 @@
+/*
+ * Print the statistics which trx publishes with -R, from outside
+ * the process and without disturbing it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: trxstat [<parameters>] <name>\n"
+		"Print the statistics of a running trx, as JSON\n");
+
+	fprintf(fd, "\nParameters:\n");
+	fprintf(fd, "  -i <ms>     Print repeatedly, at this interval\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct stats *s;
+	unsigned int interval = 0;
+
+	for (;;) {
+		int c;
+
+		c = getopt(argc, argv, "i:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(stderr);
+		return -1;
+	}
+
+	s = stats_open(argv[optind]);
+	if (s == NULL)
+		return -1;
+
+	for (;;) {
+		if (stats_dump(s, stdout) != 0)
+			return -1;
+		if (interval == 0)
+			break;
+		usleep(interval * 1000);
+	}
+
+	return 0;
+}
@@ -19,16 +19,22 @@
 
 #include <netdb.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <alsa/asoundlib.h>
-#include <opus/opus.h>
+#include <opus/opus_multistream.h>
 #include <ortp/ortp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "backend.h"
+#include "codec.h"
 #include "defaults.h"
 #include "device.h"
+#include "format.h"
 #include "notice.h"
 #include "sched.h"
+#include "stats.h"
 #include "tx_alsalib.h"
 #include "tx_rtplib.h"
 #include "tx_runlib.h"
@@ -41,39 +47,55 @@ static void usage(FILE *fd)
 		"Real-time audio transmitter over IP\n");
 
 	fprintf(fd, "\nAudio device (ALSA) parameters:\n");
-	fprintf(fd, "  -d <dev>    Device name (default '%s')\n",
+	fprintf(fd, "  -d <dev>    Device name, or file:<path> or null (default '%s')\n",
 		DEFAULT_DEVICE);
 	fprintf(fd, "  -m <ms>     Buffer time (default %d milliseconds)\n",
 		DEFAULT_BUFFER);
+	fprintf(fd, "  -M          Access the device buffer directly (memory-mapped)\n");
+	fprintf(fd, "  -F <fmt>    Sample format: s16, s24, s32, float or auto (default %s)\n",
+		DEFAULT_FORMAT);
 
 	fprintf(fd, "\nNetwork parameters:\n");
 	fprintf(fd, "  -h <addr>   IP address to send to (default %s)\n",
 		DEFAULT_ADDR);
 	fprintf(fd, "  -p <port>   UDP port number (default %d)\n",
 		DEFAULT_PORT);
+	fprintf(fd, "  -U          Send with the built-in RTP, in place of oRTP\n");
 
 	fprintf(fd, "\nEncoding parameters:\n");
 	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
 		DEFAULT_RATE);
 	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
 		DEFAULT_CHANNELS);
+	fprintf(fd, "  -L <layout> Channels over Opus streams: pairs, mono or\n"
+		"              <streams>:<coupled>:<mapping>,... (default pairs)\n");
 	fprintf(fd, "  -f <n>      Frame size (default %d samples, see below)\n",
 		DEFAULT_FRAME);
 	fprintf(fd, "  -b <kbps>   Bitrate (approx., default %d)\n",
 		DEFAULT_BITRATE);
+	fprintf(fd, "  -l <%%>      Expected packet loss, adds in-band FEC if set (default %d)\n",
+		DEFAULT_LOSS);
 
 	fprintf(fd, "\nProgram parameters:\n");
 	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
 		DEFAULT_VERBOSE);
 	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
+	fprintf(fd, "  -R <name>   Publish statistics in shared memory, see trxstat\n");
 
 	fprintf(fd, "\nAllowed frame sizes (-f) are defined by the Opus codec. For example,\n"
 		"at 48000Hz the permitted values are 120, 240, 480 or 960.\n");
+	fprintf(fd, "\nIn-band FEC (-l) needs frames of 10ms or more (480 at 48000Hz) and a\n"
+		"modest bitrate; the receiver recovers a lost frame from the one after it.\n");
+	fprintf(fd, "\nIn place of a device, audio can be read from a WAV or raw file (in a loop),\n"
+		"or be silence (null), at the pace of a device.\n");
 }
 
 int main(int argc, char *argv[])
 {
-	int r, error;
+	int r;
+	struct codec_layout layout;
+	struct backend *backend = NULL;
+	struct stats *stats = NULL;
 	struct tx_args tx = {
 		.channels = DEFAULT_CHANNELS,
 		.frame = DEFAULT_FRAME,
@@ -83,18 +105,26 @@ int main(int argc, char *argv[])
 	/* command-line options */
 	const char *device = DEFAULT_DEVICE,
 		*addr = DEFAULT_ADDR,
+		*layout_name = NULL,
+		*stats_name = NULL,
 		*pid = NULL;
+	bool native = false;
+	snd_pcm_access_t access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	snd_pcm_format_t format;
 	unsigned int buffer = DEFAULT_BUFFER,
 		rate = DEFAULT_RATE,
 		kbps = DEFAULT_BITRATE,
+		loss = DEFAULT_LOSS,
 		port = DEFAULT_PORT;
 
 	fputs(COPYRIGHT "\n", stderr);
 
+	format_parse(DEFAULT_FORMAT, &format);
+
 	for (;;) {
 		int c;
 
-		c = getopt(argc, argv, "b:c:d:f:h:m:p:r:v:D:");
+		c = getopt(argc, argv, "b:c:d:f:h:l:m:p:r:v:D:F:L:MR:U");
 		if (c == -1)
 			break;
 
@@ -114,15 +144,36 @@ int main(int argc, char *argv[])
 		case 'h':
 			addr = optarg;
 			break;
+		case 'l':
+			loss = atoi(optarg);
+			break;
 		case 'm':
 			buffer = atoi(optarg);
 			break;
+		case 'F':
+			if (format_parse(optarg, &format) == -1) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'L':
+			layout_name = optarg;
+			break;
+		case 'M':
+			access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+			break;
 		case 'p':
 			port = atoi(optarg);
 			break;
 		case 'r':
 			rate = atoi(optarg);
 			break;
+		case 'R':
+			stats_name = optarg;
+			break;
+		case 'U':
+			native = true;
+			break;
 		case 'v':
 			verbose = atoi(optarg);
 			break;
@@ -137,16 +188,15 @@ int main(int argc, char *argv[])
 
 	tx.sessions = calloc(1, sizeof(RtpSession *));
 
-	tx.encoder = opus_encoder_create(rate, tx.channels, OPUS_APPLICATION_AUDIO,
-				&error);
-	if (tx.encoder == NULL) {
-		fprintf(stderr, "opus_encoder_create: %s\n",
-			opus_strerror(error));
+	if (codec_layout(&layout, tx.channels, layout_name) == -1)
+		return -1;
+	tx.encoder = codec_encoder(&layout, rate);
+	if (tx.encoder == NULL)
+		return -1;
+	if (set_opus_fec(tx.encoder, loss) == -1)
 		return -1;
-	}
 
 	tx.bytes_per_frame = kbps * 1024 * tx.frame / rate / 8;
-
 	/* Follow the RFC, payload 0 has 8kHz reference rate */
 
 	tx.ts_per_frame = tx.frame * 8000 / rate;
@@ -154,33 +204,80 @@ int main(int argc, char *argv[])
 	ortp_init();
 	ortp_scheduler_init();
 	ortp_set_log_level_mask(NULL, ORTP_WARNING|ORTP_ERROR);
-	tx.sessions[0] = create_rtp_send(addr, port);
-	assert(tx.sessions[0] != NULL);
 
-	r = snd_pcm_open(&tx.snd, device, SND_PCM_STREAM_CAPTURE, 0);
-	if (r < 0) {
-		aerror("snd_pcm_open", r);
-		return -1;
+	if (native) {
+		srandom(time(NULL) ^ getpid()); /* SSRC and sequence */
+		tx.fanout = fanout_new(1, 120);
+		if (tx.fanout == NULL)
+			return -1;
+		if (fanout_add(tx.fanout, 0, addr, port, random(), -1) == -1)
+			return -1;
+	} else {
+		tx.sessions[0] = create_rtp_send(addr, port);
+		assert(tx.sessions[0] != NULL);
 	}
-	if (set_alsa_hw(tx.snd, rate, tx.channels, buffer * 1000) == -1)
-		return -1;
-	if (set_alsa_sw(tx.snd) == -1)
+
+	if (backend_is(device)) {
+		tx.snd = NULL;
+		backend = backend_open(device, true, rate, tx.channels, &format);
+		if (backend == NULL)
+			return -1;
+		access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	} else {
+		r = snd_pcm_open(&tx.snd, device, SND_PCM_STREAM_CAPTURE, 0);
+		if (r < 0) {
+			aerror("snd_pcm_open", r);
+			return -1;
+		}
+		if (set_alsa_hw(tx.snd, rate, tx.channels, buffer * 1000,
+				access, &format) == -1)
+		{
+			return -1;
+		}
+		if (set_alsa_sw(tx.snd) == -1)
+			return -1;
+	}
+
+	if (tx_stream_init(&tx.stream, tx.channels, tx.frame,
+				tx.bytes_per_frame, format) == -1)
+	{
 		return -1;
+	}
+	tx.stream.mmap = (access == SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	tx.stream.backend = backend;
+
+	if (stats_name) {
+		stats = stats_new(stats_name, 0);
+		if (stats == NULL)
+			return -1;
+		stats_set(&stats->tx.kbps, kbps);
+		tx.stream.stats = stats;
+	}
 
 	if (pid)
 		go_daemon(pid);
 
+	lock_memory();
 	go_realtime();
 	r = (long)run_tx(&tx);
 
-	if (snd_pcm_close(tx.snd) < 0)
+	if (tx.snd && snd_pcm_close(tx.snd) < 0)
 		abort();
+	if (backend)
+		backend_close(backend);
 
-	rtp_session_destroy(tx.sessions[0]);
+	if (tx.fanout)
+		fanout_free(tx.fanout);
+	else
+		rtp_session_destroy(tx.sessions[0]);
 	ortp_exit();
 	ortp_global_stats_display();
 
-	opus_encoder_destroy(tx.encoder);
+	if (stats)
+		stats_free(stats, stats_name);
+
+	opus_multistream_encoder_destroy(tx.encoder);
+	tx_stream_clear(&tx.stream);
 
 	return r;
 }
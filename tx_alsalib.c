@@ -1,29 +1,288 @@
 #include "tx_alsalib.h"
 #include "device.h"
+#include "format.h"
+
+int tx_stream_init(struct tx_stream *stream,
+		const unsigned int channels,
+		const snd_pcm_uframes_t samples,
+		const size_t bytes_per_frame,
+		const snd_pcm_format_t format)
+{
+	stream->ts = 0;
+	stream->format = format;
+	stream->work = NULL;
+	stream->stats = NULL;
+	stream->backend = NULL;
+	stream->stamped = false;
+
+	stream->pcm = alloc_pcm(format_bytes(format) * samples * channels);
+	if (stream->pcm == NULL)
+		return -1;
+
+	stream->packet = alloc_pcm(bytes_per_frame);
+	if (stream->packet == NULL) {
+		free(stream->pcm);
+		return -1;
+	}
+
+	if (format_needs_conversion(format)) {
+		stream->work = alloc_pcm(sizeof(float) * samples * channels);
+		if (stream->work == NULL) {
+			free(stream->pcm);
+			free(stream->packet);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void tx_stream_clear(struct tx_stream *stream)
+{
+	free(stream->pcm);
+	free(stream->work);
+	free(stream->packet);
+}
+
+/*
+ * Have the encoder carry a low bitrate copy of each frame in the
+ * next (in-band FEC), if packet loss of 'loss' percent is expected.
+ * Opus only does this in its SILK and hybrid modes, which need
+ * frames of at least 10ms and a modest bitrate
+ */
+
+int set_opus_fec(OpusMSEncoder *encoder, const unsigned int loss)
+{
+	int r;
+
+	r = opus_multistream_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(loss > 0));
+	if (r != OPUS_OK) {
+		fprintf(stderr, "OPUS_SET_INBAND_FEC: %s\n", opus_strerror(r));
+		return -1;
+	}
+
+	r = opus_multistream_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(loss));
+	if (r != OPUS_OK) {
+		fprintf(stderr, "OPUS_SET_PACKET_LOSS_PERC: %s\n",
+				opus_strerror(r));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Encode a frame of audio in the device format, to 'packet'
+ */
+
+opus_int32 encode_one_frame(OpusMSEncoder *encoder,
+		const void *pcm,
+		const unsigned int channels,
+		const snd_pcm_uframes_t samples,
+		const size_t bytes_per_frame,
+		struct tx_stream *stream)
+{
+	opus_int32 z;
+	unsigned long start = stats_now();
+
+	if (!format_is_float(stream->format)) {
+		z = opus_multistream_encode(encoder, pcm, samples, stream->packet,
+				bytes_per_frame);
+	} else {
+		if (format_needs_conversion(stream->format)) {
+			format_to_float(stream->format, stream->work, pcm,
+					samples * channels);
+			pcm = stream->work;
+		}
+
+		z = opus_multistream_encode_float(encoder, pcm, samples, stream->packet,
+				bytes_per_frame);
+	}
+
+	stream->encode_ns = stats_now() - start;
+	if (stream->stats)
+		stats_hist_add(&stream->stats->tx.encode_ns, stream->encode_ns);
+
+	return z;
+}
+
+/*
+ * Note when the oldest sample of the frame was captured: 'held'
+ * frames ago, less any still waiting in the buffer, from the time
+ * of the device's last update
+ */
+
+static void captured(snd_pcm_t *snd, snd_pcm_uframes_t held,
+		struct tx_stream *stream)
+{
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t t;
+
+	if (!stream->stamped)
+		return;
+
+	if (snd == NULL || snd_pcm_htimestamp(snd, &avail, &t) < 0 ||
+		(t.tv_sec == 0 && t.tv_nsec == 0))
+	{
+		stream->captured = stats_now() - held * 1000000000UL / stream->rate;
+		return;
+	}
+
+	stream->captured = t.tv_sec * 1000000000UL + t.tv_nsec
+		- (avail + held) * 1000000000UL / stream->rate;
+}
+
+/*
+ * Pass the frame's timing to the sender; microseconds, saturated
+ */
+
+static void stamp_frame(struct fanout *fanout, const struct tx_stream *stream)
+{
+	unsigned long capture, encode;
+
+	capture = (stats_now() - stream->captured) / 1000;
+	encode = stream->encode_ns / 1000;
+	capture = capture > encode ? capture - encode : 0;
+
+	fanout->capture_us = capture < UINT16_MAX ? capture : UINT16_MAX;
+	fanout->encode_us = encode < UINT16_MAX ? encode : UINT16_MAX;
+}
+
+/*
+ * Count a capture xrun, or other error being recovered from
+ */
+
+static void xrun(struct tx_stream *stream)
+{
+	if (stream->stats)
+		stats_add(&stream->stats->tx.xruns, 1);
+}
+
+/*
+ * Encode straight from the device's buffer where the frame does not
+ * wrap; otherwise copy it out as usual. Return the encoded length,
+ * or 0 if the frame was lost to an xrun
+ */
+
+static ssize_t encode_mmap(snd_pcm_t *snd,
+		const unsigned int channels,
+		const snd_pcm_uframes_t samples,
+		OpusMSEncoder *encoder,
+		const size_t bytes_per_frame,
+		struct tx_stream *stream)
+{
+	int r;
+	void *buf;
+	ssize_t z;
+	snd_pcm_uframes_t offset;
+	snd_pcm_sframes_t f;
+
+	r = pcm_mmap_wait(snd, samples);
+	if (r < 0)
+		goto recover;
+	captured(snd, 0, stream);
+
+	r = pcm_mmap_begin(snd, samples, &buf, &offset);
+	if (r < 0)
+		goto recover;
+
+	if (r == 1) {
+		z = encode_one_frame(encoder, buf, channels, samples,
+				bytes_per_frame, stream);
+
+		r = pcm_mmap_commit(snd, offset, samples);
+		if (r < 0)
+			goto recover;
+	} else {
+		f = snd_pcm_mmap_readi(snd, stream->pcm, samples);
+		if (f < 0) {
+			r = f;
+			goto recover;
+		}
+		if (f < samples) {
+			fprintf(stderr, "Short read, %ld\n", f);
+			return 0;
+		}
+
+		z = encode_one_frame(encoder, stream->pcm, channels, samples,
+				bytes_per_frame, stream);
+	}
+
+	if (z < 0) {
+		fprintf(stderr, "opus_multistream_encode: %s\n",
+				opus_strerror(z));
+		return -1;
+	}
+
+	return z;
+
+recover:
+	xrun(stream);
+	if (r == -ESTRPIPE)
+		stream->ts = 0;
+
+	r = snd_pcm_recover(snd, r, 0);
+	if (r < 0) {
+		aerror("snd_pcm_mmap_begin", r);
+		return -1;
+	}
+	return 0;
+}
+
+static void publish_tx(struct stats *st, const struct fanout *fanout,
+		unsigned long ns)
+{
+	unsigned int n;
+
+	stats_add(&st->tx.frames, 1);
+	stats_hist_add(&st->tx.send_ns, ns);
+
+	if (fanout == NULL)
+		return;
+
+	for (n = 0; n < fanout->nr_peers && n < st->nr_peers; n++) {
+		if (slot_get(&fanout->peer[n].state) != SLOT_ACTIVE)
+			continue;
+		stats_set(&st->peer[n].sent, fanout->peer[n].sent);
+		stats_set(&st->peer[n].send_failed, fanout->peer[n].failed);
+	}
+}
 
 int send_one_frame(snd_pcm_t *snd,
 		const unsigned int channels,
 		const snd_pcm_uframes_t samples,
-		OpusEncoder *encoder,
+		OpusMSEncoder *encoder,
 		const size_t bytes_per_frame,
 		const unsigned int ts_per_frame,
 		const int nr_sessions,
-		RtpSession **sessions)
+		RtpSession **sessions,
+		struct fanout *fanout,
+		struct tx_stream *stream)
 {
 	int i;
-	int16_t *pcm;
-	void *packet;
 	ssize_t z;
+	unsigned long start;
 	snd_pcm_sframes_t f;
-	static unsigned int ts = 0;
 
-	pcm = alloca(sizeof(*pcm) * samples * channels);
-	packet = alloca(bytes_per_frame);
+	if (stream->mmap) {
+		z = encode_mmap(snd, channels, samples, encoder,
+				bytes_per_frame, stream);
+		if (z <= 0)
+			return z;
+		goto send;
+	}
 
-	f = snd_pcm_readi(snd, pcm, samples);
+	if (stream->backend) {
+		f = backend_read(stream->backend, stream->pcm, samples);
+		if (f < 0)
+			return -1;
+	} else {
+		f = snd_pcm_readi(snd, stream->pcm, samples);
+	}
 	if (f < 0) {
+		xrun(stream);
 		if (f == -ESTRPIPE)
-			ts = 0;
+			stream->ts = 0;
 
 		f = snd_pcm_recover(snd, f, 0);
 		if (f < 0) {
@@ -41,17 +300,34 @@ int send_one_frame(snd_pcm_t *snd,
 		fprintf(stderr, "Short read, %ld\n", f);
 		return 0;
 	}
+	captured(stream->backend ? NULL : snd, samples, stream);
 
-	z = opus_encode(encoder, pcm, samples, packet, bytes_per_frame);
+	z = encode_one_frame(encoder, stream->pcm, channels, samples,
+			bytes_per_frame, stream);
 	if (z < 0) {
-		fprintf(stderr, "opus_encode_float: %s\n", opus_strerror(z));
+		fprintf(stderr, "opus_multistream_encode_float: %s\n",
+				opus_strerror(z));
 		return -1;
 	}
 
-	for (i = 0; i < nr_sessions; i++) {
-		rtp_session_send_with_ts(sessions[i], packet, z, ts);
+send:
+	start = stats_now();
+
+	if (fanout) {
+		if (stream->stamped)
+			stamp_frame(fanout, stream);
+		fanout_send(fanout, stream->packet, z, stream->ts);
+	} else {
+		for (i = 0; i < nr_sessions; i++) {
+			rtp_session_send_with_ts(sessions[i], stream->packet, z,
+					stream->ts);
+		}
 	}
-	ts += ts_per_frame;
+	stream->ts += ts_per_frame;
+	stream->send_ns = stats_now() - start;
+
+	if (stream->stats)
+		publish_tx(stream->stats, fanout, stream->send_ns);
 
 	return 0;
 }
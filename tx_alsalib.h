@@ -1,17 +1,64 @@
 #ifndef TX_ALSALIB_H
 #define TX_ALSALIB_H
 
+#include <stdbool.h>
 #include <alsa/asoundlib.h>
-#include <opus/opus.h>
+#include <opus/opus_multistream.h>
 #include <ortp/ortp.h>
 
+#include "backend.h"
+#include "fanout.h"
+#include "stats.h"
+
+/*
+ * State of one encoded stream, so that sending a frame needs no
+ * allocation. Audio is captured to 'pcm' in the device format and,
+ * if that is not a working format (see format.h), converted to
+ * 'work'
+ */
+
+struct tx_stream {
+	void *pcm, *work;
+	snd_pcm_format_t format;
+	unsigned char *packet;
+	unsigned int ts;
+	bool mmap; /* device uses SND_PCM_ACCESS_MMAP_INTERLEAVED */
+	struct stats *stats; /* if given */
+	struct backend *backend; /* in place of the device, if given */
+
+	/* Timing of the frame being sent, for stamp.h and framebench */
+
+	bool stamped;
+	unsigned int rate; /* if stamped */
+	unsigned long captured; /* oldest sample, see stats_now() */
+	unsigned long encode_ns, send_ns;
+};
+
+int tx_stream_init(struct tx_stream *stream,
+		const unsigned int channels,
+		const snd_pcm_uframes_t samples,
+		const size_t bytes_per_frame,
+		const snd_pcm_format_t format);
+void tx_stream_clear(struct tx_stream *stream);
+
+int set_opus_fec(OpusMSEncoder *encoder, const unsigned int loss);
+
+opus_int32 encode_one_frame(OpusMSEncoder *encoder,
+		const void *pcm,
+		const unsigned int channels,
+		const snd_pcm_uframes_t samples,
+		const size_t bytes_per_frame,
+		struct tx_stream *stream);
+
 int send_one_frame(snd_pcm_t *snd,
 		const unsigned int channels,
 		const snd_pcm_uframes_t samples,
-		OpusEncoder *encoder,
+		OpusMSEncoder *encoder,
 		const size_t bytes_per_frame,
 		const unsigned int ts_per_frame,
 		const int nr_sessions,
-		RtpSession **sessions);
+		RtpSession **sessions,
+		struct fanout *fanout,
+		struct tx_stream *stream);
 
 #endif
@@ -10,10 +10,18 @@ void *run_tx(struct tx_args *tx)
 
 		r = send_one_frame(tx->snd, tx->channels, tx->frame,
 				tx->encoder, tx->bytes_per_frame, tx->ts_per_frame,
-				tx->nr_sessions, tx->sessions);
+				tx->nr_sessions, tx->sessions, tx->fanout,
+				&tx->stream);
 		if (r == -1)
 			return (void *)-1;
 
+		if (tx->adapt) {
+			if (adapt_frame(tx->adapt, tx->encoder) == -1)
+				return (void *)-1;
+			if (tx->stream.stats)
+				stats_set(&tx->stream.stats->tx.kbps, tx->adapt->kbps);
+		}
+
 		if (verbose > 1)
 			fputc('>', stderr);
 	}
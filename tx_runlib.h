@@ -2,19 +2,25 @@
 #define TX_RUNLIB_H
 
 #include <alsa/asoundlib.h>
-#include <opus/opus.h>
+#include <opus/opus_multistream.h>
 #include <ortp/ortp.h>
 
+#include "adapt.h"
+#include "tx_alsalib.h"
+
 struct tx_args
 {
 	snd_pcm_t *snd;
 	unsigned int channels;
 	snd_pcm_uframes_t frame;
-	OpusEncoder *encoder;
+	OpusMSEncoder *encoder;
 	size_t bytes_per_frame;
 	unsigned int ts_per_frame;
 	int nr_sessions;
 	RtpSession **sessions;
+	struct fanout *fanout; /* if given, used in place of sessions */
+	struct adapt *adapt; /* if given, bitrate follows peers' loss */
+	struct tx_stream stream;
 };
 
 void *run_tx(struct tx_args *args);